@@ -0,0 +1,454 @@
+// Engine benchmarks: `make bench`
+//
+// Times the fused decode -> EQ -> encode kernels for every bit depth,
+// a spread of channel counts and chain lengths up to a 31-band graphic
+// EQ in both precisions, then sweeps the chunk size, checks the blocked
+// mono kernels against the serial ones (failing if they are out of
+// tolerance), times the convolver per partition length and the
+// resampler per quality, and measures how much a coefficient redesign
+// costs. Nothing here touches ALSA or a terminal.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "biquad.h"
+#include "conv.h"
+#include "dsp.h"
+#include "resample.h"
+
+// Same as CHUNK_FRAMES in player.c
+#define BENCH_CHUNK 4096
+// Frames per timed pass; large enough to leave the L2 cache
+#define BENCH_FRAMES (1 << 18)
+#define BENCH_RUNS 5
+#define BENCH_RATE 48000
+// Bands in the redesign tests
+#define BENCH_BANDS 3
+// Impulse response length in the convolution tests, about 1.4 s
+#define BENCH_TAPS 65536
+// How far the blocked mono kernels may stray from the serial double
+// kernel, as documented in dsp.c: the 32-bit output's step in double,
+// -120 dB in float, and for float bass bands a multiple of the serial
+// float kernel's own error
+#define BENCH_TOL_DOUBLE 3.5e-8
+#define BENCH_TOL_FLOAT 1e-6
+#define BENCH_TOL_BASS 2.0
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_fill(uint8_t *buf, size_t size)
+{
+	uint32_t x = 0x12345678;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		x = x * 1664525u + 1013904223u;
+		buf[i] = x >> 24;
+	}
+}
+
+// Up to three mixed bands, all off the flat and low-frequency paths;
+// longer chains are a graphic EQ with every third-octave band boosted
+// or cut
+static void
+bench_chain(
+		BiquadChain *chain,
+		int stages,
+		int channels,
+		int rate,
+		enum BiquadPrecision precision)
+{
+	BiquadInfo bands[BQ_ISO_BANDS] = {
+		{ BQ_PEAKING, { 1000.0f, 1.0f, 3.0f } },
+		{ BQ_HIGHSHELF, { 8000.0f, 0.7f, -2.0f } },
+		{ BQ_LOWPASS, { 18000.0f, 0.7f, 0.0f } },
+	};
+
+	if (stages > BQ_UNROLL_STAGES)
+	{
+		for (int b = 0; b < stages; b++)
+		{
+			bands[b].type = BQ_PEAKING;
+			bands[b].args[0] = bq_iso_freq(b);
+			bands[b].args[1] = 4.32f;
+			bands[b].args[2] = (b & 1) ? -3.0f : 3.0f;
+		}
+	}
+
+	bq_chain_update(chain, bands, stages, channels, rate, precision);
+}
+
+// Largest difference, as a fraction of full scale, between a mono
+// 32-bit kernel and the serial kernel in double precision over the same
+// input. `serial` picks the serial kernel at `precision` instead of the
+// blocked one; dsp_select() only hands it out for mono while a ramp
+// runs, so a ramp is pretended for the call.
+static double
+bench_mono_error(
+		const uint8_t *in,
+		uint8_t *ref,
+		uint8_t *out,
+		size_t frames,
+		int stages,
+		enum BiquadPrecision precision,
+		int serial,
+		BiquadChain *chain)
+{
+	bench_chain(chain, stages, 1, BENCH_RATE, BQ_DOUBLE);
+	bq_chain_reset(chain);
+	chain->ramp_left = 1;
+	DspKernel kernel = dsp_select(32, 1, chain);
+	chain->ramp_left = 0;
+
+	for (size_t done = 0; done < frames; done += BENCH_CHUNK)
+	{
+		size_t n = (frames - done > BENCH_CHUNK) ? BENCH_CHUNK : frames - done;
+		kernel(in + done * 4, ref + done * 4, n, chain);
+	}
+
+	bench_chain(chain, stages, 1, BENCH_RATE, precision);
+	bq_chain_reset(chain);
+	chain->ramp_left = serial;
+	kernel = dsp_select(32, 1, chain);
+	chain->ramp_left = 0;
+
+	for (size_t done = 0; done < frames; done += BENCH_CHUNK)
+	{
+		size_t n = (frames - done > BENCH_CHUNK) ? BENCH_CHUNK : frames - done;
+		kernel(in + done * 4, out + done * 4, n, chain);
+	}
+
+	int64_t worst = 0;
+	for (size_t i = 0; i < frames; i++)
+	{
+		int32_t a, b;
+		memcpy(&a, ref + i * 4, 4);
+		memcpy(&b, out + i * 4, 4);
+
+		int64_t d = (int64_t) a - b;
+		if (d < 0) { d = -d; }
+		if (d > worst) { worst = d; }
+	}
+
+	return worst / 2147483648.0;
+}
+
+// Best-of-BENCH_RUNS ns per frame for one kernel over `frames` frames
+// handled `chunk` frames at a time
+static double
+bench_kernel(
+		const uint8_t *in,
+		uint8_t *out,
+		size_t frames,
+		size_t chunk,
+		int bps,
+		int channels,
+		BiquadChain *chain)
+{
+	const size_t frame_size = bps / 8 * channels;
+	DspKernel kernel = dsp_select(bps, channels, chain);
+	double best = 0.0;
+
+	for (int run = 0; run < BENCH_RUNS; run++)
+	{
+		double start = bench_now();
+
+		for (size_t done = 0; done < frames; done += chunk)
+		{
+			size_t n = (frames - done > chunk) ? chunk : frames - done;
+			kernel(in + done * frame_size, out + done * frame_size, n, chain);
+		}
+
+		double t = (bench_now() - start) * 1e9 / frames;
+		if (run == 0 || t < best) { best = t; }
+	}
+
+	return best;
+}
+
+int
+main(void)
+{
+	static const int depths[] = { 16, 24, 32 };
+	static const int layouts[] = { 1, 2, 6, 8 };
+	static const int lengths[] = { 0, 1, 2, 3, 8, BQ_ISO_BANDS };
+	static const char *names[] = { [BQ_FLOAT] = "float", [BQ_DOUBLE] = "double" };
+
+	const size_t max_bytes = (size_t) BENCH_FRAMES * 4 * BQ_MAX_CHANNELS;
+	uint8_t *in = malloc(max_bytes);
+	uint8_t *out = malloc(max_bytes);
+	BiquadChain *chain = bq_chain_new(BQ_ISO_BANDS);
+
+	if (!in || !out || !chain)
+	{
+		fprintf(stderr, "Failed to allocate benchmark buffers.\n");
+		return EXIT_FAILURE;
+	}
+
+	bench_fill(in, max_bytes);
+	bq_denormals_off();
+
+	// ----- KERNELS ----- //
+	printf("%-4s %-3s %-7s %-7s %12s %10s %10s\n",
+			"bps", "ch", "filters", "prec", "Msamples/s", "ns/frame", "x realtime");
+
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+	{
+		for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+		{
+			for (size_t n = 0; n < sizeof(lengths) / sizeof(lengths[0]); n++)
+			{
+				const int stages = lengths[n];
+
+				for (int p = BQ_FLOAT; p <= BQ_DOUBLE; p++)
+				{
+					// Passthrough does not depend on the precision
+					if (stages == 0 && p == BQ_DOUBLE) { continue; }
+
+					bench_chain(chain, stages, layouts[l], BENCH_RATE, p);
+					double ns = bench_kernel(in, out, BENCH_FRAMES, BENCH_CHUNK,
+							depths[d], layouts[l], chain);
+
+					printf("%-4d %-3d %-7d %-7s %12.1f %10.2f %10.0f\n",
+							depths[d], layouts[l], stages,
+							stages ? names[p] : "-",
+							layouts[l] * 1e3 / ns,
+							ns,
+							1e9 / (ns * BENCH_RATE));
+				}
+			}
+		}
+	}
+
+	// ----- CHUNK SIZE ----- //
+	printf("\nchunk sweep, 24-bit stereo, %d float filters\n", BENCH_BANDS);
+	printf("%-7s %10s\n", "frames", "ns/frame");
+
+	for (size_t chunk = 64; chunk <= 65536; chunk *= 2)
+	{
+		bench_chain(chain, BENCH_BANDS, 2, BENCH_RATE, BQ_FLOAT);
+		printf("%-7zu %10.2f\n", chunk,
+				bench_kernel(in, out, BENCH_FRAMES, chunk, 24, 2, chain));
+	}
+
+	// ----- GRAPHIC EQ ----- //
+	// The case the long kernel is there for: 31 bands, 96 kHz stereo
+	printf("\n%d-band graphic EQ, 24-bit stereo at 96 kHz\n", BQ_ISO_BANDS);
+
+	for (int p = BQ_FLOAT; p <= BQ_DOUBLE; p++)
+	{
+		bench_chain(chain, BQ_ISO_BANDS, 2, 96000, p);
+		double ns = bench_kernel(in, out, BENCH_FRAMES, BENCH_CHUNK, 24, 2, chain);
+
+		printf("%-7s %10.2f ns/frame %10.0f x realtime\n",
+				names[p], ns, 1e9 / (ns * 96000));
+	}
+
+	// ----- BLOCKED MONO ----- //
+	// The blocked kernels reorder the serial recursion's roundings;
+	// these are the limits documented with them in dsp.c. Half-scale
+	// noise, so clipping does not hide a difference.
+	printf("\nblocked mono against serial double, 32-bit, max error\n");
+
+	const size_t acc_frames = BENCH_FRAMES / 4;
+	uint8_t *acc_in = malloc(acc_frames * 4);
+	uint8_t *acc_ref = malloc(acc_frames * 4);
+	uint8_t *acc_out = malloc(acc_frames * 4);
+	float *acc_f = malloc(acc_frames * sizeof(float));
+	if (!acc_in || !acc_ref || !acc_out || !acc_f)
+	{
+		fprintf(stderr, "Failed to allocate benchmark buffers.\n");
+		return EXIT_FAILURE;
+	}
+
+	dsp_to_float(in, acc_f, acc_frames, DSP_S32);
+	for (size_t i = 0; i < acc_frames; i++) { acc_f[i] *= 0.5f; }
+	dsp_from_float(acc_f, acc_in, acc_frames, DSP_S32);
+
+	double err_d = bench_mono_error(acc_in, acc_ref, acc_out, acc_frames,
+			BENCH_BANDS, BQ_DOUBLE, 0, chain);
+	double err_f = bench_mono_error(acc_in, acc_ref, acc_out, acc_frames,
+			BENCH_BANDS, BQ_FLOAT, 0, chain);
+	double bass_serial = bench_mono_error(acc_in, acc_ref, acc_out, acc_frames,
+			BQ_ISO_BANDS, BQ_FLOAT, 1, chain);
+	double bass = bench_mono_error(acc_in, acc_ref, acc_out, acc_frames,
+			BQ_ISO_BANDS, BQ_FLOAT, 0, chain);
+
+	printf("%d bands, double   %10.2e (limit %.1e)\n", BENCH_BANDS, err_d, BENCH_TOL_DOUBLE);
+	printf("%d bands, float    %10.2e (limit %.1e)\n", BENCH_BANDS, err_f, BENCH_TOL_FLOAT);
+	printf("%d bands, float   %10.2e (serial %.2e, limit %.1fx)\n",
+			BQ_ISO_BANDS, bass, bass_serial, BENCH_TOL_BASS);
+
+	free(acc_in);
+	free(acc_ref);
+	free(acc_out);
+	free(acc_f);
+
+	if (err_d > BENCH_TOL_DOUBLE || err_f > BENCH_TOL_FLOAT ||
+		bass > BENCH_TOL_BASS * bass_serial)
+	{
+		fprintf(stderr, "Blocked mono kernels are outside their tolerance.\n");
+		return EXIT_FAILURE;
+	}
+
+	// ----- CONVOLUTION ----- //
+	// A decaying noise response, one shared by both channels
+	printf("\n%d-tap convolution, float stereo at %d Hz\n", BENCH_TAPS, BENCH_RATE);
+	printf("%-7s %10s %10s\n", "block", "ns/frame", "x realtime");
+
+	ConvIR ir = { malloc(BENCH_TAPS * sizeof(float)), BENCH_TAPS, 1, BENCH_RATE };
+	float *fbuf = malloc(BENCH_CHUNK * 2 * sizeof(float));
+	if (!ir.samples || !fbuf)
+	{
+		fprintf(stderr, "Failed to allocate benchmark buffers.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Scaled so the output, which is fed back in, stays in range
+	dsp_to_float(in, ir.samples, BENCH_TAPS, DSP_S16);
+	for (int i = 0; i < BENCH_TAPS; i++) { ir.samples[i] *= (1.0f - (float) i / BENCH_TAPS) / 128; }
+	dsp_to_float(in, fbuf, BENCH_CHUNK * 2, DSP_S16);
+
+	for (size_t block = CONV_MIN_BLOCK; block <= CONV_MAX_BLOCK; block *= 4)
+	{
+		Convolver *conv = conv_new(&ir, 2, block);
+		if (!conv)
+		{
+			fprintf(stderr, "Failed to allocate the convolver.\n");
+			return EXIT_FAILURE;
+		}
+
+		double best = 0.0;
+		for (int run = 0; run < BENCH_RUNS; run++)
+		{
+			double start = bench_now();
+
+			for (size_t done = 0; done < BENCH_RATE; done += block)
+				conv_process(conv, fbuf, block);
+
+			double t = (bench_now() - start) * 1e9 / BENCH_RATE;
+			if (run == 0 || t < best) { best = t; }
+		}
+
+		printf("%-7zu %10.2f %10.0f\n", block, best, 1e9 / (best * BENCH_RATE));
+		conv_free(conv);
+	}
+
+	free(ir.samples);
+
+	// ----- RESAMPLING ----- //
+	printf("\nresampling, float stereo, ns per output frame\n");
+	printf("%-14s %8s %8s %8s\n", "rates", "fast", "good", "best");
+
+	static const int rates[][2] = { { 44100, 48000 }, { 48000, 44100 }, { 96000, 48000 } };
+	static const int out_cap = 1024;
+	float *rs_out = malloc(out_cap * 2 * sizeof(float));
+	if (!rs_out)
+	{
+		fprintf(stderr, "Failed to allocate benchmark buffers.\n");
+		return EXIT_FAILURE;
+	}
+
+	for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+	{
+		printf("%6d>%-7d", rates[r][0], rates[r][1]);
+
+		for (int q = RS_FAST; q <= RS_BEST; q++)
+		{
+			Resampler *rs = rs_new(rates[r][0], rates[r][1], 2, q);
+			if (!rs)
+			{
+				fprintf(stderr, "Failed to allocate the resampler.\n");
+				return EXIT_FAILURE;
+			}
+
+			double best = 0.0;
+			for (int run = 0; run < BENCH_RUNS; run++)
+			{
+				size_t made = 0;
+				double start = bench_now();
+
+				// The same input over and over; it only has to be there
+				for (size_t done = 0; done < BENCH_RATE; done += BENCH_CHUNK / 4)
+				{
+					size_t used;
+					made += rs_process(rs, fbuf, BENCH_CHUNK / 4, &used, rs_out, out_cap);
+				}
+
+				double t = (bench_now() - start) * 1e9 / made;
+				if (run == 0 || t < best) { best = t; }
+			}
+
+			printf(" %8.2f", best);
+			rs_free(rs);
+		}
+		printf("\n");
+	}
+
+	free(rs_out);
+	free(fbuf);
+
+	// ----- REDESIGN ----- //
+	enum { DESIGNS = 20000 };
+	BiquadInfo bands[BENCH_BANDS] = {
+		{ BQ_PEAKING, { 1000.0f, 1.0f, 3.0f } },
+		{ BQ_LOWSHELF, { 300.0f, 0.7f, 2.0f } },
+		{ BQ_HIGHSHELF, { 8000.0f, 0.7f, -2.0f } },
+	};
+	double start;
+
+	printf("\nredesign, %d stereo bands\n", BENCH_BANDS);
+
+	// A new gain every time: band 0 misses the cache, the rest hit
+	start = bench_now();
+	for (int i = 0; i < DESIGNS; i++)
+	{
+		bands[0].args[2] = 3.0f + i * 1e-4f;
+		bq_chain_update(chain, bands, BENCH_BANDS, 2, BENCH_RATE, BQ_FLOAT);
+	}
+	printf("%-28s %10.1f ns\n", "update, one band designed", (bench_now() - start) * 1e9 / DESIGNS);
+
+	start = bench_now();
+	for (int i = 0; i < DESIGNS; i++)
+	{
+		bq_chain_update(chain, bands, BENCH_BANDS, 2, BENCH_RATE, BQ_FLOAT);
+	}
+	printf("%-28s %10.1f ns\n", "update, all bands cached", (bench_now() - start) * 1e9 / DESIGNS);
+
+	// What a key press costs the audio thread: one band, then its ramp
+	start = bench_now();
+	for (int i = 0; i < DESIGNS; i++)
+	{
+		bands[0].args[2] = 6.0f + i * 1e-4f;
+		bq_chain_retarget(chain, bands, BENCH_BANDS, BQ_FLOAT);
+	}
+	printf("%-28s %10.1f ns\n", "retarget one band", (bench_now() - start) * 1e9 / DESIGNS);
+
+	start = bench_now();
+	for (int i = 0; i < DESIGNS; i++)
+	{
+		chain->ramp_left = BQ_RAMP_FRAMES;
+		while (chain->ramp_left > 0)
+			bq_chain_ramp(chain, BQ_RAMP_BLOCK);
+	}
+	printf("%-28s %10.1f ns\n", "full coefficient ramp", (bench_now() - start) * 1e9 / DESIGNS);
+
+	size_t hits, misses;
+	bq_cache_stats(&hits, &misses);
+	printf("coefficient cache: %zu hits, %zu misses\n", hits, misses);
+
+	free(in);
+	free(out);
+	bq_chain_free(chain);
+	return EXIT_SUCCESS;
+}
@@ -1,11 +1,17 @@
 #include "biquad.h"
 
 #include <math.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 
 // amplitude over time -> amplitude over frequency -> amplitude over time
 // decouple the frequencies
@@ -18,7 +24,77 @@
 
 void bq_reset(Biquad *bq) { memset(&bq->x1, 0, 4 * sizeof(double)); }
 
+// ------------------------------- //
+// --------- PRESET TRIG --------- //
+// ------------------------------- //
+
+// ISO 266 third-octave centres, what preset EQ files are written in
+static const float bq_iso_freqs[BQ_ISO_BANDS] = {
+	20, 25, 31.5, 40, 50, 63, 80, 100, 125, 160,
+	200, 250, 315, 400, 500, 630, 800, 1000, 1250, 1600,
+	2000, 2500, 3150, 4000, 5000, 6300, 8000, 10000, 12500, 16000,
+	20000,
+};
+#define BQ_ISO_COUNT BQ_ISO_BANDS
+
+float
+bq_iso_freq(int band)
+{
+	return (band >= 0 && band < BQ_ISO_BANDS) ? bq_iso_freqs[band] : 0.0f;
+}
+
+static const int bq_preset_rates[] = { 44100, 48000, 88200, 96000 };
+#define BQ_RATE_COUNT (sizeof(bq_preset_rates) / sizeof(bq_preset_rates[0]))
+
+static double bq_preset_sin[BQ_RATE_COUNT][BQ_ISO_COUNT];
+static double bq_preset_cos[BQ_RATE_COUNT][BQ_ISO_COUNT];
+static uint8_t bq_presets_ready = 0;
+
+void
+bq_presets_init(void)
+{
+	for (size_t r = 0; r < BQ_RATE_COUNT; r++)
+	{
+		for (size_t f = 0; f < BQ_ISO_COUNT; f++)
+		{
+			const double w0 = 2.0 * M_PI * bq_iso_freqs[f] / bq_preset_rates[r];
+			bq_preset_sin[r][f] = sin(w0);
+			bq_preset_cos[r][f] = cos(w0);
+		}
+	}
+
+	bq_presets_ready = 1;
+}
+
+// sin and cos of w0, from the preset table when f0 and fs are in it
+static void
+bq_trig(float f0, float fs, double *sn, double *cs)
+{
+	for (size_t r = 0; bq_presets_ready && r < BQ_RATE_COUNT; r++)
+	{
+		if (bq_preset_rates[r] != fs)
+			continue;
+
+		for (size_t f = 0; f < BQ_ISO_COUNT; f++)
+		{
+			if (bq_iso_freqs[f] == f0)
+			{
+				*sn = bq_preset_sin[r][f];
+				*cs = bq_preset_cos[r][f];
+				return;
+			}
+		}
+		break;
+	}
+
+	const double w0 = 2.0 * M_PI * f0 / fs;
+	*sn = sin(w0);
+	*cs = cos(w0);
+}
+
 /*** AUDIO EQ COOKBOOK ***/
+// Designed in double so the double-precision chain gets exact
+// coefficients; the float chain rounds them once when broadcasting.
 void
 bq_peaking(
 		Biquad *bq,
@@ -27,27 +103,26 @@ bq_peaking(
 		float fs,
 		float q)
 {
-	const float A = powf(10.0f, db_gain / 40.0f);
-	const float w0 = 2 * M_PI * f0 / fs;
-	const float sn = sinf(w0), cs = cosf(w0);
-	const float alpha = sn / (2.0f * q);
+	const double A = pow(10.0f, db_gain / 40.0f);
+	double sn, cs;
+	bq_trig(f0, fs, &sn, &cs);
+	const double alpha = sn / (2.0f * q);
 
-	const float alpha_A = alpha * A;
-	const float alpha_dA = alpha / A;
+	const double alpha_A = alpha * A;
+	const double alpha_dA = alpha / A;
 
-	const float b0 = 1.0f + alpha_A;
-	const float b1 = -2.0f * cs;
-	const float b2 = 1.0f - alpha_A;
-	const float a0 = 1.0f + alpha_dA;
-	const float a1 = b1;
-	const float a2 = 1.0f - alpha_dA;
+	const double b0 = 1.0f + alpha_A;
+	const double b1 = -2.0f * cs;
+	const double b2 = 1.0f - alpha_A;
+	const double a0 = 1.0f + alpha_dA;
+	const double a1 = b1;
+	const double a2 = 1.0f - alpha_dA;
 
 	bq->a0 = b0 / a0;
 	bq->a1 = b1 / a0;
 	bq->a2 = b2 / a0;
 	bq->a3 = a1 / a0;
 	bq->a4 = a2 / a0;
-	bq_reset(bq);
 }
 
 void
@@ -58,26 +133,25 @@ bq_lowshelf(
 		float fs,
 		float q)
 {
-	const float A = powf(10.0f, db_gain / 40.0f);
-	const float w0 = 2.0f * M_PI * f0 / fs;
-	const float sn = sinf(w0), cs = cosf(w0);
-	const float alpha = sn / (2.0f * q);
+	const double A = pow(10.0f, db_gain / 40.0f);
+	double sn, cs;
+	bq_trig(f0, fs, &sn, &cs);
+	const double alpha = sn / (2.0f * q);
 
-	const float beta = 2.0f * sqrtf(A) * alpha;
+	const double beta = 2.0f * sqrt(A) * alpha;
 
-	const float b0 = A * ((A + 1.0f) - (A - 1.0f) * cs + beta);
-	const float b1 = 2.0f * A * ((A - 1.0f) - (A + 1.0f) * cs);
-	const float b2 = A * ((A + 1.0f) - (A - 1.0f) * cs - beta);
-	const float a0 = (A + 1.0f) + (A - 1.0f) * cs + beta;
-	const float a1 = -2.0f * ((A - 1.0f) + (A + 1.0f) * cs);
-	const float a2 = (A + 1.0f) + (A - 1.0f) * cs - beta;
+	const double b0 = A * ((A + 1.0f) - (A - 1.0f) * cs + beta);
+	const double b1 = 2.0f * A * ((A - 1.0f) - (A + 1.0f) * cs);
+	const double b2 = A * ((A + 1.0f) - (A - 1.0f) * cs - beta);
+	const double a0 = (A + 1.0f) + (A - 1.0f) * cs + beta;
+	const double a1 = -2.0f * ((A - 1.0f) + (A + 1.0f) * cs);
+	const double a2 = (A + 1.0f) + (A - 1.0f) * cs - beta;
 
 	bq->a0 = b0 / a0;
 	bq->a1 = b1 / a0;
 	bq->a2 = b2 / a0;
 	bq->a3 = a1 / a0;
 	bq->a4 = a2 / a0;
-	bq_reset(bq);
 }
 
 void
@@ -88,26 +162,25 @@ bq_highshelf(
 		float fs,
 		float q)
 {
-	const float A = powf(10.0f, db_gain / 40.0f);
-	const float w0 = 2.0f * M_PI * f0 / fs;
-	const float sn = sinf(w0), cs = cosf(w0);
-	const float alpha = sn / (2.0f * q);
+	const double A = pow(10.0f, db_gain / 40.0f);
+	double sn, cs;
+	bq_trig(f0, fs, &sn, &cs);
+	const double alpha = sn / (2.0f * q);
 
-	const float beta = 2 * sqrtf(A) * alpha;
+	const double beta = 2 * sqrt(A) * alpha;
 
-	const float b0 = A * ((A + 1.0f) + (A - 1.0f) * cs + beta);
-	const float b1 = 2.0f * A * ((A - 1.0f) + (A + 1.0f) * cs);
-	const float b2 = A * ((A + 1.0f) + (A - 1.0f) * cs - beta);
-	const float a0 = (A + 1.0f) - (A - 1.0f) * cs + beta;
-	const float a1 = -2.0f * ((A - 1.0f) - (A + 1.0f) * cs);
-	const float a2 = (A + 1.0f) - (A - 1.0f) * cs - beta;
+	const double b0 = A * ((A + 1.0f) + (A - 1.0f) * cs + beta);
+	const double b1 = 2.0f * A * ((A - 1.0f) + (A + 1.0f) * cs);
+	const double b2 = A * ((A + 1.0f) + (A - 1.0f) * cs - beta);
+	const double a0 = (A + 1.0f) - (A - 1.0f) * cs + beta;
+	const double a1 = -2.0f * ((A - 1.0f) - (A + 1.0f) * cs);
+	const double a2 = (A + 1.0f) - (A - 1.0f) * cs - beta;
 
 	bq->a0 = b0 / a0;
 	bq->a1 = b1 / a0;
 	bq->a2 = b2 / a0;
 	bq->a3 = a1 / a0;
 	bq->a4 = a2 / a0;
-	bq_reset(bq);
 }
 
 void
@@ -117,23 +190,22 @@ bq_lowpass(
 		float fs,
 		float q)
 {
-	const float w0 = 2.0f * M_PI * f0 / fs;
-	const float sn = sinf(w0), cs = cosf(w0);
-	const float alpha = sn / (2.0f * q);
+	double sn, cs;
+	bq_trig(f0, fs, &sn, &cs);
+	const double alpha = sn / (2.0f * q);
 
-	const float b0 = (1.0f - cs) / 2.0f;
-	const float b1 = 1.0f - cs;
-	const float b2 = (1.0f - cs) / 2.0f;
-	const float a0 = 1.0f + alpha;
-	const float a1 = -2.0f * cs;
-	const float a2 = 1.0f - alpha;
+	const double b0 = (1.0f - cs) / 2.0f;
+	const double b1 = 1.0f - cs;
+	const double b2 = (1.0f - cs) / 2.0f;
+	const double a0 = 1.0f + alpha;
+	const double a1 = -2.0f * cs;
+	const double a2 = 1.0f - alpha;
 
 	bq->a0 = b0 / a0;
 	bq->a1 = b1 / a0;
 	bq->a2 = b2 / a0;
 	bq->a3 = a1 / a0;
 	bq->a4 = a2 / a0;
-	bq_reset(bq);
 }
 
 void
@@ -143,75 +215,671 @@ bq_highpass(
 		float fs,
 		float q)
 {
-	const float w0 = 2.0f * M_PI * f0 / fs;
-	const float sn = sinf(w0), cs = cosf(w0);
-	const float alpha = sn / (2.0f * q);
+	double sn, cs;
+	bq_trig(f0, fs, &sn, &cs);
+	const double alpha = sn / (2.0f * q);
 
-	const float b0 = (1.0f + cs) / 2.0f;
-	const float b1 = -(1.0f + cs);
-	const float b2 = (1.0f + cs) / 2.0f;
-	const float a0 = 1.0f + alpha;
-	const float a1 = -2.0f * cs;
-	const float a2 = 1.0f - alpha;
+	const double b0 = (1.0f + cs) / 2.0f;
+	const double b1 = -(1.0f + cs);
+	const double b2 = (1.0f + cs) / 2.0f;
+	const double a0 = 1.0f + alpha;
+	const double a1 = -2.0f * cs;
+	const double a2 = 1.0f - alpha;
 
 	bq->a0 = b0 / a0;
 	bq->a1 = b1 / a0;
 	bq->a2 = b2 / a0;
 	bq->a3 = a1 / a0;
 	bq->a4 = a2 / a0;
-	bq_reset(bq);
+}
+
+static int
+bq_design(Biquad *bq, BiquadInfo *info, float fs)
+{
+	switch (info->type)
+	{
+	case BQ_PEAKING:
+		bq_peaking(bq, info->args[2], info->args[0], fs, info->args[1]);
+		break;
+	case BQ_LOWSHELF:
+		bq_lowshelf(bq, info->args[2], info->args[0], fs, info->args[1]);
+		break;
+	case BQ_HIGHSHELF:
+		bq_highshelf(bq, info->args[2], info->args[0], fs, info->args[1]);
+		break;
+	case BQ_LOWPASS:
+		bq_lowpass(bq, info->args[0], fs, info->args[1]);
+		break;
+	case BQ_HIGHPASS:
+		bq_highpass(bq, info->args[0], fs, info->args[1]);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+bq_denormals_off(void)
+{
+#if defined(__SSE__)
+	// FTZ (bit 15) and DAZ (bit 6)
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+#elif defined(__aarch64__)
+	uint64_t fpcr;
+	__asm__ volatile ("mrs %0, fpcr" : "=r" (fpcr));
+	fpcr |= 1 << 24; // FZ
+	__asm__ volatile ("msr fpcr, %0" : : "r" (fpcr));
+#endif
+}
+
+BiquadChain *
+bq_chain_new(int max_stages)
+{
+	if (max_stages < 1)
+		max_stages = 1;
+
+	const size_t n = max_stages;
+	const size_t frow = (n * sizeof(float[BQ_MAX_CHANNELS]) + 63) & ~(size_t) 63;
+	const size_t drow = (n * sizeof(double[BQ_MAX_CHANNELS]) + 63) & ~(size_t) 63;
+	const size_t head = (sizeof(BiquadChain) + 63) & ~(size_t) 63;
+
+	// Rows first so each starts on a cache line, then the bookkeeping
+	size_t rows_size = 7 * frow + 7 * drow +
+		n * (sizeof(BqBlockF) + sizeof(BqBlockD)) +
+		n * (sizeof(int) + sizeof(BiquadInfo) + 2 * sizeof(double[5]) + 1);
+	rows_size = (rows_size + 63) & ~(size_t) 63;
+
+	uint8_t *block = aligned_alloc(64, head + rows_size);
+	if (!block)
+		return NULL;
+
+	memset(block, 0, head + rows_size);
+
+	BiquadChain *chain = (BiquadChain *) block;
+	uint8_t *p = block + head;
+
+	chain->rows = p;
+	chain->rows_size = rows_size;
+	chain->max_stages = max_stages;
+
+#define BQ_CARVE(ROW, SIZE) \
+	do { chain->ROW = (void *) p; p += (SIZE); } while (0)
+
+	BQ_CARVE(b0, frow); BQ_CARVE(b1, frow); BQ_CARVE(b2, frow);
+	BQ_CARVE(a1, frow); BQ_CARVE(a2, frow);
+	BQ_CARVE(z1, frow); BQ_CARVE(z2, frow);
+	BQ_CARVE(db0, drow); BQ_CARVE(db1, drow); BQ_CARVE(db2, drow);
+	BQ_CARVE(da1, drow); BQ_CARVE(da2, drow);
+	BQ_CARVE(dz1, drow); BQ_CARVE(dz2, drow);
+	BQ_CARVE(blk, n * sizeof(BqBlockF));
+	BQ_CARVE(dblk, n * sizeof(BqBlockD));
+	BQ_CARVE(ramp_from, n * sizeof(double[5]));
+	BQ_CARVE(ramp_to, n * sizeof(double[5]));
+	BQ_CARVE(info, n * sizeof(BiquadInfo));
+	BQ_CARVE(band, n * sizeof(int));
+	BQ_CARVE(dying, n);
+
+#undef BQ_CARVE
+
+	chain->precision = BQ_FLOAT;
+	return chain;
+}
+
+void
+bq_chain_free(BiquadChain *chain)
+{
+	free(chain);
+}
+
+void
+bq_chain_reset(BiquadChain *chain)
+{
+	const size_t n = chain->max_stages;
+
+	memset(chain->z1, 0, n * sizeof(chain->z1[0]));
+	memset(chain->z2, 0, n * sizeof(chain->z2[0]));
+	memset(chain->dz1, 0, n * sizeof(chain->dz1[0]));
+	memset(chain->dz2, 0, n * sizeof(chain->dz2[0]));
+}
+
+// ------------------------------- //
+// ------ COEFFICIENT CACHE ------ //
+// ------------------------------- //
+
+typedef struct
+{
+	int type;
+	float f0, q, gain;
+	int fs;
+} BqKey;
+
+// seq is 0 while empty and odd while a thread is filling the entry.
+// Lock free: a reader that races a writer just counts a miss.
+typedef struct
+{
+	atomic_uint seq;
+	BqKey key;
+	double c[5];
+} BqCacheEntry;
+
+static BqCacheEntry bq_cache[BQ_CACHE_SIZE];
+static atomic_size_t bq_cache_hits;
+static atomic_size_t bq_cache_misses;
+
+static inline uint32_t
+bq_key_hash(const BqKey *key)
+{
+	// FNV-1a over the key's bytes
+	const uint8_t *p = (const uint8_t *) key;
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(*key); i++)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+static int
+bq_cache_get(const BqKey *key, uint32_t h, double c[5])
+{
+	for (int i = 0; i < BQ_CACHE_WAYS; i++)
+	{
+		BqCacheEntry *e = &bq_cache[(h + i) & (BQ_CACHE_SIZE - 1)];
+		unsigned int begin = atomic_load_explicit(&e->seq, memory_order_acquire);
+
+		if (begin == 0 || (begin & 1))
+			continue;
+
+		BqKey k = e->key;
+		double v[5];
+		memcpy(v, e->c, sizeof(v));
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&e->seq, memory_order_relaxed) != begin ||
+			memcmp(&k, key, sizeof(k)) != 0)
+		{
+			continue;
+		}
+
+		memcpy(c, v, sizeof(v));
+		return 0;
+	}
+
+	return -1;
+}
+
+static void
+bq_cache_put(const BqKey *key, uint32_t h, const double c[5])
+{
+	// The way comes from the upper hash bits, so keys that collide on
+	// the lower bits still spread over the set
+	BqCacheEntry *e = &bq_cache[(h + (h >> 16) % BQ_CACHE_WAYS) & (BQ_CACHE_SIZE - 1)];
+	unsigned int seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+
+	// Somebody else is writing it; caching is best effort
+	if ((seq & 1) ||
+		!atomic_compare_exchange_strong_explicit(&e->seq, &seq, seq + 1,
+			memory_order_acquire, memory_order_relaxed))
+	{
+		return;
+	}
+	atomic_thread_fence(memory_order_release);
+
+	e->key = *key;
+	memcpy(e->c, c, sizeof(e->c));
+
+	atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+}
+
+void
+bq_cache_stats(size_t *hits, size_t *misses)
+{
+	*hits = atomic_load_explicit(&bq_cache_hits, memory_order_relaxed);
+	*misses = atomic_load_explicit(&bq_cache_misses, memory_order_relaxed);
+}
+
+// Coefficients for one filter as b0 b1 b2 a1 a2, or -1 when it is
+// off: BQ_NONE, an unknown type, or a flat peaking/shelf band
+static int
+bq_coefs(BiquadInfo *info, int fs, double c[5])
+{
+	Biquad bq;
+
+	if ((info->type == BQ_PEAKING ||
+		info->type == BQ_LOWSHELF ||
+		info->type == BQ_HIGHSHELF) &&
+		fabsf(info->args[2]) < BQ_FLAT_DB)
+	{
+		return -1;
+	}
+
+	// Pass filters ignore the gain, so it is not part of their key
+	BqKey key = {
+		.type = info->type,
+		.f0 = info->args[0],
+		.q = info->args[1],
+		.gain = (info->type == BQ_LOWPASS || info->type == BQ_HIGHPASS) ?
+			0.0f : info->args[2],
+		.fs = fs,
+	};
+	uint32_t h = bq_key_hash(&key);
+
+	if (bq_cache_get(&key, h, c) == 0)
+	{
+		atomic_fetch_add_explicit(&bq_cache_hits, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	if (bq_design(&bq, info, (float) fs) != 0)
+		return -1;
+
+	c[0] = bq.a0;
+	c[1] = bq.a1;
+	c[2] = bq.a2;
+	c[3] = bq.a3;
+	c[4] = bq.a4;
+
+	atomic_fetch_add_explicit(&bq_cache_misses, 1, memory_order_relaxed);
+	bq_cache_put(&key, h, c);
+	return 0;
+}
+
+// Broadcasts one row's coefficients to every channel lane
+static void
+bq_chain_load(BiquadChain *chain, int s, const double c[5])
+{
+	chain->blk_ready = 0;
+
+	for (int ch = 0; ch < chain->channels; ch++)
+	{
+		chain->b0[s][ch] = chain->db0[s][ch] = c[0];
+		chain->b1[s][ch] = chain->db1[s][ch] = c[1];
+		chain->b2[s][ch] = chain->db2[s][ch] = c[2];
+		chain->a1[s][ch] = chain->da1[s][ch] = c[3];
+		chain->a2[s][ch] = chain->da2[s][ch] = c[4];
+	}
+}
+
+// Picks float or double for the current rows and moves the state
+// over when that changes
+static void
+bq_chain_resolve(BiquadChain *chain)
+{
+	enum BiquadPrecision p = (chain->requested == BQ_DOUBLE) ? BQ_DOUBLE : BQ_FLOAT;
+
+	// Poles crowd z = 1 at low w0 and float coefficients
+	// can no longer place them accurately
+	for (int s = 0; s < chain->num_stages && chain->requested == BQ_AUTO; s++)
+	{
+		if (chain->info[s].args[0] < BQ_LF_RATIO * chain->fs)
+			p = BQ_DOUBLE;
+	}
+
+	if (p == chain->precision)
+		return;
+
+	for (int s = 0; s < chain->num_stages; s++)
+	{
+		for (int c = 0; c < BQ_MAX_CHANNELS; c++)
+		{
+			if (p == BQ_DOUBLE)
+			{
+				chain->dz1[s][c] = chain->z1[s][c];
+				chain->dz2[s][c] = chain->z2[s][c];
+			}
+			else
+			{
+				chain->z1[s][c] = chain->dz1[s][c];
+				chain->z2[s][c] = chain->dz2[s][c];
+			}
+		}
+	}
+
+	chain->precision = p;
+}
+
+// Removes row s, moving the rows after it down
+static void
+bq_chain_drop(BiquadChain *chain, int s)
+{
+	int after = chain->num_stages - s - 1;
+
+#define BQ_SHIFT(ROW) \
+	memmove(&chain->ROW[s], &chain->ROW[s + 1], after * sizeof(chain->ROW[0]))
+
+	BQ_SHIFT(b0); BQ_SHIFT(b1); BQ_SHIFT(b2); BQ_SHIFT(a1); BQ_SHIFT(a2);
+	BQ_SHIFT(z1); BQ_SHIFT(z2);
+	BQ_SHIFT(db0); BQ_SHIFT(db1); BQ_SHIFT(db2); BQ_SHIFT(da1); BQ_SHIFT(da2);
+	BQ_SHIFT(dz1); BQ_SHIFT(dz2);
+	BQ_SHIFT(band); BQ_SHIFT(info);
+	BQ_SHIFT(ramp_from); BQ_SHIFT(ramp_to); BQ_SHIFT(dying);
+
+#undef BQ_SHIFT
+
+	chain->num_stages--;
+	chain->blk_ready = 0;
+}
+
+void
+bq_chain_update(
+		BiquadChain *chain,
+		BiquadInfo *bq_info,
+		int num_bq,
+		int channels,
+		int fs,
+		enum BiquadPrecision precision)
+{
+	memset(chain->rows, 0, chain->rows_size);
+	chain->num_stages = 0;
+	chain->ramp_left = 0;
+	chain->channels = channels;
+	chain->fs = fs;
+	chain->precision = BQ_FLOAT;
+	chain->requested = precision;
+
+	for (int b = 0; b < num_bq && chain->num_stages < chain->max_stages; b++)
+	{
+		double c[5];
+
+		// Design once, then broadcast to every channel lane
+		if (bq_coefs(&bq_info[b], fs, c) != 0)
+			continue;
+
+		int s = chain->num_stages++;
+		chain->band[s] = b;
+		chain->info[s] = bq_info[b];
+		memcpy(chain->ramp_to[s], c, sizeof(c));
+		bq_chain_load(chain, s, c);
+	}
+
+	bq_chain_resolve(chain);
 }
 
 void
-bq_update(
-        Biquad (*bqs)[2],
-        BiquadInfo * bq_info, 
-        int num_bq,
-        int channels,
-        int fs)
+bq_chain_retarget(
+		BiquadChain *chain,
+		BiquadInfo *bq_info,
+		int num_bq,
+		enum BiquadPrecision precision)
 {
-	for (int b = 0; b < num_bq/*_num_filters*/; b++)
+	static const double identity[5] = { 1.0, 0.0, 0.0, 0.0, 0.0 };
+	uint8_t moved = 0;
+
+	// Every ramp restarts from where the coefficients are now, so a
+	// retarget in the middle of a ramp carries on smoothly
+	for (int s = 0; s < chain->num_stages; s++)
 	{
-		for (uint8_t c = 0; c < channels; c++)
+		chain->ramp_from[s][0] = chain->db0[s][0];
+		chain->ramp_from[s][1] = chain->db1[s][0];
+		chain->ramp_from[s][2] = chain->db2[s][0];
+		chain->ramp_from[s][3] = chain->da1[s][0];
+		chain->ramp_from[s][4] = chain->da2[s][0];
+	}
+
+	for (int b = 0; b < num_bq; b++)
+	{
+		int s = 0;
+		while (s < chain->num_stages && chain->band[s] != b)
+			s++;
+
+		if (s < chain->num_stages &&
+			memcmp(&chain->info[s], &bq_info[b], sizeof(BiquadInfo)) == 0)
 		{
-			switch (bq_info[b].type)
+			continue;
+		}
+
+		double c[5];
+		uint8_t on = bq_coefs(&bq_info[b], chain->fs, c) == 0;
+
+		if (s == chain->num_stages)
+		{
+			if (!on || s == chain->max_stages)
+				continue;
+
+			// New row: silent state, identity coefficients
+			chain->num_stages++;
+			chain->band[s] = b;
+			memcpy(chain->ramp_from[s], identity, sizeof(identity));
+			bq_chain_load(chain, s, identity);
+
+			for (int ch = 0; ch < BQ_MAX_CHANNELS; ch++)
 			{
-			case BQ_PEAKING:
-				bq_peaking(&bqs[b][c],
-						bq_info[b].args[2],
-						bq_info[b].args[0],
-						(float) fs,
-						bq_info[b].args[1]);
-				break;
-			case BQ_LOWSHELF:
-				bq_lowshelf(&bqs[b][c],
-						bq_info[b].args[2],
-						bq_info[b].args[0],
-						(float) fs,
-						bq_info[b].args[1]);
-				break;
-			case BQ_HIGHSHELF:
-				bq_highshelf(&bqs[b][c],
-						bq_info[b].args[2],
-						bq_info[b].args[0],
-						(float) fs,
-						bq_info[b].args[1]);
-				break;
-			case BQ_LOWPASS:
-				bq_lowpass(&bqs[b][c],
-						bq_info[b].args[0],
-						(float) fs,
-						bq_info[b].args[1]);
-				break;
-			case BQ_HIGHPASS:
-				bq_highpass(&bqs[b][c],
-						bq_info[b].args[0],
-						(float) fs,
-						bq_info[b].args[1]);
-				break;
-			default:
-				break;
+				chain->z1[s][ch] = chain->z2[s][ch] = 0.0f;
+				chain->dz1[s][ch] = chain->dz2[s][ch] = 0.0;
 			}
 		}
+
+		chain->info[s] = bq_info[b];
+		chain->dying[s] = !on;
+		memcpy(chain->ramp_to[s], on ? c : identity, sizeof(c));
+		moved = 1;
+	}
+
+	if (precision != chain->requested)
+	{
+		chain->requested = precision;
+		moved = 1;
+	}
+
+	if (moved)
+	{
+		chain->ramp_left = BQ_RAMP_FRAMES;
+		bq_chain_resolve(chain);
+	}
+}
+
+// Runs one stage from state (z1, z2) over `len` inputs that are zero
+// except for a 1 at `impulse` (none if out of range), in double; y gets
+// the outputs, z the state after them
+static void
+bq_block_sim(
+		const double c[5],
+		int len,
+		int impulse,
+		double z1,
+		double z2,
+		double *y,
+		double z[2])
+{
+	for (int k = 0; k < len; k++)
+	{
+		double x = (k == impulse) ? 1.0 : 0.0;
+
+		y[k] = c[0] * x + z1;
+		double n1 = c[1] * x - c[3] * y[k] + z2;
+		z2 = c[2] * x - c[4] * y[k];
+		z1 = n1;
+	}
+
+	z[0] = z1;
+	z[1] = z2;
+}
+
+// Responses to a unit input at each position and to unit z1 and z2,
+// which is all the linear block map is made of
+#define BQ_BLOCK_DESIGN(B, T, L, c) \
+	do { \
+		double y[L], z[2]; \
+\
+		for (int j = 0; j < L; j++) \
+		{ \
+			bq_block_sim(c, L, j, 0.0, 0.0, y, z); \
+			for (int k = 0; k < L; k++) \
+				(B)->h[j][k] = (T) y[k]; \
+			(B)->p1[j] = (T) z[0]; \
+			(B)->p2[j] = (T) z[1]; \
+		} \
+\
+		bq_block_sim(c, L, -1, 1.0, 0.0, y, z); \
+		for (int k = 0; k < L; k++) \
+			(B)->c1[k] = (T) y[k]; \
+		(B)->q[0][0] = (T) z[0]; \
+		(B)->q[1][0] = (T) z[1]; \
+\
+		bq_block_sim(c, L, -1, 0.0, 1.0, y, z); \
+		for (int k = 0; k < L; k++) \
+			(B)->c2[k] = (T) y[k]; \
+		(B)->q[0][1] = (T) z[0]; \
+		(B)->q[1][1] = (T) z[1]; \
+	} while (0)
+
+void
+bq_chain_block(BiquadChain *chain)
+{
+	for (int s = 0; s < chain->num_stages; s++)
+	{
+		const double c[5] = {
+			chain->db0[s][0], chain->db1[s][0], chain->db2[s][0],
+			chain->da1[s][0], chain->da2[s][0],
+		};
+
+		BQ_BLOCK_DESIGN(&chain->blk[s], float, BQ_BLOCK_F, c);
+		BQ_BLOCK_DESIGN(&chain->dblk[s], double, BQ_BLOCK_D, c);
+	}
+
+	chain->blk_ready = 1;
+}
+
+void
+bq_chain_ramp(
+		BiquadChain *chain,
+		size_t frames)
+{
+	if (chain->ramp_left == 0)
+		return;
+
+	chain->ramp_left = (frames < chain->ramp_left) ? chain->ramp_left - frames : 0;
+	const double t = 1.0 - (double) chain->ramp_left / BQ_RAMP_FRAMES;
+
+	// Linear in the coefficients: the stable region of (a1, a2) is a
+	// triangle, so every step between two stable filters is stable too
+	for (int s = 0; s < chain->num_stages; s++)
+	{
+		double c[5];
+		for (int k = 0; k < 5; k++)
+		{
+			c[k] = chain->ramp_from[s][k] +
+				(chain->ramp_to[s][k] - chain->ramp_from[s][k]) * t;
+		}
+		bq_chain_load(chain, s, c);
+	}
+
+	if (chain->ramp_left > 0)
+		return;
+
+	for (int s = chain->num_stages - 1; s >= 0; s--)
+	{
+		if (chain->dying[s])
+			bq_chain_drop(chain, s);
+	}
+
+	bq_chain_resolve(chain);
+}
+
+// Transposed direct form II over a whole interleaved buffer, one channel
+// per lane. VEC is the compute type (float or double lanes), FVEC the
+// matching float vector for the frame, P selects the coefficient rows
+// (empty for float, `d` for double). `ch` is a compile-time constant at
+// every call site so the partial frame load/store collapses to a single
+// vector move.
+//
+// Runs stage by stage over tiles of BQ_TILE_FRAMES, so one stage's
+// coefficients and state stay in registers however long the chain is.
+#define BQ_CHAIN_KERNEL(NAME, VEC, FVEC, P) \
+static inline __attribute__((always_inline)) void \
+NAME(BiquadChain *chain, float *buf, size_t frames, const int ch) \
+{ \
+	const int n = chain->num_stages; \
+	VEC tile[BQ_TILE_FRAMES]; \
+\
+	for (size_t done = 0; done < frames; done += BQ_TILE_FRAMES) \
+	{ \
+		const size_t len = (frames - done < BQ_TILE_FRAMES) ? \
+			frames - done : BQ_TILE_FRAMES; \
+		float *p = buf + done * ch; \
+\
+		for (size_t i = 0; i < len; i++) \
+		{ \
+			FVEC in = { 0 }; \
+			memcpy(&in, p + i * ch, ch * sizeof(float)); \
+			tile[i] = __builtin_convertvector(in, VEC); \
+		} \
+\
+		for (int s = 0; s < n; s++) \
+		{ \
+			VEC b0, b1, b2, a1, a2, z1, z2; \
+			memcpy(&b0, chain->P##b0[s], sizeof(VEC)); \
+			memcpy(&b1, chain->P##b1[s], sizeof(VEC)); \
+			memcpy(&b2, chain->P##b2[s], sizeof(VEC)); \
+			memcpy(&a1, chain->P##a1[s], sizeof(VEC)); \
+			memcpy(&a2, chain->P##a2[s], sizeof(VEC)); \
+			memcpy(&z1, chain->P##z1[s], sizeof(VEC)); \
+			memcpy(&z2, chain->P##z2[s], sizeof(VEC)); \
+\
+			for (size_t i = 0; i < len; i++) \
+			{ \
+				VEC x = tile[i]; \
+				VEC y = b0 * x + z1; \
+				z1 = b1 * x - a1 * y + z2; \
+				z2 = b2 * x - a2 * y; \
+				tile[i] = y; \
+			} \
+\
+			memcpy(chain->P##z1[s], &z1, sizeof(VEC)); \
+			memcpy(chain->P##z2[s], &z2, sizeof(VEC)); \
+		} \
+\
+		for (size_t i = 0; i < len; i++) \
+		{ \
+			FVEC out = __builtin_convertvector(tile[i], FVEC); \
+			memcpy(p + i * ch, &out, ch * sizeof(float)); \
+		} \
+	} \
+}
+
+BQ_CHAIN_KERNEL(bq_chain_run4, bq_v4f, bq_v4f, )
+BQ_CHAIN_KERNEL(bq_chain_run8, bq_v8f, bq_v8f, )
+BQ_CHAIN_KERNEL(bq_chain_run4d, bq_v4d, bq_v4f, d)
+BQ_CHAIN_KERNEL(bq_chain_run8d, bq_v8d, bq_v8f, d)
+
+void
+bq_chain_process(
+		BiquadChain *chain,
+		float *buf,
+		size_t frames)
+{
+	if (chain->num_stages == 0)
+		return;
+
+	if (chain->precision == BQ_DOUBLE)
+	{
+		switch (chain->channels)
+		{
+		case 1: bq_chain_run4d(chain, buf, frames, 1); break;
+		case 2: bq_chain_run4d(chain, buf, frames, 2); break;
+		case 3: bq_chain_run4d(chain, buf, frames, 3); break;
+		case 4: bq_chain_run4d(chain, buf, frames, 4); break;
+		case 5: bq_chain_run8d(chain, buf, frames, 5); break;
+		case 6: bq_chain_run8d(chain, buf, frames, 6); break;
+		case 7: bq_chain_run8d(chain, buf, frames, 7); break;
+		case 8: bq_chain_run8d(chain, buf, frames, 8); break;
+		default: break;
+		}
+		return;
+	}
+
+	switch (chain->channels)
+	{
+	case 1: bq_chain_run4(chain, buf, frames, 1); break;
+	case 2: bq_chain_run4(chain, buf, frames, 2); break;
+	case 3: bq_chain_run4(chain, buf, frames, 3); break;
+	case 4: bq_chain_run4(chain, buf, frames, 4); break;
+	case 5: bq_chain_run8(chain, buf, frames, 5); break;
+	case 6: bq_chain_run8(chain, buf, frames, 6); break;
+	case 7: bq_chain_run8(chain, buf, frames, 7); break;
+	case 8: bq_chain_run8(chain, buf, frames, 8); break;
+	default: break;
 	}
 }
@@ -1,6 +1,49 @@
 #ifndef BIQUAD_H
 #define BIQUAD_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Widest channel layout the cascade engine handles in one pass.
+// One channel per SIMD lane, so 1..8 channels cost the same.
+#define BQ_MAX_CHANNELS 8
+
+// Chains with up to this many active stages run a kernel with the
+// stage loop unrolled and all state in registers. Longer ones go
+// through in short tiles, one stage at a time across each tile.
+#define BQ_UNROLL_STAGES 3
+#define BQ_TILE_FRAMES 64
+
+// ISO 266 third-octave centres from 20 Hz to 20 kHz, the bands of a
+// graphic EQ
+#define BQ_ISO_BANDS 31
+
+// With BQ_AUTO, any stage tuned below this fraction of the sample
+// rate (about 240 Hz at 48 kHz) moves the chain to double precision.
+#define BQ_LF_RATIO 0.005f
+
+// Peaking and shelf bands closer to 0 dB than this are an identity
+// filter and get no stage, so an EQ left at 0 dB costs nothing.
+#define BQ_FLAT_DB 0.05f
+
+// Designed coefficients are cached by (type, f0, Q, gain, fs), so
+// track changes and repeated edits skip the trig. BQ_CACHE_SIZE must
+// be a power of two; a key may sit in any of BQ_CACHE_WAYS slots.
+#define BQ_CACHE_SIZE 256
+#define BQ_CACHE_WAYS 4
+
+// EQ edits move the coefficients over BQ_RAMP_FRAMES (about 20 ms at
+// 48 kHz) in steps of BQ_RAMP_BLOCK frames instead of jumping.
+#define BQ_RAMP_FRAMES 1024
+#define BQ_RAMP_BLOCK 32
+
+enum BiquadPrecision
+{
+	BQ_AUTO = 0,
+	BQ_FLOAT,
+	BQ_DOUBLE,
+};
+
 enum FilterType : int
 {
 	BQ_NONE = 0,
@@ -31,6 +74,8 @@ typedef struct {
 	double x1, x2, y1, y2;
 } Biquad;
 
+// The designers below only write coefficients, so a filter can be
+// retuned while it runs. Call bq_reset() before the first bq_process().
 void bq_reset(Biquad *bq);
 
 void 
@@ -74,19 +119,175 @@ bq_highpass(
 static inline float
 bq_process(Biquad *bq, float x)
 {
-	float y = bq->a0 * x + bq->a1 * bq->x1 + bq->a2 * bq->x2
+	double y = bq->a0 * x + bq->a1 * bq->x1 + bq->a2 * bq->x2
 		- bq->a3 * bq->y1 - bq->a4 * bq->y2;
 	bq->x2 = bq->x1; bq->x1 = x;
 	bq->y2 = bq->y1; bq->y1 = y;
 	return y;
 }
 
+// Vector types for the cascade kernels. GCC lowers these to SSE on
+// plain x86-64 and to AVX when built with -mavx / -march=native.
+typedef float bq_v4f __attribute__((vector_size(16)));
+typedef float bq_v8f __attribute__((vector_size(32)));
+typedef double bq_v4d __attribute__((vector_size(32)));
+typedef double bq_v8d __attribute__((vector_size(64)));
+
+// A mono stream fills one lane per stage, so for mono each stage also
+// has a time-blocked form: with the state (z1, z2) before a block of
+// BQ_BLOCK_F (float) or BQ_BLOCK_D (double) inputs, every output of
+// the block and the state after it are fixed linear combinations of
+// those, which vectorize along time. Derived from the rows by
+// bq_chain_block(); the kernel and its error bound are in dsp.c.
+#define BQ_BLOCK_F 8
+#define BQ_BLOCK_D 4
+
+typedef struct
+{
+	float h[BQ_BLOCK_F][BQ_BLOCK_F]; // h[j][k]: output k per input j
+	float c1[BQ_BLOCK_F];            // outputs per unit of z1
+	float c2[BQ_BLOCK_F];            // outputs per unit of z2
+	float p1[BQ_BLOCK_F];            // next z1 per input
+	float p2[BQ_BLOCK_F];            // next z2 per input
+	float q[2][2];                   // next (z1, z2) per (z1, z2)
+} __attribute__((aligned(32)))
+BqBlockF;
+
+typedef struct
+{
+	double h[BQ_BLOCK_D][BQ_BLOCK_D];
+	double c1[BQ_BLOCK_D];
+	double c2[BQ_BLOCK_D];
+	double p1[BQ_BLOCK_D];
+	double p2[BQ_BLOCK_D];
+	double q[2][2];
+} __attribute__((aligned(32)))
+BqBlockD;
+
+// Structure-of-arrays cascade: one row per stage, one lane per channel.
+// Only active (non BQ_NONE) filters get a row, so num_stages can be
+// smaller than the number of filters in the EQ. band[] maps a row back
+// to its filter; rows are not kept in filter order.
+//
+// Stages run in transposed direct form II (two state words per stage).
+// The float rows are used with BQ_FLOAT, the `d` rows with BQ_DOUBLE;
+// both are filled on every update so switching needs no redesign.
+//
+// The rows are sized for max_stages when the chain is created with
+// bq_chain_new(), so nothing after that allocates.
+typedef struct
+{
+	float (*b0)[BQ_MAX_CHANNELS];
+	float (*b1)[BQ_MAX_CHANNELS];
+	float (*b2)[BQ_MAX_CHANNELS];
+	float (*a1)[BQ_MAX_CHANNELS];
+	float (*a2)[BQ_MAX_CHANNELS];
+	float (*z1)[BQ_MAX_CHANNELS];
+	float (*z2)[BQ_MAX_CHANNELS];
+
+	double (*db0)[BQ_MAX_CHANNELS];
+	double (*db1)[BQ_MAX_CHANNELS];
+	double (*db2)[BQ_MAX_CHANNELS];
+	double (*da1)[BQ_MAX_CHANNELS];
+	double (*da2)[BQ_MAX_CHANNELS];
+	double (*dz1)[BQ_MAX_CHANNELS];
+	double (*dz2)[BQ_MAX_CHANNELS];
+
+	int max_stages;
+	int num_stages;
+	int channels;
+	int fs;
+	enum BiquadPrecision precision; // resolved, never BQ_AUTO
+	enum BiquadPrecision requested; // as passed in, may be BQ_AUTO
+
+	// Settings each row was designed from, so a retarget only
+	// redesigns the filters that changed
+	int *band;
+	BiquadInfo *info;
+
+	// Coefficient ramp, b0 b1 b2 a1 a2 per row. Rows marked dying
+	// ramp to an identity stage and are dropped when it ends.
+	double (*ramp_from)[5];
+	double (*ramp_to)[5];
+	uint8_t *dying;
+	size_t ramp_left;
+
+	// Blocked form of each row for mono, valid while blk_ready
+	BqBlockF *blk;
+	BqBlockD *dblk;
+	uint8_t blk_ready;
+
+	// Every row above, in one block after the struct
+	void *rows;
+	size_t rows_size;
+} __attribute__((aligned(64)))
+BiquadChain;
+
+// A chain with room for `max_stages` active filters, all flat. NULL if
+// out of memory. Free with bq_chain_free().
+BiquadChain *bq_chain_new(int max_stages);
+
+void bq_chain_free(BiquadChain *chain);
+
+// Derives the blocked form of every row from its coefficients (lane 0)
+// and sets blk_ready. The coefficients change on every ramp step, so
+// it only pays off while chain->ramp_left is 0.
+void bq_chain_block(BiquadChain *chain);
+
+// Centre frequency of ISO band 0..BQ_ISO_BANDS-1
+float bq_iso_freq(int band);
+
+// Precomputes sin/cos of w0 for the ISO third-octave frequencies at
+// 44.1, 48, 88.2 and 96 kHz, which the designers then look up. Optional;
+// call once before any thread designs filters.
+void bq_presets_init(void);
+
+// Coefficient cache counters since start, for benchmarks
+void bq_cache_stats(size_t *hits, size_t *misses);
+
+// Sets flush-to-zero / denormals-are-zero for the calling thread so
+// decaying IIR tails do not fall onto the slow denormal path.
+void bq_denormals_off(void);
+
+void bq_chain_reset(BiquadChain *chain);
+
+// Designs the chain from scratch. Filters past chain->max_stages active
+// ones are left out.
+void
+bq_chain_update(
+		BiquadChain *chain,
+		BiquadInfo *bq_info,
+		int num_bq,
+		int channels,
+		int fs,
+		enum BiquadPrecision precision);
+
+// Moves a running chain to the settings in bq_info, keeping its state.
+// Only filters whose settings differ are redesigned, and the new
+// coefficients are reached through bq_chain_ramp(). A filter that turns
+// on starts as an identity stage; one that turns off ramps to identity
+// first, so neither clicks.
+void
+bq_chain_retarget(
+		BiquadChain *chain,
+		BiquadInfo *bq_info,
+		int num_bq,
+		enum BiquadPrecision precision);
+
+// Advances the ramp by `frames` (at most BQ_RAMP_BLOCK) and loads the
+// coefficients for that block. No-op once chain->ramp_left is 0; the
+// stage count may drop on the last step.
+void
+bq_chain_ramp(
+		BiquadChain *chain,
+		size_t frames);
+
+// Runs every stage of the chain over `frames` interleaved frames
+// of `chain->channels` samples, in place.
 void
-bq_update(
-        Biquad (*bqs)[2],
-        BiquadInfo * bq_info, 
-        int num_bq,
-        int channels,
-        int fs);
+bq_chain_process(
+		BiquadChain *chain,
+		float *buf,
+		size_t frames);
 
 #endif
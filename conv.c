@@ -0,0 +1,460 @@
+#include "conv.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dsp.h"
+#include "wav.h"
+
+// ------------------------------- //
+// ------------ FFT -------------- //
+// ------------------------------- //
+
+// In-place radix-2 FFT of c->block points on split real / imaginary
+// arrays. Each pass reads its twiddles from one contiguous run, so the
+// butterflies of the wider passes vectorize. Passing the arrays the
+// other way round, (im, re), gives the unscaled inverse.
+static void
+conv_fft(const Convolver *c, float *restrict re, float *restrict im)
+{
+	const size_t m = c->block;
+
+	for (size_t i = 0; i < m; i++)
+	{
+		size_t j = c->rev[i];
+		if (i < j)
+		{
+			float t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (size_t half = 1; half < m; half *= 2)
+	{
+		const float *wr = c->tw_re + half;
+		const float *wi = c->tw_im + half;
+
+		for (size_t s = 0; s < m; s += 2 * half)
+		{
+			float *ar = re + s, *ai = im + s;
+			float *br = ar + half, *bi = ai + half;
+
+			for (size_t j = 0; j < half; j++)
+			{
+				float tr = br[j] * wr[j] - bi[j] * wi[j];
+				float ti = br[j] * wi[j] + bi[j] * wr[j];
+				br[j] = ar[j] - tr;
+				bi[j] = ai[j] - ti;
+				ar[j] += tr;
+				ai[j] += ti;
+			}
+		}
+	}
+}
+
+// Spectrum bins 0..N/2 of N = 2 * block real samples, through one
+// complex FFT of half the length with the even samples as the real and
+// the odd ones as the imaginary part
+static void
+conv_rfft(
+		const Convolver *c,
+		const float *x,
+		float *restrict out_re,
+		float *restrict out_im)
+{
+	const size_t m = c->block;
+	float *z_re = c->z_re, *z_im = c->z_im;
+
+	for (size_t k = 0; k < m; k++)
+	{
+		z_re[k] = x[2 * k];
+		z_im[k] = x[2 * k + 1];
+	}
+
+	conv_fft(c, z_re, z_im);
+
+	for (size_t k = 0; k <= m; k++)
+	{
+		size_t a = (k == m) ? 0 : k;
+		size_t b = (k == 0) ? 0 : m - k;
+
+		float e_re = 0.5f * (z_re[a] + z_re[b]);
+		float e_im = 0.5f * (z_im[a] - z_im[b]);
+		float o_re = 0.5f * (z_im[a] + z_im[b]);
+		float o_im = -0.5f * (z_re[a] - z_re[b]);
+
+		out_re[k] = e_re + c->split_re[k] * o_re - c->split_im[k] * o_im;
+		out_im[k] = e_im + c->split_re[k] * o_im + c->split_im[k] * o_re;
+	}
+}
+
+// Inverse of conv_rfft() scaled by N / 2, writing only samples
+// [block, 2 * block) of the result, the part overlap-save keeps
+static void
+conv_irfft_tail(
+		const Convolver *c,
+		const float *in_re,
+		const float *in_im,
+		float *restrict y)
+{
+	const size_t m = c->block;
+	float *z_re = c->z_re, *z_im = c->z_im;
+
+	for (size_t k = 0; k < m; k++)
+	{
+		float a_re = in_re[k], a_im = in_im[k];
+		float b_re = in_re[m - k], b_im = -in_im[m - k];
+
+		float e_re = 0.5f * (a_re + b_re);
+		float e_im = 0.5f * (a_im + b_im);
+		float d_re = 0.5f * (a_re - b_re);
+		float d_im = 0.5f * (a_im - b_im);
+
+		// o = d * conj(w^k), then z = e + i * o
+		float o_re = d_re * c->split_re[k] + d_im * c->split_im[k];
+		float o_im = d_im * c->split_re[k] - d_re * c->split_im[k];
+
+		z_re[k] = e_re - o_im;
+		z_im[k] = e_im + o_re;
+	}
+
+	conv_fft(c, z_im, z_re);
+
+	for (size_t k = m / 2; k < m; k++)
+	{
+		y[2 * k - m] = z_re[k];
+		y[2 * k + 1 - m] = z_im[k];
+	}
+}
+
+// ------------------------------- //
+// --------- CONVOLVER ----------- //
+// ------------------------------- //
+
+Convolver *
+conv_new(
+		const ConvIR *ir,
+		int channels,
+		size_t block)
+{
+	if (ir->frames == 0 || ir->frames > CONV_MAX_TAPS ||
+		(ir->channels != 1 && ir->channels != channels))
+	{
+		return NULL;
+	}
+
+	size_t b = CONV_MIN_BLOCK;
+	while (b * 2 <= block && b * 2 <= CONV_MAX_BLOCK) { b *= 2; }
+
+	Convolver *c = calloc(1, sizeof(Convolver));
+	if (!c) { return NULL; }
+
+	c->block = b;
+	c->size = 2 * b;
+	c->bins = (b + 1 + 15) & ~(size_t) 15;
+	c->num_parts = (ir->frames + b - 1) / b;
+	c->channels = channels;
+	c->ir_channels = ir->channels;
+
+	const size_t n = c->size;
+	const size_t bins = c->bins;
+	const size_t parts = c->num_parts;
+
+	// Every array is a multiple of 16 floats, so each starts on a
+	// cache line
+	const size_t sizes[] = {
+		parts * ir->channels * bins, parts * ir->channels * bins,
+		parts * channels * bins, parts * channels * bins,
+		channels * n, channels * b,
+		channels * bins, channels * bins, n, b, b,
+		b, b, bins, bins,
+		b, // rev, 32-bit like a float
+	};
+	size_t total = 0;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		total += (sizes[i] + 15) & ~(size_t) 15;
+	}
+
+	c->mem = aligned_alloc(64, total * sizeof(float));
+	if (!c->mem)
+	{
+		free(c);
+		return NULL;
+	}
+	memset(c->mem, 0, total * sizeof(float));
+
+	float *p = c->mem;
+	float **arrays[] = {
+		&c->h_re, &c->h_im,
+		&c->x_re, &c->x_im,
+		&c->in, &c->out,
+		&c->acc_re, &c->acc_im, &c->time, &c->z_re, &c->z_im,
+		&c->tw_re, &c->tw_im, &c->split_re, &c->split_im,
+	};
+	for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++)
+	{
+		*arrays[i] = p;
+		p += (sizes[i] + 15) & ~(size_t) 15;
+	}
+	c->rev = (uint32_t *) p;
+
+	// Tables, in double so the rounding does not pile up
+	int bits = 0;
+	while (((size_t) 1 << bits) < b) { bits++; }
+
+	for (size_t i = 0; i < b; i++)
+	{
+		uint32_t r = 0;
+		for (int k = 0; k < bits; k++) { r |= ((i >> k) & 1) << (bits - 1 - k); }
+		c->rev[i] = r;
+	}
+
+	for (size_t half = 1; half < b; half *= 2)
+	{
+		for (size_t j = 0; j < half; j++)
+		{
+			double w = -M_PI * j / half;
+			c->tw_re[half + j] = cos(w);
+			c->tw_im[half + j] = sin(w);
+		}
+	}
+
+	for (size_t k = 0; k <= b; k++)
+	{
+		double w = -2.0 * M_PI * k / n;
+		c->split_re[k] = cos(w);
+		c->split_im[k] = sin(w);
+	}
+
+	// Response spectra, with the 1 / (N / 2) of the inverse folded in
+	const float scale = 1.0f / b;
+
+	for (size_t part = 0; part < parts; part++)
+	{
+		for (int ch = 0; ch < ir->channels; ch++)
+		{
+			const float *src = ir->samples + ch * ir->frames + part * b;
+			size_t len = (ir->frames - part * b < b) ? ir->frames - part * b : b;
+
+			memset(c->time, 0, n * sizeof(float));
+			for (size_t i = 0; i < len; i++) { c->time[i] = src[i] * scale; }
+
+			size_t at = (part * ir->channels + ch) * bins;
+			conv_rfft(c, c->time, c->h_re + at, c->h_im + at);
+		}
+	}
+
+	return c;
+}
+
+void
+conv_free(Convolver *c)
+{
+	if (!c) { return; }
+
+	free(c->mem);
+	free(c);
+}
+
+void
+conv_reset(Convolver *c)
+{
+	const size_t spectra = c->num_parts * c->channels * c->bins;
+
+	memset(c->x_re, 0, spectra * sizeof(float));
+	memset(c->x_im, 0, spectra * sizeof(float));
+	memset(c->in, 0, c->channels * c->size * sizeof(float));
+	memset(c->out, 0, c->channels * c->block * sizeof(float));
+	c->fill = 0;
+	c->head = 0;
+}
+
+// One partition's worth of input is in: output the next block
+static void
+conv_block(Convolver *c)
+{
+	const size_t b = c->block;
+	const size_t bins = c->bins;
+	const int parts = c->num_parts;
+	const int channels = c->channels;
+
+	c->head = (c->head + 1 < parts) ? c->head + 1 : 0;
+
+	for (int ch = 0; ch < channels; ch++)
+	{
+		size_t newest = (c->head * channels + ch) * bins;
+		conv_rfft(c, c->in + ch * c->size, c->x_re + newest, c->x_im + newest);
+	}
+
+	float *restrict acc_re = c->acc_re;
+	float *restrict acc_im = c->acc_im;
+	memset(acc_re, 0, channels * bins * sizeof(float));
+	memset(acc_im, 0, channels * bins * sizeof(float));
+
+	// Input spectra from `part` blocks ago times response part `part`;
+	// this loop is nearly all of the work for long responses. Every
+	// channel is done per part, so a shared response is read once.
+	int slot = c->head;
+	for (int part = 0; part < parts; part++)
+	{
+		for (int ch = 0; ch < channels; ch++)
+		{
+			const float *restrict xr = c->x_re + (slot * channels + ch) * bins;
+			const float *restrict xi = c->x_im + (slot * channels + ch) * bins;
+			size_t h_at = (part * c->ir_channels + (c->ir_channels > 1 ? ch : 0)) * bins;
+			const float *restrict hr = c->h_re + h_at;
+			const float *restrict hi = c->h_im + h_at;
+			float *restrict ar = acc_re + ch * bins;
+			float *restrict ai = acc_im + ch * bins;
+
+			for (size_t k = 0; k < bins; k++)
+			{
+				ar[k] += xr[k] * hr[k] - xi[k] * hi[k];
+				ai[k] += xr[k] * hi[k] + xi[k] * hr[k];
+			}
+		}
+
+		slot = (slot > 0) ? slot - 1 : parts - 1;
+	}
+
+	for (int ch = 0; ch < channels; ch++)
+	{
+		float *in = c->in + ch * c->size;
+
+		conv_irfft_tail(c, acc_re + ch * bins, acc_im + ch * bins, c->out + ch * b);
+
+		// The new half becomes the old half of the next window
+		memcpy(in, in + b, b * sizeof(float));
+	}
+}
+
+void
+conv_process(
+		Convolver *c,
+		float *buf,
+		size_t frames)
+{
+	const int channels = c->channels;
+	const size_t b = c->block;
+
+	while (frames > 0)
+	{
+		size_t n = b - c->fill;
+		if (n > frames) { n = frames; }
+
+		// Swap the new inputs in for the outputs of the last block
+		for (int ch = 0; ch < channels; ch++)
+		{
+			float *in = c->in + ch * c->size + b + c->fill;
+			const float *out = c->out + ch * b + c->fill;
+
+			for (size_t i = 0; i < n; i++)
+			{
+				in[i] = buf[i * channels + ch];
+				buf[i * channels + ch] = out[i];
+			}
+		}
+
+		buf += n * channels;
+		frames -= n;
+		c->fill += n;
+
+		if (c->fill == b)
+		{
+			conv_block(c);
+			c->fill = 0;
+		}
+	}
+}
+
+// ------------------------------- //
+// ----------- LOADING ----------- //
+// ------------------------------- //
+
+int
+conv_load_ir(const char *path, ConvIR *ir)
+{
+	char file_path[1300];
+	WAVHeader header = { 0 };
+	size_t file_size = 0;
+	char *file_buf = NULL;
+	int offset = 0;
+
+	memset(ir, 0, sizeof(*ir));
+	snprintf(file_path, sizeof(file_path), "%s", path);
+
+	int retval = read_file(file_path, &header, &file_size, &file_buf, &offset, 0);
+	if (retval == 0) { retval = validate_header(file_path, &header, 0); }
+
+	size_t frame_size = header.bps / 8 * header.num_channels;
+	size_t frames = 0;
+
+	if (retval == 0)
+	{
+		// The data chunk may claim more than the file holds
+		size_t data = header.subchunk2_size;
+		if (data > file_size - offset) { data = file_size - offset; }
+		frames = data / frame_size;
+
+		if (frames == 0 || frames > CONV_MAX_TAPS)
+		{
+			fprintf(stderr, "%s: impulse response must have 1 to %d frames.\n\r",
+					path, CONV_MAX_TAPS);
+			retval = -1;
+		}
+	}
+
+	float *interleaved = NULL;
+	if (retval == 0)
+	{
+		ir->samples = malloc(frames * header.num_channels * sizeof(float));
+		interleaved = malloc(frames * header.num_channels * sizeof(float));
+
+		if (!ir->samples || !interleaved)
+		{
+			fprintf(stderr, "Failed to allocate the impulse response.\n\r");
+			retval = -1;
+		}
+	}
+
+	if (retval == 0)
+	{
+		dsp_to_float((const uint8_t *) file_buf + offset, interleaved,
+				frames * header.num_channels,
+				dsp_format(header.audio_format, header.bps));
+
+		for (int ch = 0; ch < header.num_channels; ch++)
+		{
+			for (size_t i = 0; i < frames; i++)
+			{
+				ir->samples[ch * frames + i] = interleaved[i * header.num_channels + ch];
+			}
+		}
+
+		ir->frames = frames;
+		ir->channels = header.num_channels;
+		ir->rate = header.sample_rate;
+	}
+
+	free(interleaved);
+	if (file_buf) { munmap(file_buf, file_size); }
+
+	if (retval != 0)
+	{
+		conv_free_ir(ir);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+conv_free_ir(ConvIR *ir)
+{
+	free(ir->samples);
+	memset(ir, 0, sizeof(*ir));
+}
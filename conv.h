@@ -0,0 +1,98 @@
+#ifndef CONV_H
+#define CONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Partition length limits, in frames. The partition is also the delay
+// the convolver adds, so callers pick one no longer than a period.
+#define CONV_MIN_BLOCK 64
+#define CONV_MAX_BLOCK 4096
+// Longest impulse response accepted, about 22 s at 48 kHz
+#define CONV_MAX_TAPS (1 << 20)
+
+// An impulse response loaded from a WAV file, deinterleaved:
+// channel c is samples[c * frames .. (c + 1) * frames)
+typedef struct
+{
+	float *samples;
+	size_t frames;
+	int channels;
+	int rate;
+} ConvIR;
+
+// Reads a WAV file of any format validate_header() takes as an
+// impulse response. Returns -1 with a message on stderr.
+int conv_load_ir(const char *path, ConvIR *ir);
+
+void conv_free_ir(ConvIR *ir);
+
+// Uniformly partitioned overlap-save convolution (FIR filter) for
+// impulse responses of up to CONV_MAX_TAPS taps.
+//
+// The response is cut into partitions of `block` frames, each kept as
+// the spectrum of its zero-padded 2 * block window. Every `block`
+// input frames, the newest window of input is transformed once and
+// pushed onto a delay line of past input spectra; the output block is
+// the inverse transform of sum_p input[now - p] * response[p]. Each
+// block costs two FFTs and one multiply-add per partition and bin, so
+// the cost is the same for every block and grows linearly with the
+// response length instead of per tap.
+//
+// The output lags the input by exactly `block` frames.
+typedef struct
+{
+	size_t block;     // B, frames per partition
+	size_t size;      // N = 2B, FFT length
+	size_t bins;      // N / 2 + 1, rounded up to a multiple of 16
+	int num_parts;    // P
+	int channels;
+	int ir_channels;  // 1 (shared by every channel) or channels
+
+	// Response spectra, [part][ir channel][bin]
+	float *h_re, *h_im;
+	// Past input spectra, [part][channel][bin]; part `head` is newest
+	float *x_re, *x_im;
+	int head;
+
+	// Per channel: the last 2B inputs and the B outputs being played
+	float *in;
+	float *out;
+	size_t fill; // frames of the current block taken so far
+
+	// Scratch for one block; the sums are [channel][bin]
+	float *acc_re, *acc_im;
+	float *time;
+	float *z_re, *z_im;
+
+	// FFT tables: bit reversal of N / 2 points, twiddles of each pass
+	// of the N / 2 point transform, and the real <-> complex split
+	uint32_t *rev;
+	float *tw_re, *tw_im;
+	float *split_re, *split_im;
+
+	void *mem;
+} Convolver;
+
+// Convolver for `channels` channels with the response `ir`, which must
+// have 1 or `channels` channels. `block` is rounded down to a power of
+// two within [CONV_MIN_BLOCK, CONV_MAX_BLOCK]. NULL on failure.
+Convolver *
+conv_new(
+		const ConvIR *ir,
+		int channels,
+		size_t block);
+
+void conv_free(Convolver *c);
+
+// Clears the input history, as after silence
+void conv_reset(Convolver *c);
+
+// Filters `frames` interleaved frames in place. Never allocates.
+void
+conv_process(
+		Convolver *c,
+		float *buf,
+		size_t frames);
+
+#endif
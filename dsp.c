@@ -0,0 +1,544 @@
+#include "dsp.h"
+
+#include <string.h>
+
+// Every kernel is the same always-inlined body with bps, ch and the
+// stage count as literal constants, so the per-sample format branches
+// fold away and the stage loop unrolls with its state in registers.
+// Chains longer than BQ_UNROLL_STAGES share one kernel per format that
+// reads the stage count at run time.
+
+static inline __attribute__((always_inline)) float
+dsp_decode(const uint8_t *p, const int bps)
+{
+	if (bps == 16)
+	{
+		int16_t s;
+		memcpy(&s, p, sizeof(s));
+		return s / 32768.0f;
+	}
+	else if (bps == 24)
+	{
+		int32_t s = (p[0] | (p[1] << 8) | (p[2] << 16));
+		if (s & 0x800000) s |= ~0xffffff;
+		return s / 8388608.0f;
+	}
+	else
+	{
+		int32_t s;
+		memcpy(&s, p, sizeof(s));
+		return s / 2147483648.0f;
+	}
+}
+
+static inline __attribute__((always_inline)) void
+dsp_encode(uint8_t *p, float x, const int bps)
+{
+	// Written so they map straight onto minps/maxps
+	x = (x < 1.0f) ? x : 1.0f;
+	x = (x > -1.0f) ? x : -1.0f;
+
+	if (bps == 16)
+	{
+		int16_t s = (int16_t)(x * 32767.0f);
+		memcpy(p, &s, sizeof(s));
+	}
+	else if (bps == 24)
+	{
+		int32_t s = (int32_t)(x * 8388607.0f);
+		p[0] = s & 0xff;
+		p[1] = (s >> 8) & 0xff;
+		p[2] = (s >> 16) & 0xff;
+	}
+	else
+	{
+		// 2147483647.0f rounds up to 2^31, which 1.0 would overflow;
+		// this is the largest float below it
+		int32_t s = (int32_t)(x * 2147483520.0f);
+		memcpy(p, &s, sizeof(s));
+	}
+}
+
+// Kernel index for chains longer than BQ_UNROLL_STAGES
+#define DSP_LONG (BQ_UNROLL_STAGES + 1)
+
+// VEC is the compute type, FVEC the float vector of the same lane
+// count, P the chain rows to use (empty for float, `d` for double).
+// `n` is the stage count, or DSP_LONG for any longer chain.
+#define DSP_FUSED(NAME, VEC, FVEC, P) \
+static inline __attribute__((always_inline)) void \
+NAME(const uint8_t *in, uint8_t *out, size_t frames, BiquadChain *chain, \
+		const int bps, const int ch, const int n) \
+{ \
+	const int bytes = bps / 8; \
+\
+	/* No stages: bit-exact copy, no requantization */ \
+	if (n == 0) \
+	{ \
+		if (out != in) \
+			memmove(out, in, frames * ch * bytes); \
+		return; \
+	} \
+\
+	/* Long chain: too many stages for registers, so each tile of \
+	 * frames is decoded, run through one stage at a time with that \
+	 * stage's coefficients and state held in registers, and encoded */ \
+	if (n == DSP_LONG) \
+	{ \
+		VEC tile[BQ_TILE_FRAMES]; \
+\
+		for (size_t done = 0; done < frames; done += BQ_TILE_FRAMES) \
+		{ \
+			const size_t len = (frames - done < BQ_TILE_FRAMES) ? \
+				frames - done : BQ_TILE_FRAMES; \
+			const uint8_t *src = in + done * ch * bytes; \
+			uint8_t *dst = out + done * ch * bytes; \
+\
+			for (size_t i = 0; i < len; i++) \
+			{ \
+				float f[sizeof(FVEC) / sizeof(float)] = { 0 }; \
+\
+				for (int c = 0; c < ch; c++) \
+					f[c] = dsp_decode(src + (i * ch + c) * bytes, bps); \
+\
+				FVEC in_v; \
+				memcpy(&in_v, f, sizeof(in_v)); \
+				tile[i] = __builtin_convertvector(in_v, VEC); \
+			} \
+\
+			for (int s = 0; s < chain->num_stages; s++) \
+			{ \
+				VEC b0, b1, b2, a1, a2, z1, z2; \
+				memcpy(&b0, chain->P##b0[s], sizeof(VEC)); \
+				memcpy(&b1, chain->P##b1[s], sizeof(VEC)); \
+				memcpy(&b2, chain->P##b2[s], sizeof(VEC)); \
+				memcpy(&a1, chain->P##a1[s], sizeof(VEC)); \
+				memcpy(&a2, chain->P##a2[s], sizeof(VEC)); \
+				memcpy(&z1, chain->P##z1[s], sizeof(VEC)); \
+				memcpy(&z2, chain->P##z2[s], sizeof(VEC)); \
+\
+				for (size_t i = 0; i < len; i++) \
+				{ \
+					VEC x = tile[i]; \
+					VEC y = b0 * x + z1; \
+					z1 = b1 * x - a1 * y + z2; \
+					z2 = b2 * x - a2 * y; \
+					tile[i] = y; \
+				} \
+\
+				memcpy(chain->P##z1[s], &z1, sizeof(VEC)); \
+				memcpy(chain->P##z2[s], &z2, sizeof(VEC)); \
+			} \
+\
+			for (size_t i = 0; i < len; i++) \
+			{ \
+				float f[sizeof(FVEC) / sizeof(float)]; \
+				FVEC out_v = __builtin_convertvector(tile[i], FVEC); \
+				memcpy(f, &out_v, sizeof(out_v)); \
+\
+				for (int c = 0; c < ch; c++) \
+					dsp_encode(dst + (i * ch + c) * bytes, f[c], bps); \
+			} \
+		} \
+		return; \
+	} \
+\
+	VEC b0[BQ_UNROLL_STAGES], b1[BQ_UNROLL_STAGES], b2[BQ_UNROLL_STAGES]; \
+	VEC a1[BQ_UNROLL_STAGES], a2[BQ_UNROLL_STAGES]; \
+	VEC z1[BQ_UNROLL_STAGES], z2[BQ_UNROLL_STAGES]; \
+\
+	for (int s = 0; s < n; s++) \
+	{ \
+		memcpy(&b0[s], chain->P##b0[s], sizeof(VEC)); \
+		memcpy(&b1[s], chain->P##b1[s], sizeof(VEC)); \
+		memcpy(&b2[s], chain->P##b2[s], sizeof(VEC)); \
+		memcpy(&a1[s], chain->P##a1[s], sizeof(VEC)); \
+		memcpy(&a2[s], chain->P##a2[s], sizeof(VEC)); \
+		memcpy(&z1[s], chain->P##z1[s], sizeof(VEC)); \
+		memcpy(&z2[s], chain->P##z2[s], sizeof(VEC)); \
+	} \
+\
+	for (size_t i = 0; i < frames; i++) \
+	{ \
+		const uint8_t *src = in + i * ch * bytes; \
+		uint8_t *dst = out + i * ch * bytes; \
+		float f[sizeof(FVEC) / sizeof(float)] = { 0 }; \
+\
+		for (int c = 0; c < ch; c++) \
+			f[c] = dsp_decode(src + c * bytes, bps); \
+\
+		FVEC in_v; \
+		memcpy(&in_v, f, sizeof(in_v)); \
+		VEC x = __builtin_convertvector(in_v, VEC); \
+\
+		for (int s = 0; s < n; s++) \
+		{ \
+			VEC y = b0[s] * x + z1[s]; \
+			z1[s] = b1[s] * x - a1[s] * y + z2[s]; \
+			z2[s] = b2[s] * x - a2[s] * y; \
+			x = y; \
+		} \
+\
+		FVEC out_v = __builtin_convertvector(x, FVEC); \
+		memcpy(f, &out_v, sizeof(out_v)); \
+\
+		for (int c = 0; c < ch; c++) \
+			dsp_encode(dst + c * bytes, f[c], bps); \
+	} \
+\
+	for (int s = 0; s < n; s++) \
+	{ \
+		memcpy(chain->P##z1[s], &z1[s], sizeof(VEC)); \
+		memcpy(chain->P##z2[s], &z2[s], sizeof(VEC)); \
+	} \
+}
+
+DSP_FUSED(dsp_fused_f4, bq_v4f, bq_v4f, )
+DSP_FUSED(dsp_fused_f8, bq_v8f, bq_v8f, )
+DSP_FUSED(dsp_fused_d4, bq_v4d, bq_v4f, d)
+DSP_FUSED(dsp_fused_d8, bq_v8d, bq_v8f, d)
+
+// ------------------------------- //
+// ------- MONO, BLOCKED --------- //
+// ------------------------------- //
+
+// Mono leaves all but one lane of the kernels above idle and every
+// stage waits on its own previous output, sample after sample. Here a
+// tile is run one stage at a time in blocks of L samples using the
+// chain's BqBlock form:
+//
+//   y[0..L) = sum_j x[j] * h[j] + z1 * c1 + z2 * c2
+//   (z1, z2) = q * (z1, z2) + (p1 . x, p2 . x)
+//
+// The outputs are L + 2 vector multiply-adds, and only the 2x2 state
+// update carries over from one block to the next. Frames past the last
+// whole block take the plain recursion, which shares the state.
+//
+// Tolerance: it is the same linear filter as the serial recursion with
+// the roundings in another order. Against a double-precision serial
+// reference, the double path matches the serial one to the 32-bit
+// output's quantization step (3.5e-8). In float, a 1-3 band EQ lands
+// within 1e-6 of full scale (-120 dB, a little closer than the serial
+// float kernel); bass bands forced to float on a 31-band graphic EQ
+// drift about twice as far as the serial form does, which BQ_AUTO
+// avoids by running those in double; `make bench` fails outside these
+// bounds. Coefficients ramping toward a new setting change every few
+// frames, so ramps use the serial kernels.
+typedef int32_t dsp_v8i __attribute__((vector_size(32)));
+typedef int64_t dsp_v4l __attribute__((vector_size(32)));
+
+// Sums of the lanes of a and of b, as a shuffle-and-add tree over both
+// at once
+static inline __attribute__((always_inline)) void
+dsp_hsum2_f(const bq_v8f *a, const bq_v8f *b, float *sa, float *sb)
+{
+	bq_v8f t = __builtin_shuffle(*a, *b, (dsp_v8i) { 0, 1, 2, 3, 8, 9, 10, 11 }) +
+		__builtin_shuffle(*a, *b, (dsp_v8i) { 4, 5, 6, 7, 12, 13, 14, 15 });
+	t += __builtin_shuffle(t, (dsp_v8i) { 2, 3, 0, 1, 6, 7, 4, 5 });
+	t += __builtin_shuffle(t, (dsp_v8i) { 1, 0, 3, 2, 5, 4, 7, 6 });
+
+	*sa = t[0];
+	*sb = t[4];
+}
+
+static inline __attribute__((always_inline)) void
+dsp_hsum2_d(const bq_v4d *a, const bq_v4d *b, double *sa, double *sb)
+{
+	bq_v4d t = __builtin_shuffle(*a, *b, (dsp_v4l) { 0, 1, 4, 5 }) +
+		__builtin_shuffle(*a, *b, (dsp_v4l) { 2, 3, 6, 7 });
+	t += __builtin_shuffle(t, (dsp_v4l) { 1, 0, 3, 2 });
+
+	*sa = t[0];
+	*sb = t[2];
+}
+
+#define DSP_MONO(NAME, T, VEC, L, P, HSUM) \
+static inline __attribute__((always_inline)) void \
+NAME(const uint8_t *in, uint8_t *out, size_t frames, BiquadChain *chain, \
+		const int bps) \
+{ \
+	const int bytes = bps / 8; \
+	T tile[BQ_TILE_FRAMES] __attribute__((aligned(64))); \
+\
+	if (!chain->blk_ready) \
+		bq_chain_block(chain); \
+\
+	for (size_t done = 0; done < frames; done += BQ_TILE_FRAMES) \
+	{ \
+		const size_t len = (frames - done < BQ_TILE_FRAMES) ? \
+			frames - done : BQ_TILE_FRAMES; \
+		const size_t whole = len / L * L; \
+\
+		for (size_t i = 0; i < len; i++) \
+			tile[i] = dsp_decode(in + (done + i) * bytes, bps); \
+\
+		for (int s = 0; s < chain->num_stages; s++) \
+		{ \
+			const typeof(chain->P##blk[0]) *b = &chain->P##blk[s]; \
+			VEC h[L], c1, c2, p1, p2; \
+			T z1 = chain->P##z1[s][0]; \
+			T z2 = chain->P##z2[s][0]; \
+\
+			memcpy(h, b->h, sizeof(h)); \
+			memcpy(&c1, b->c1, sizeof(VEC)); \
+			memcpy(&c2, b->c2, sizeof(VEC)); \
+			memcpy(&p1, b->p1, sizeof(VEC)); \
+			memcpy(&p2, b->p2, sizeof(VEC)); \
+\
+			for (size_t i = 0; i < whole; i += L) \
+			{ \
+				VEC x; \
+				memcpy(&x, &tile[i], sizeof(x)); \
+\
+				/* Two sums so the adds are not one long chain */ \
+				VEC ya = c1 * z1, yb = c2 * z2; \
+				_Pragma("GCC unroll 8") \
+				for (int j = 0; j < L; j += 2) \
+				{ \
+					ya += tile[i + j] * h[j]; \
+					yb += tile[i + j + 1] * h[j + 1]; \
+				} \
+				VEC y = ya + yb; \
+\
+				VEC u1 = p1 * x, u2 = p2 * x; \
+				T s1, s2; \
+				HSUM(&u1, &u2, &s1, &s2); \
+\
+				T n1 = b->q[0][0] * z1 + b->q[0][1] * z2 + s1; \
+				z2 = b->q[1][0] * z1 + b->q[1][1] * z2 + s2; \
+				z1 = n1; \
+\
+				memcpy(&tile[i], &y, sizeof(y)); \
+			} \
+\
+			const T b0 = chain->P##b0[s][0], b1 = chain->P##b1[s][0]; \
+			const T b2 = chain->P##b2[s][0]; \
+			const T a1 = chain->P##a1[s][0], a2 = chain->P##a2[s][0]; \
+\
+			for (size_t i = whole; i < len; i++) \
+			{ \
+				T x = tile[i]; \
+				T y = b0 * x + z1; \
+				z1 = b1 * x - a1 * y + z2; \
+				z2 = b2 * x - a2 * y; \
+				tile[i] = y; \
+			} \
+\
+			chain->P##z1[s][0] = z1; \
+			chain->P##z2[s][0] = z2; \
+		} \
+\
+		for (size_t i = 0; i < len; i++) \
+			dsp_encode(out + (done + i) * bytes, (float) tile[i], bps); \
+	} \
+}
+
+DSP_MONO(dsp_mono_f, float, bq_v8f, BQ_BLOCK_F, , dsp_hsum2_f)
+DSP_MONO(dsp_mono_d, double, bq_v4d, BQ_BLOCK_D, d, dsp_hsum2_d)
+
+#define DSP_MONO_DEFINE(P, BPS) \
+static void \
+dsp_mono_##P##_##BPS(const uint8_t *in, uint8_t *out, \
+		size_t frames, BiquadChain *chain) \
+{ \
+	dsp_mono_##P(in, out, frames, chain, BPS); \
+}
+
+DSP_MONO_DEFINE(f, 16) DSP_MONO_DEFINE(f, 24) DSP_MONO_DEFINE(f, 32)
+DSP_MONO_DEFINE(d, 16) DSP_MONO_DEFINE(d, 24) DSP_MONO_DEFINE(d, 32)
+
+// [precision][bps]
+static const DspKernel dsp_mono_kernels[2][3] =
+{
+	{ dsp_mono_f_16, dsp_mono_f_24, dsp_mono_f_32 },
+	{ dsp_mono_d_16, dsp_mono_d_24, dsp_mono_d_32 },
+};
+
+// ------------------------------- //
+// -------- KERNEL TABLE --------- //
+// ------------------------------- //
+
+#define DSP_KERNEL_NAME(P, BPS, CH, N) dsp_k_##P##_##BPS##_##CH##_##N
+
+#define DSP_DEFINE(P, W, BPS, CH, N) \
+static void \
+DSP_KERNEL_NAME(P, BPS, CH, N)(const uint8_t *in, uint8_t *out, \
+		size_t frames, BiquadChain *chain) \
+{ \
+	dsp_fused_##P##W(in, out, frames, chain, BPS, CH, N); \
+}
+
+#define DSP_ENTRY(P, W, BPS, CH, N) \
+	[P##_IDX][BPS / 8 - 2][CH - 1][N] = DSP_KERNEL_NAME(P, BPS, CH, N),
+
+// (channels, lane width) pairs
+#define DSP_CHANNELS(X, P, BPS, N) \
+	X(P, 4, BPS, 1, N) X(P, 4, BPS, 2, N) X(P, 4, BPS, 3, N) \
+	X(P, 4, BPS, 4, N) X(P, 8, BPS, 5, N) X(P, 8, BPS, 6, N) \
+	X(P, 8, BPS, 7, N) X(P, 8, BPS, 8, N)
+
+// 0..BQ_UNROLL_STAGES, then DSP_LONG
+#define DSP_STAGES(X, P, BPS) \
+	DSP_CHANNELS(X, P, BPS, 0) DSP_CHANNELS(X, P, BPS, 1) \
+	DSP_CHANNELS(X, P, BPS, 2) DSP_CHANNELS(X, P, BPS, 3) \
+	DSP_CHANNELS(X, P, BPS, 4)
+
+_Static_assert(DSP_LONG == 4, "DSP_STAGES must end at DSP_LONG");
+
+#define DSP_ALL(X, P) \
+	DSP_STAGES(X, P, 16) DSP_STAGES(X, P, 24) DSP_STAGES(X, P, 32)
+
+#define f_IDX 0
+#define d_IDX 1
+
+DSP_ALL(DSP_DEFINE, f)
+DSP_ALL(DSP_DEFINE, d)
+
+// [precision][bps][channels][stages]
+static const DspKernel dsp_kernels[2][3][BQ_MAX_CHANNELS][DSP_LONG + 1] =
+{
+	DSP_ALL(DSP_ENTRY, f)
+	DSP_ALL(DSP_ENTRY, d)
+};
+
+DspKernel
+dsp_select(
+		int bps,
+		int channels,
+		BiquadChain *chain)
+{
+	if (bps != 16 && bps != 24 && bps != 32)
+		return NULL;
+
+	if (channels < 1 || channels > BQ_MAX_CHANNELS)
+		return NULL;
+
+	if (chain->num_stages < 0)
+		return NULL;
+
+	int p = (chain->precision == BQ_DOUBLE) ? 1 : 0;
+
+	if (channels == 1 && chain->num_stages > 0 && chain->ramp_left == 0)
+		return dsp_mono_kernels[p][bps / 8 - 2];
+
+	int n = (chain->num_stages > BQ_UNROLL_STAGES) ? DSP_LONG : chain->num_stages;
+	return dsp_kernels[p][bps / 8 - 2][channels - 1][n];
+}
+
+// ------------------------------- //
+// ------- FLOAT CONVERSION ------ //
+// ------------------------------- //
+
+// One loop per depth so the format branches fold away
+#define DSP_CONVERT(BPS) \
+static void \
+dsp_to_float_##BPS(const uint8_t *in, float *out, size_t samples) \
+{ \
+	for (size_t i = 0; i < samples; i++) \
+		out[i] = dsp_decode(in + i * (BPS / 8), BPS); \
+} \
+\
+static void \
+dsp_from_float_##BPS(const float *in, uint8_t *out, size_t samples) \
+{ \
+	for (size_t i = 0; i < samples; i++) \
+		dsp_encode(out + i * (BPS / 8), in[i], BPS); \
+}
+
+DSP_CONVERT(16)
+DSP_CONVERT(24)
+DSP_CONVERT(32)
+
+int
+dsp_format(int audio_format, int bps)
+{
+	if (audio_format == 1)
+	{
+		switch (bps)
+		{
+		case 8: return DSP_U8;
+		case 16: return DSP_S16;
+		case 24: return DSP_S24;
+		case 32: return DSP_S32;
+		default: return -1;
+		}
+	}
+
+	if (audio_format == 3)
+	{
+		switch (bps)
+		{
+		case 32: return DSP_F32;
+		case 64: return DSP_F64;
+		default: return -1;
+		}
+	}
+
+	return -1;
+}
+
+void
+dsp_to_float(
+		const uint8_t *in,
+		float *out,
+		size_t samples,
+		enum DspFormat format)
+{
+	switch (format)
+	{
+	case DSP_U8:
+		for (size_t i = 0; i < samples; i++)
+			out[i] = (in[i] - 128) / 128.0f;
+		break;
+	case DSP_S16: dsp_to_float_16(in, out, samples); break;
+	case DSP_S24: dsp_to_float_24(in, out, samples); break;
+	case DSP_S32: dsp_to_float_32(in, out, samples); break;
+	case DSP_F32:
+		if ((const void *) in != out)
+			memmove(out, in, samples * sizeof(float));
+		break;
+	case DSP_F64:
+		for (size_t i = 0; i < samples; i++)
+		{
+			double d;
+			memcpy(&d, in + i * sizeof(d), sizeof(d));
+			out[i] = d;
+		}
+		break;
+	}
+}
+
+void
+dsp_from_float(
+		const float *in,
+		uint8_t *out,
+		size_t samples,
+		enum DspFormat format)
+{
+	switch (format)
+	{
+	case DSP_U8:
+		for (size_t i = 0; i < samples; i++)
+		{
+			float x = (in[i] < 1.0f) ? in[i] : 1.0f;
+			x = (x > -1.0f) ? x : -1.0f;
+			out[i] = (int) (x * 127.0f) + 128;
+		}
+		break;
+	case DSP_S16: dsp_from_float_16(in, out, samples); break;
+	case DSP_S24: dsp_from_float_24(in, out, samples); break;
+	case DSP_S32: dsp_from_float_32(in, out, samples); break;
+	// Float keeps whatever headroom the EQ used: no clamp, no rounding
+	case DSP_F32:
+		if ((void *) out != in)
+			memmove(out, in, samples * sizeof(float));
+		break;
+	case DSP_F64:
+		for (size_t i = 0; i < samples; i++)
+		{
+			double d = in[i];
+			memcpy(out + i * sizeof(d), &d, sizeof(d));
+		}
+		break;
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "biquad.h"
+
+// One fused pass over a chunk of interleaved PCM:
+// decode to float -> biquad cascade -> clamp -> encode.
+// `in` and `out` may point to the same buffer.
+typedef void (*DspKernel)(
+		const uint8_t *in,
+		uint8_t *out,
+		size_t frames,
+		BiquadChain *chain);
+
+// Picks the kernel built for this bit depth, channel count and the
+// chain's current stage count / precision. Call again whenever the
+// chain is redesigned or ramped; mono switches between the serial and
+// the blocked kernels as a ramp starts and ends. Returns NULL for
+// unsupported formats.
+DspKernel
+dsp_select(
+		int bps,
+		int channels,
+		BiquadChain *chain);
+
+// Sample encodings of interleaved PCM, as found in WAV files
+enum DspFormat
+{
+	DSP_U8 = 0, // unsigned, 128 is silence
+	DSP_S16,
+	DSP_S24,    // packed, 3 bytes
+	DSP_S32,
+	DSP_F32,    // IEEE float, full scale is +-1.0
+	DSP_F64,
+};
+
+static inline int
+dsp_format_bytes(enum DspFormat format)
+{
+	static const uint8_t bytes[] = { 1, 2, 3, 4, 4, 8 };
+	return bytes[format];
+}
+
+// The DspFormat of a WAV audio_format (1 PCM, 3 IEEE float) at `bps`
+// bits, or -1 if there is none. The fused kernels above only take the
+// 16, 24 and 32-bit integer ones.
+int dsp_format(int audio_format, int bps);
+
+// Plain conversions for everything the fused kernels do not cover:
+// `samples` samples of any format to float, and back. Integer formats
+// are clamped on the way back; float ones are not, so they keep any
+// headroom. `in` and `out` may be the same buffer for DSP_F32.
+void
+dsp_to_float(
+		const uint8_t *in,
+		float *out,
+		size_t samples,
+		enum DspFormat format);
+
+void
+dsp_from_float(
+		const float *in,
+		uint8_t *out,
+		size_t samples,
+		enum DspFormat format);
+
+#endif
@@ -0,0 +1,373 @@
+#include "eq.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EQ_FRESH 4u
+
+static inline void
+eq_copy(EqParams *dst, const EqParams *src)
+{
+	memcpy(dst->bands, src->bands, src->num_bands * sizeof(BiquadInfo));
+	dst->num_bands = src->num_bands;
+	dst->precision = src->precision;
+}
+
+// Seqlock copy for the display; this thread is the only writer
+static void
+eq_show(EqShared *eq)
+{
+	unsigned int seq = atomic_load_explicit(&eq->shown_seq, memory_order_relaxed);
+
+	atomic_store_explicit(&eq->shown_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	eq_copy(&eq->shown, &eq->work);
+	eq->shown_band = eq->selected_band;
+
+	atomic_store_explicit(&eq->shown_seq, seq + 2, memory_order_release);
+}
+
+static void
+eq_publish(EqShared *eq)
+{
+	eq_copy(&eq->slots[eq->back], &eq->work);
+	eq->back = atomic_exchange_explicit(&eq->middle, eq->back | EQ_FRESH,
+			memory_order_acq_rel) & ~EQ_FRESH;
+
+	eq_show(eq);
+}
+
+int
+eq_init(
+		EqShared *eq,
+		const BiquadInfo *bands,
+		int num_bands,
+		enum BiquadPrecision precision)
+{
+	memset(eq, 0, sizeof(*eq));
+
+	// Three slots, work and shown
+	eq->storage = calloc(5 * (size_t) (num_bands > 0 ? num_bands : 1), sizeof(BiquadInfo));
+	if (!eq->storage)
+		return -1;
+
+	eq->num_bands = num_bands;
+
+	EqParams *params[5] = { &eq->slots[0], &eq->slots[1], &eq->slots[2], &eq->work, &eq->shown };
+	for (int i = 0; i < 5; i++)
+	{
+		params[i]->bands = eq->storage + i * num_bands;
+		params[i]->num_bands = num_bands;
+	}
+
+	memcpy(eq->work.bands, bands, num_bands * sizeof(BiquadInfo));
+	eq->work.precision = precision;
+
+	for (int i = 0; i < 3; i++)
+		eq_copy(&eq->slots[i], &eq->work);
+
+	eq->back = 0;
+	eq->front = 1;
+	atomic_init(&eq->middle, 2);
+	atomic_init(&eq->shown_seq, 0);
+	eq_copy(&eq->shown, &eq->work);
+
+	return 0;
+}
+
+void
+eq_free(EqShared *eq)
+{
+	free(eq->storage);
+	memset(eq, 0, sizeof(*eq));
+}
+
+// Appends a zeroed band to a growing list; NULL past EQ_MAX_BANDS or
+// out of memory
+static BiquadInfo *
+eq_append(BiquadInfo **list, int *count, int *cap, const char *path)
+{
+	if (*count == EQ_MAX_BANDS)
+	{
+		fprintf(stderr, "%s: more than %d filters\n\r", path, EQ_MAX_BANDS);
+		return NULL;
+	}
+
+	if (*count == *cap)
+	{
+		int grown_cap = *cap ? *cap * 2 : 16;
+		BiquadInfo *grown = realloc(*list, grown_cap * sizeof(BiquadInfo));
+		if (!grown)
+		{
+			fprintf(stderr, "%s: out of memory\n\r", path);
+			return NULL;
+		}
+
+		*list = grown;
+		*cap = grown_cap;
+	}
+
+	BiquadInfo *bq = &(*list)[(*count)++];
+	memset(bq, 0, sizeof(*bq));
+	return bq;
+}
+
+int
+eq_load(
+		const char *path,
+		BiquadInfo **bands,
+		int *num_bands,
+		enum BiquadPrecision *precision)
+{
+	static const struct { const char *name; enum FilterType type; int nargs; } types[] = {
+		{ "BQ_PEAKING", BQ_PEAKING, 3 },
+		{ "BQ_LOWSHELF", BQ_LOWSHELF, 3 },
+		{ "BQ_HIGHSHELF", BQ_HIGHSHELF, 3 },
+		{ "BQ_LOWPASS", BQ_LOWPASS, 2 },
+		{ "BQ_HIGHPASS", BQ_HIGHPASS, 2 },
+	};
+
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+	{
+		fprintf(stderr, "Failed to open %s file\n\r", path);
+		return -1;
+	}
+
+	BiquadInfo *list = NULL;
+	BiquadInfo *bq = NULL;
+	int count = 0, cap = 0;
+	int want = 0, arg = 0; // arguments of `bq` still to come
+	int graphic = -1;      // next ISO band while in a BQ_GRAPHIC list
+	int retval = 0;
+
+	char *line_buf = NULL;
+	size_t line_size = 0;
+
+	while (retval == 0 && getline(&line_buf, &line_size, fp) != -1)
+	{
+		char *comment = strchr(line_buf, '#');
+		if (comment) { *comment = '\0'; }
+
+		char *save;
+		for (char *tok = strtok_r(line_buf, " \t\r\n", &save);
+			tok && retval == 0;
+			tok = strtok_r(NULL, " \t\r\n", &save))
+		{
+			char *end;
+			float value = strtof(tok, &end);
+			uint8_t is_num = end != tok;
+
+			if (want > 0)
+			{
+				if (!is_num)
+				{
+					fprintf(stderr, "Not enough args for filter #%d\n\r", count);
+					retval = -1;
+					break;
+				}
+
+				bq->args[arg++] = value;
+				want--;
+				continue;
+			}
+
+			if (graphic >= 0 && is_num)
+			{
+				if (graphic == BQ_ISO_BANDS)
+				{
+					fprintf(stderr, "BQ_GRAPHIC takes at most %d gains\n\r", BQ_ISO_BANDS);
+					retval = -1;
+					break;
+				}
+
+				if (!(bq = eq_append(&list, &count, &cap, path)))
+				{
+					retval = -1;
+					break;
+				}
+
+				bq->type = BQ_PEAKING;
+				bq->args[0] = bq_iso_freq(graphic++);
+				bq->args[1] = EQ_GRAPHIC_Q;
+				bq->args[2] = value;
+				continue;
+			}
+			graphic = -1;
+
+			// Precision directives, may appear anywhere in the file
+			if (strcmp(tok, "BQ_AUTO") == 0) { *precision = BQ_AUTO; continue; }
+			if (strcmp(tok, "BQ_FLOAT") == 0) { *precision = BQ_FLOAT; continue; }
+			if (strcmp(tok, "BQ_DOUBLE") == 0) { *precision = BQ_DOUBLE; continue; }
+
+			if (strcmp(tok, "BQ_GRAPHIC") == 0)
+			{
+				graphic = 0;
+				continue;
+			}
+
+			for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+			{
+				if (strcmp(tok, types[t].name) != 0)
+					continue;
+
+				if (!(bq = eq_append(&list, &count, &cap, path)))
+				{
+					retval = -1;
+					break;
+				}
+
+				bq->type = types[t].type;
+				want = types[t].nargs;
+				arg = 0;
+				break;
+			}
+
+			// Anything else is skipped
+		}
+	}
+
+	if (retval == 0 && want > 0)
+	{
+		fprintf(stderr, "Not enough args for filter #%d\n\r", count);
+		retval = -1;
+	}
+
+	free(line_buf);
+	fclose(fp);
+
+	if (retval != 0)
+	{
+		free(list);
+		return -1;
+	}
+
+	*bands = list;
+	*num_bands = count;
+	return 0;
+}
+
+int
+eq_key(EqShared *eq, char key)
+{
+	if (eq->num_bands == 0)
+		return 0;
+
+	BiquadInfo *bq = &eq->work.bands[eq->selected_band];
+
+	// Digits reach the first ten bands, [ and ] step through all of them
+	if (key >= '0' && key <= '9' && key - '0' < eq->num_bands)
+	{
+		eq->selected_band = key - '0';
+		eq_show(eq);
+		return 1;
+	}
+	else if (key == '[' || key == ']')
+	{
+		int step = (key == ']') ? 1 : eq->num_bands - 1;
+		eq->selected_band = (eq->selected_band + step) % eq->num_bands;
+		eq_show(eq);
+		return 1;
+	}
+	// change type
+	else if (key == 't' || key == 'd' || key == 'f' || key == 'q')
+	{
+		eq->selected_setting = key;
+		return 1;
+	}
+	else if (key == 'j')
+	{
+		switch (eq->selected_setting)
+		{
+		case 't':
+			bq->type = (bq->type - 1) % BQ_MAX;
+			break;
+		case 'd':
+			bq->args[2] -= 0.1f;
+			break;
+		case 'f':
+			bq->args[0] -= 10.0f;
+
+			if (bq->args[0] < 0.0f)
+				bq->args[0] = 0.0f;
+			break;
+		case 'q':
+			if (bq->type == BQ_LOWPASS || bq->type == BQ_HIGHPASS)
+				break;
+
+			bq->args[1] -= 0.1f;
+
+			if (bq->args[1] < 0.1f)
+				bq->args[1] = 0.1f;
+			break;
+		}
+	}
+	else if (key == 'k')
+	{
+		switch (eq->selected_setting)
+		{
+		case 't':
+			if (bq->type == 0)
+				bq->type = BQ_MAX + 1;
+			bq->type = bq->type - 1;
+			break;
+		case 'd':
+			bq->args[2] += 0.1f;
+			break;
+		case 'f':
+			bq->args[0] += 10.0f;
+			break;
+		case 'q':
+			if (bq->type == BQ_LOWPASS ||
+				bq->type == BQ_HIGHPASS ||
+				bq->args[1] == 0.0f)
+			{
+				break;
+			}
+
+			bq->args[1] += 0.1f;
+			break;
+		}
+	}
+	else
+	{
+		return 0;
+	}
+
+	eq_publish(eq);
+	return 1;
+}
+
+const EqParams *
+eq_acquire(EqShared *eq, uint8_t *changed)
+{
+	*changed = 0;
+
+	if (atomic_load_explicit(&eq->middle, memory_order_relaxed) & EQ_FRESH)
+	{
+		eq->front = atomic_exchange_explicit(&eq->middle, eq->front,
+				memory_order_acq_rel) & ~EQ_FRESH;
+		*changed = 1;
+	}
+
+	return &eq->slots[eq->front];
+}
+
+int
+eq_snapshot(EqShared *eq, EqParams *out)
+{
+	unsigned int begin, end;
+	int selected;
+
+	do {
+		begin = atomic_load_explicit(&eq->shown_seq, memory_order_acquire);
+		eq_copy(out, &eq->shown);
+		selected = eq->shown_band;
+		atomic_thread_fence(memory_order_acquire);
+		end = atomic_load_explicit(&eq->shown_seq, memory_order_relaxed);
+	} while ((begin & 1) || begin != end);
+
+	return selected;
+}
@@ -0,0 +1,90 @@
+#ifndef EQ_H
+#define EQ_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "biquad.h"
+
+// Bands the EQ starts with when no filter file gives more
+#define EQ_DEFAULT_BANDS 3
+// Sanity limit for filter files
+#define EQ_MAX_BANDS 1024
+// Bandwidth of one third of an octave, for BQ_GRAPHIC bands
+#define EQ_GRAPHIC_Q 4.32f
+
+// One complete set of EQ settings
+typedef struct
+{
+	BiquadInfo *bands; // num_bands, owned by the EqShared or the caller
+	int num_bands;
+	enum BiquadPrecision precision;
+} EqParams;
+
+// Hands EQ settings from the input thread, which owns the key editor,
+// to the audio thread without locks. Triple buffered: each side owns
+// one slot and the third changes hands with a single atomic exchange,
+// so the audio thread never waits and never sees a half-written set.
+// The display reads a separate copy under a seqlock.
+typedef struct
+{
+	EqParams slots[3];
+	atomic_uint middle; // slot index, EQ_FRESH while unread
+	unsigned int back;  // input thread's slot
+	unsigned int front; // audio thread's slot
+
+	int num_bands;
+	BiquadInfo *storage; // the bands of every EqParams in here
+
+	// Input thread only
+	EqParams work;
+	int selected_band;
+	char selected_setting;
+
+	atomic_uint shown_seq;
+	EqParams shown;
+	int shown_band; // selected_band, for the display
+} EqShared;
+
+// Copies `num_bands` bands in. Returns -1 if out of memory.
+int
+eq_init(
+		EqShared *eq,
+		const BiquadInfo *bands,
+		int num_bands,
+		enum BiquadPrecision precision);
+
+void eq_free(EqShared *eq);
+
+// Reads a filter file into a malloc()ed array of bands. Whitespace
+// separated, anything after '#' ignored:
+//
+//   BQ_PEAKING | BQ_LOWSHELF | BQ_HIGHSHELF <freq> <q> <db gain>
+//   BQ_LOWPASS | BQ_HIGHPASS <freq> <q>
+//   BQ_GRAPHIC <db gain> ...  peaking bands on the ISO third octaves
+//                             from 20 Hz, up to BQ_ISO_BANDS gains
+//   BQ_AUTO | BQ_FLOAT | BQ_DOUBLE  sets *precision
+//
+// Arguments may be on the same line or the following ones. Returns -1
+// with a message on stderr.
+int
+eq_load(
+		const char *path,
+		BiquadInfo **bands,
+		int *num_bands,
+		enum BiquadPrecision *precision);
+
+// Input thread: applies an EQ key (band digit 0-9 or [ ] to step
+// through all bands, t/d/f/q to pick the setting, j/k to move it) and
+// publishes the result. Returns 0 if `key` is not an EQ key.
+int eq_key(EqShared *eq, char key);
+
+// Audio thread: the newest published settings. *changed is set when
+// they differ from the previous call's.
+const EqParams *eq_acquire(EqShared *eq, uint8_t *changed);
+
+// Any thread: a consistent copy for display into out->bands, which
+// must hold eq->num_bands. Returns the selected band.
+int eq_snapshot(EqShared *eq, EqParams *out);
+
+#endif
@@ -0,0 +1,90 @@
+#include "hist.h"
+
+#include <inttypes.h>
+
+void
+hist_init(Histogram *h)
+{
+	for (size_t b = 0; b < HIST_BUCKETS; b++)
+	{
+		atomic_init(&h->counts[b], 0);
+	}
+
+	atomic_init(&h->count, 0);
+	atomic_init(&h->sum, 0);
+	atomic_init(&h->max, 0);
+}
+
+uint64_t
+hist_bucket_max(size_t b)
+{
+	const size_t subs = 1u << HIST_SUB_BITS;
+	if (b < subs) { return b; }
+
+	int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t width = 1ull << (e - HIST_SUB_BITS);
+	uint64_t low = (uint64_t) (subs + (b & (subs - 1))) << (e - HIST_SUB_BITS);
+
+	return low + (width - 1);
+}
+
+uint64_t
+hist_quantile(const Histogram *h, double q)
+{
+	// Counted from the buckets rather than h->count, so a reader racing
+	// the writer still walks a consistent total
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total = 0;
+
+	for (size_t b = 0; b < HIST_BUCKETS; b++)
+	{
+		counts[b] = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+		total += counts[b];
+	}
+
+	if (total == 0) { return 0; }
+
+	uint64_t rank = (uint64_t) (q * (total - 1)) + 1;
+	uint64_t seen = 0;
+
+	for (size_t b = 0; b < HIST_BUCKETS; b++)
+	{
+		seen += counts[b];
+		if (seen >= rank)
+		{
+			// The top bucket reaches past anything actually seen
+			uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+			uint64_t bound = hist_bucket_max(b);
+			return (bound < max) ? bound : max;
+		}
+	}
+
+	return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void
+hist_json(const Histogram *h, FILE *f)
+{
+	uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+
+	fprintf(f, "{\"count\": %" PRIu64 ", \"mean\": %" PRIu64 ", \"max\": %" PRIu64
+			", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64
+			", \"p999\": %" PRIu64 ", \"buckets\": [",
+			count, count ? sum / count : 0,
+			(uint64_t) atomic_load_explicit(&h->max, memory_order_relaxed),
+			hist_quantile(h, 0.5), hist_quantile(h, 0.9),
+			hist_quantile(h, 0.99), hist_quantile(h, 0.999));
+
+	const char *sep = "";
+	for (size_t b = 0; b < HIST_BUCKETS; b++)
+	{
+		uint64_t n = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+		if (n == 0) { continue; }
+
+		fprintf(f, "%s[%" PRIu64 ", %" PRIu64 "]", sep, hist_bucket_max(b), n);
+		sep = ", ";
+	}
+
+	fprintf(f, "]}");
+}
@@ -0,0 +1,69 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Four buckets per power of two, enough for any uint64_t
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+// Histogram of durations (or any other counts) with buckets at most a
+// quarter of their lower bound wide, so quantiles come out within 25%.
+//
+// One writer, any number of readers, no locks: the writer never
+// read-modify-writes, it only stores what it alone computed, and a
+// reader at worst sees a value from a chunk that has not been counted
+// everywhere yet.
+typedef struct
+{
+	atomic_uint_fast64_t counts[HIST_BUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum;
+	atomic_uint_fast64_t max;
+} Histogram;
+
+void hist_init(Histogram *h);
+
+static inline size_t
+hist_bucket(uint64_t v)
+{
+	if (v < (1u << HIST_SUB_BITS)) { return v; }
+
+	int e = 63 - __builtin_clzll(v);
+	size_t sub = (v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+	return ((size_t) (e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Largest value that lands in bucket `b`
+uint64_t hist_bucket_max(size_t b);
+
+// Writer only
+static inline void
+hist_add(Histogram *h, uint64_t v)
+{
+	atomic_uint_fast64_t *bucket = &h->counts[hist_bucket(v)];
+
+	atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+	atomic_store_explicit(&h->count, atomic_load_explicit(&h->count, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+	atomic_store_explicit(&h->sum, atomic_load_explicit(&h->sum, memory_order_relaxed) + v,
+			memory_order_relaxed);
+
+	if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+	{
+		atomic_store_explicit(&h->max, v, memory_order_relaxed);
+	}
+}
+
+// Upper bound of the q-quantile, 0 <= q <= 1. 0 while empty.
+uint64_t hist_quantile(const Histogram *h, double q);
+
+// Writes `h` as a JSON object: count, mean, max, p50, p90, p99, p999
+// and the non-empty buckets as [max value, count] pairs
+void hist_json(const Histogram *h, FILE *f);
+
+#endif
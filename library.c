@@ -0,0 +1,313 @@
+#include "library.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wav.h"
+
+static int
+lib_map(Library *lib)
+{
+	int fd = open(lib->index_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) { return -1; }
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(LibHeader))
+	{
+		close(fd);
+		return -1;
+	}
+
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) { return -1; }
+
+	// Anything that does not add up is treated as no index at all. The
+	// records are bounded by the file first, so records_end cannot pass
+	// its end and the strings are exactly what is left after them.
+	const LibHeader *h = (const LibHeader *) map;
+	const size_t file_size = st.st_size;
+	const size_t max_count = (file_size - sizeof(LibHeader)) / sizeof(LibRecord);
+	size_t records_end = 0;
+
+	if (h->count <= max_count)
+	{
+		records_end = sizeof(LibHeader) + h->count * sizeof(LibRecord);
+	}
+
+	if (memcmp(h->magic, LIB_MAGIC, 8) != 0 ||
+		h->version != LIB_VERSION ||
+		h->record_size != sizeof(LibRecord) ||
+		records_end == 0 ||
+		h->strings_size != file_size - records_end ||
+		(h->strings_size > 0 && map[file_size - 1] != '\0'))
+	{
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	lib->map = map;
+	lib->map_size = st.st_size;
+	lib->records = (const LibRecord *) (map + sizeof(LibHeader));
+	lib->strings = (const char *) (map + records_end);
+	lib->count = h->count;
+
+	for (size_t i = 0; i < lib->count; i++)
+	{
+		if (lib->records[i].path_offset >= h->strings_size)
+		{
+			lib_close(lib);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int
+lib_open(Library *lib, const char *root)
+{
+	char real[PATH_MAX];
+
+	memset(lib, 0, sizeof(*lib));
+
+	if (!realpath(root, real)) { return -1; }
+
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char dir[768];
+
+	if (cache && cache[0]) { snprintf(dir, sizeof(dir), "%s/yacht", cache); }
+	else if (home && home[0]) { snprintf(dir, sizeof(dir), "%s/.cache/yacht", home); }
+	else { return 0; }
+
+	// FNV-1a of the resolved root names the index
+	uint64_t h = 14695981039346656037ull;
+	for (const char *p = real; *p; p++)
+	{
+		h = (h ^ (uint8_t) *p) * 1099511628211ull;
+	}
+
+	snprintf(lib->index_path, sizeof(lib->index_path), "%s/%016llx.idx",
+			dir, (unsigned long long) h);
+
+	lib_map(lib);
+	return 0;
+}
+
+void
+lib_close(Library *lib)
+{
+	if (lib->map) { munmap(lib->map, lib->map_size); }
+
+	lib->map = NULL;
+	lib->map_size = 0;
+	lib->records = NULL;
+	lib->strings = NULL;
+	lib->count = 0;
+}
+
+const LibRecord *
+lib_find(const Library *lib, const char *path)
+{
+	size_t lo = 0, hi = lib->count;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(lib_path(lib, &lib->records[mid]), path);
+
+		if (cmp == 0) { return &lib->records[mid]; }
+		if (cmp < 0) { lo = mid + 1; }
+		else { hi = mid; }
+	}
+
+	return NULL;
+}
+
+void
+lib_scan_hook(void *ctx, int dir_fd, const char *name, ScanEntry *e)
+{
+	Library *lib = ctx;
+	struct stat st;
+
+	if (fstatat(dir_fd, name, &st, 0) != 0) { return; }
+
+	e->mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	e->size = st.st_size;
+
+	if (!e->is_wav) { return; }
+
+	const LibRecord *r = lib_find(lib, e->path);
+	if (r && r->mtime_ns == e->mtime_ns && r->size == e->size)
+	{
+		e->frames = r->frames;
+		e->sample_rate = r->sample_rate;
+		e->channels = r->channels;
+		e->bps = r->bps;
+		return;
+	}
+
+	e->probed = 1;
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) { return; }
+
+	WAVHeader header;
+	if (wav_probe(fd, &header) == 0 && header.block_align > 0)
+	{
+		e->frames = header.subchunk2_size / header.block_align;
+		e->sample_rate = header.sample_rate;
+		e->channels = header.num_channels;
+		e->bps = header.bps;
+	}
+
+	close(fd);
+}
+
+static int
+lib_entry_cmp(const void *a, const void *b)
+{
+	return strcmp((*(ScanEntry *const *) a)->path, (*(ScanEntry *const *) b)->path);
+}
+
+static int
+lib_write(int fd, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	while (size > 0)
+	{
+		ssize_t n = write(fd, p, size);
+		if (n < 0)
+		{
+			if (errno == EINTR) { continue; }
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+int
+lib_update(
+		Library *lib,
+		ScanEntry **entries,
+		size_t count,
+		size_t *changed,
+		size_t *removed)
+{
+	size_t kept = 0;
+
+	*changed = 0;
+	*removed = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const LibRecord *r = lib_find(lib, entries[i]->path);
+
+		if (r) { kept++; }
+		if (!r || r->mtime_ns != entries[i]->mtime_ns || r->size != entries[i]->size)
+		{
+			(*changed)++;
+		}
+	}
+	*removed = lib->count - kept;
+
+	if (!lib->index_path[0]) { return 0; }
+
+	// Same on disk as before: keep the mapping
+	if (*changed == 0 && *removed == 0 && lib->map) { return 0; }
+
+	qsort(entries, count, sizeof(ScanEntry *), lib_entry_cmp);
+
+	LibRecord *records = calloc(count ? count : 1, sizeof(LibRecord));
+	if (!records) { return -1; }
+
+	LibHeader header = {
+		.magic = LIB_MAGIC,
+		.version = LIB_VERSION,
+		.record_size = sizeof(LibRecord),
+		.count = count,
+	};
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const ScanEntry *e = entries[i];
+
+		records[i].path_offset = header.strings_size;
+		records[i].mtime_ns = e->mtime_ns;
+		records[i].size = e->size;
+		records[i].frames = e->frames;
+		records[i].sample_rate = e->sample_rate;
+		records[i].channels = e->channels;
+		records[i].bps = e->bps;
+		records[i].is_wav = e->is_wav;
+
+		header.strings_size += strlen(e->path) + 1;
+	}
+
+	char *strings = malloc(header.strings_size ? header.strings_size : 1);
+	if (!strings)
+	{
+		free(records);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		strcpy(strings + records[i].path_offset, entries[i]->path);
+	}
+
+	// The cache directory may not exist yet
+	char dir[sizeof(lib->index_path)];
+	snprintf(dir, sizeof(dir), "%s", lib->index_path);
+	for (char *p = dir + 1; *p; p++)
+	{
+		if (*p != '/') { continue; }
+
+		*p = '\0';
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+
+	// Written next to the old index and renamed over it, so readers
+	// only ever map a complete file
+	char tmp[sizeof(lib->index_path) + 16];
+	snprintf(tmp, sizeof(tmp), "%s.%d", lib->index_path, (int) getpid());
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		free(records);
+		free(strings);
+		return -1;
+	}
+
+	int retval = lib_write(fd, &header, sizeof(header));
+	if (retval == 0) { retval = lib_write(fd, records, count * sizeof(LibRecord)); }
+	if (retval == 0) { retval = lib_write(fd, strings, header.strings_size); }
+
+	free(records);
+	free(strings);
+
+	if (close(fd) != 0 || retval != 0 || rename(tmp, lib->index_path) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %s\n\r", lib->index_path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	lib_close(lib);
+	lib_map(lib);
+	return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scan.h"
+
+// On-disk index of one scan root, mapped read-only:
+//
+//   LibHeader | LibRecord[count], sorted by path | path strings
+//
+// Kept in $XDG_CACHE_HOME (or ~/.cache) as yacht/<hash of root>.idx.
+// A warm start only maps it; the scan that follows re-reads just the
+// files whose mtime or size changed and then writes a new index.
+#define LIB_MAGIC "YACHTIDX"
+#define LIB_VERSION 1
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t count;
+	uint64_t strings_size;
+} LibHeader;
+
+typedef struct
+{
+	uint64_t path_offset; // into the strings, NUL terminated
+	int64_t mtime_ns;
+	uint64_t size;
+	uint64_t frames;
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t bps;
+	uint8_t is_wav;
+	uint8_t pad[7];
+} LibRecord;
+
+typedef struct
+{
+	char index_path[1024]; // empty when there is nowhere to keep one
+
+	uint8_t *map;
+	size_t map_size;
+
+	const LibRecord *records;
+	const char *strings;
+	size_t count;
+} Library;
+
+// Maps the index for `root` if there is a valid one; count is 0
+// otherwise. Only fails (-1) when `root` cannot be resolved.
+int lib_open(Library *lib, const char *root);
+
+void lib_close(Library *lib);
+
+static inline const char *
+lib_path(const Library *lib, const LibRecord *r)
+{
+	return lib->strings + r->path_offset;
+}
+
+// Binary search by path relative to the root; NULL if not indexed
+const LibRecord *lib_find(const Library *lib, const char *path);
+
+// ScanHook: stats the file and takes the WAV metadata from the index
+// when mtime and size still match, or probes the header otherwise.
+// Safe on any number of scan workers at once.
+void lib_scan_hook(void *lib, int dir_fd, const char *name, ScanEntry *e);
+
+// Replaces the index with the `count` entries of a finished scan (as
+// filled in by lib_scan_hook) and maps the new one. *changed and
+// *removed get the number of new or modified and of vanished files.
+int
+lib_update(
+		Library *lib,
+		ScanEntry **entries,
+		size_t count,
+		size_t *changed,
+		size_t *removed);
+
+#endif
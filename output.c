@@ -0,0 +1,397 @@
+#include "output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+const LatencyProfile out_profiles[] =
+{
+	{ "low-latency",    2500, 2 }, // 5 ms
+	{ "balanced",      25000, 4 }, // 100 ms
+	{ "power-save",   500000, 4 }, // 2 s, one wakeup per 500 ms
+	{ NULL, 0, 0 },
+};
+
+const LatencyProfile *
+out_find_profile(const char *name)
+{
+	for (const LatencyProfile *p = out_profiles; p->name; p++)
+	{
+		if (strcmp(p->name, name) == 0) { return p; }
+	}
+
+	return NULL;
+}
+
+static inline uint64_t
+out_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// Without a profile this is the old fixed 500 ms snd_pcm_set_params()
+// setup; with one, period and buffer come from the profile. Either way
+// the ring is made max_buffer_us long if that is longer.
+static int
+out_configure(
+		Output *out,
+		snd_pcm_format_t format,
+		snd_pcm_access_t access,
+		unsigned int channels,
+		unsigned int rate,
+		const LatencyProfile *profile,
+		unsigned int max_buffer_us)
+{
+	// The fixed setup's own 125 ms periods, in a longer ring, so that
+	// wakeups stay as frequent as before
+	static const LatencyProfile fixed = { "fixed", 125000, 4 };
+
+	if (!profile && max_buffer_us <= 500000)
+	{
+		return snd_pcm_set_params(out->pcm, format, access, channels, rate, 1, 500000);
+	}
+	else if (!profile)
+	{
+		profile = &fixed;
+	}
+
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	if ((err = snd_pcm_hw_params_any(out->pcm, hw)) < 0) { return err; }
+	if ((err = snd_pcm_hw_params_set_rate_resample(out->pcm, hw, 1)) < 0) { return err; }
+	if ((err = snd_pcm_hw_params_set_access(out->pcm, hw, access)) < 0) { return err; }
+	if ((err = snd_pcm_hw_params_set_format(out->pcm, hw, format)) < 0) { return err; }
+	if ((err = snd_pcm_hw_params_set_channels(out->pcm, hw, channels)) < 0) { return err; }
+
+	unsigned int actual_rate = rate;
+	if ((err = snd_pcm_hw_params_set_rate_near(out->pcm, hw, &actual_rate, NULL)) < 0) { return err; }
+
+	snd_pcm_uframes_t period = (snd_pcm_uframes_t) rate * profile->period_us / 1000000;
+	snd_pcm_uframes_t buffer = period * profile->periods;
+	snd_pcm_uframes_t max_buffer = (snd_pcm_uframes_t) rate * max_buffer_us / 1000000;
+	snd_pcm_uframes_t start = 0; // 0: once the ring is full
+	if (max_buffer > buffer)
+	{
+		start = buffer;
+		buffer = max_buffer;
+	}
+
+	if ((err = snd_pcm_hw_params_set_period_size_near(out->pcm, hw, &period, NULL)) < 0) { return err; }
+	if ((err = snd_pcm_hw_params_set_buffer_size_near(out->pcm, hw, &buffer)) < 0) { return err; }
+	if ((err = snd_pcm_hw_params(out->pcm, hw)) < 0) { return err; }
+
+	snd_pcm_hw_params_get_period_size(hw, &period, NULL);
+	snd_pcm_hw_params_get_buffer_size(hw, &buffer);
+
+	// Start once the configured buffer is queued, which is the whole
+	// ring unless it was made longer to grow into; wake up once a
+	// period is free
+	if (start == 0 || start > buffer) { start = buffer; }
+	if ((err = snd_pcm_sw_params_current(out->pcm, sw)) < 0) { return err; }
+	if ((err = snd_pcm_sw_params_set_start_threshold(out->pcm, sw, start)) < 0) { return err; }
+	if ((err = snd_pcm_sw_params_set_avail_min(out->pcm, sw, period)) < 0) { return err; }
+
+	return snd_pcm_sw_params(out->pcm, sw);
+}
+
+int
+out_probe_format(snd_pcm_format_t format)
+{
+	snd_pcm_t *pcm;
+	snd_pcm_hw_params_t *hw;
+
+	if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) { return 0; }
+
+	snd_pcm_hw_params_alloca(&hw);
+	int ok = snd_pcm_hw_params_any(pcm, hw) >= 0 &&
+			snd_pcm_hw_params_test_format(pcm, hw, format) == 0;
+
+	snd_pcm_close(pcm);
+	return ok;
+}
+
+int
+out_open(
+		Output *out,
+		snd_pcm_format_t format,
+		unsigned int channels,
+		unsigned int rate,
+		size_t frame_size,
+		size_t default_chunk,
+		const LatencyProfile *profile,
+		unsigned int max_buffer_ms,
+		int use_mmap,
+		int lock_memory)
+{
+	int err;
+
+	memset(out, 0, sizeof(*out));
+	out->frame_size = frame_size;
+
+	if ((err = snd_pcm_open(&out->pcm, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+	{
+		fprintf(stderr, "Failed to open audio device: %s\n\r", snd_strerror(err));
+		return -1;
+	}
+
+	if (use_mmap)
+	{
+		err = out_configure(out, format, SND_PCM_ACCESS_MMAP_INTERLEAVED,
+				channels, rate, profile, max_buffer_ms * 1000);
+
+		if (err == 0)
+		{
+			out->use_mmap = 1;
+		}
+		else
+		{
+			fprintf(stderr, "mmap access unavailable (%s), using writes.\n\r",
+					snd_strerror(err));
+		}
+	}
+
+	if (!out->use_mmap)
+	{
+		err = out_configure(out, format, SND_PCM_ACCESS_RW_INTERLEAVED,
+				channels, rate, profile, max_buffer_ms * 1000);
+
+		if (err < 0)
+		{
+			fprintf(stderr, "Failed to set audio params: %s\n\r", snd_strerror(err));
+			snd_pcm_close(out->pcm);
+			return -1;
+		}
+	}
+
+	snd_pcm_get_params(out->pcm, &out->buffer_size, &out->period_size);
+
+	// Queue what was asked for; the rest of the ring is headroom. With
+	// no room to grow the whole ring is used, as the device rounded it.
+	snd_pcm_uframes_t base = profile ?
+		(snd_pcm_uframes_t) rate * profile->period_us / 1000000 * profile->periods :
+		rate / 2;
+	if ((snd_pcm_uframes_t) rate * max_buffer_ms / 1000 <= base) { base = out->buffer_size; }
+	out->base_fill = (base < out->buffer_size) ? base : out->buffer_size;
+	out->fill_target = out->base_fill;
+	out->last_change_ms = out_now_ms();
+
+	// A profile means one chunk per period, so each wakeup fills
+	// exactly the room that just became free
+	out->chunk_frames = profile ? out->period_size : default_chunk;
+
+	if (!out->use_mmap)
+	{
+		out->staging = malloc(out->chunk_frames * frame_size);
+		out->staging_frames = out->chunk_frames;
+		if (!out->staging)
+		{
+			snd_pcm_close(out->pcm);
+			return -1;
+		}
+
+		if (lock_memory)
+		{
+			mlock(out->staging, out->chunk_frames * frame_size);
+		}
+	}
+
+	out->num_pfds = snd_pcm_poll_descriptors_count(out->pcm);
+	if (out->num_pfds < 0) { out->num_pfds = 0; }
+	out->pfds = calloc(out->num_pfds + 1, sizeof(struct pollfd));
+	snd_pcm_poll_descriptors(out->pcm, out->pfds, out->num_pfds);
+
+	return 0;
+}
+
+void
+out_close(Output *out)
+{
+	snd_pcm_drain(out->pcm);
+	snd_pcm_close(out->pcm);
+	free(out->staging);
+	free(out->pfds);
+	out->staging = NULL;
+	out->pfds = NULL;
+}
+
+int
+out_recover(
+		Output *out,
+		int err)
+{
+	uint64_t now = out_now_ms();
+
+	if (err == -EPIPE)
+	{
+		out->xruns++;
+		out->burst = (now - out->last_xrun_ms < OUT_XRUN_WINDOW_MS) ? out->burst + 1 : 1;
+		out->last_xrun_ms = now;
+		out->last_change_ms = now;
+
+		// The ring is empty now, so a bigger target costs no extra gap
+		if (out->burst >= OUT_XRUN_BURST && out->fill_target < out->buffer_size)
+		{
+			out->fill_target = (out->fill_target * 2 < out->buffer_size) ?
+				out->fill_target * 2 : out->buffer_size;
+			out->burst = 0;
+		}
+	}
+	else if (err == -ESTRPIPE)
+	{
+		// The system slept; nothing to learn about its load
+		out->suspends++;
+	}
+
+	// Underruns are prepared, suspends resumed (or prepared if the
+	// driver cannot resume)
+	err = snd_pcm_recover(out->pcm, err, 1);
+	if (err < 0) { err = snd_pcm_prepare(out->pcm); }
+
+	return err;
+}
+
+// Halves the fill target after OUT_STABLE_MS without an xrun. Nothing
+// is dropped: writes just wait until the queue has run down to it.
+static void
+out_settle(Output *out)
+{
+	if (out->fill_target <= out->base_fill) { return; }
+
+	uint64_t now = out_now_ms();
+	if (now - out->last_change_ms < OUT_STABLE_MS) { return; }
+
+	out->fill_target = (out->fill_target / 2 > out->base_fill) ?
+		out->fill_target / 2 : out->base_fill;
+	out->last_change_ms = now;
+}
+
+int
+out_wait(
+		Output *out,
+		size_t frames,
+		int wake_fd)
+{
+	out_settle(out);
+
+	// Room for the chunk on top of the part of the ring left empty
+	size_t want = frames + (out->buffer_size - out->fill_target);
+	want = (want > out->buffer_size) ? out->buffer_size : want;
+	struct pollfd *wake = &out->pfds[out->num_pfds];
+
+	for (;;)
+	{
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(out->pcm);
+		if (avail < 0) { return avail; }
+		if ((size_t) avail >= want) { return 1; }
+
+		// Filled to the target but nothing has started it yet
+		if (snd_pcm_state(out->pcm) == SND_PCM_STATE_PREPARED)
+		{
+			int err = snd_pcm_start(out->pcm);
+			if (err < 0) { return err; }
+		}
+
+		wake->fd = wake_fd;
+		wake->events = POLLIN;
+		wake->revents = 0;
+
+		if (poll(out->pfds, out->num_pfds + 1, -1) < 0)
+		{
+			if (errno == EINTR) { continue; }
+			return -errno;
+		}
+
+		if (wake->revents & POLLIN) { return 0; }
+
+		unsigned short revents;
+		snd_pcm_poll_descriptors_revents(out->pcm, out->pfds, out->num_pfds, &revents);
+		if (revents & POLLERR) { return -EPIPE; }
+	}
+}
+
+snd_pcm_sframes_t
+out_begin(
+		Output *out,
+		size_t frames,
+		uint8_t **dst)
+{
+	if (!out->use_mmap)
+	{
+		*dst = out->staging;
+		return (frames > out->staging_frames) ? out->staging_frames : frames;
+	}
+
+	int err = out_wait(out, frames, -1);
+	if (err < 0) { return err; }
+
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset;
+	snd_pcm_uframes_t n = (frames > out->buffer_size) ? out->buffer_size : frames;
+
+	err = snd_pcm_mmap_begin(out->pcm, &areas, &offset, &n);
+	if (err < 0) { return err; }
+
+	// Interleaved: every channel shares one area, step is a whole frame
+	*dst = (uint8_t *) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+	out->mmap_offset = offset;
+
+	// May be short when the area wraps around the end of the ring
+	return n;
+}
+
+snd_pcm_sframes_t
+out_commit(
+		Output *out,
+		size_t frames)
+{
+	if (!out->use_mmap)
+	{
+		return snd_pcm_writei(out->pcm, out->staging, frames);
+	}
+
+	snd_pcm_sframes_t committed =
+		snd_pcm_mmap_commit(out->pcm, out->mmap_offset, frames);
+
+	if (committed >= 0 && (size_t) committed != frames)
+	{
+		return -EPIPE;
+	}
+
+	return committed;
+}
+
+snd_pcm_sframes_t
+out_write(
+		Output *out,
+		const uint8_t *src,
+		size_t frames)
+{
+	if (!out->use_mmap)
+	{
+		return snd_pcm_writei(out->pcm, src, frames);
+	}
+
+	size_t done = 0;
+	while (done < frames)
+	{
+		uint8_t *dst;
+		snd_pcm_sframes_t n = out_begin(out, frames - done, &dst);
+		if (n < 0) { return done ? (snd_pcm_sframes_t) done : n; }
+
+		memcpy(dst, src + done * out->frame_size, n * out->frame_size);
+
+		n = out_commit(out, n);
+		if (n < 0) { return done ? (snd_pcm_sframes_t) done : n; }
+		done += n;
+	}
+
+	return done;
+}
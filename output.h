@@ -0,0 +1,143 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+// Period length and count for snd_pcm_hw_params; the buffer is
+// period_us * periods long.
+typedef struct
+{
+	const char *name;
+	unsigned int period_us;
+	unsigned int periods;
+} LatencyProfile;
+
+// NULL-terminated: low-latency, balanced, power-save
+extern const LatencyProfile out_profiles[];
+
+// Adaptive buffering: this many xruns, each within the window of the
+// one before, double the queued audio; this long without one halves it
+// again
+#define OUT_XRUN_BURST 2
+#define OUT_XRUN_WINDOW_MS 10000
+#define OUT_STABLE_MS 30000
+
+const LatencyProfile *out_find_profile(const char *name);
+
+// Playback device behind a begin/commit interface so the DSP kernels
+// can write their output wherever the samples end up:
+//  - RW mode: into a staging buffer, copied out by snd_pcm_writei()
+//  - mmap mode: straight into the device ring buffer, no copy
+typedef struct
+{
+	snd_pcm_t *pcm;
+	int use_mmap;
+
+	size_t frame_size;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+
+	// Frames the audio thread should handle per wakeup
+	size_t chunk_frames;
+
+	// RW mode
+	uint8_t *staging;
+	size_t staging_frames;
+
+	// mmap mode, offset returned by the last snd_pcm_mmap_begin()
+	snd_pcm_uframes_t mmap_offset;
+
+	// Device descriptors plus one trailing slot for a wake-up fd
+	struct pollfd *pfds;
+	int num_pfds;
+
+	// Adaptive buffering. The ring is allocated at the upper limit once
+	// and only fill_target frames of it are kept queued, so the amount
+	// of audio buffered can change without reopening the device or
+	// dropping what is queued. Never below base_fill, the configured
+	// buffer.
+	snd_pcm_uframes_t fill_target;
+	snd_pcm_uframes_t base_fill;
+
+	// Since open: underruns, suspends, and xruns in the current burst
+	unsigned int xruns;
+	unsigned int suspends;
+	unsigned int burst;
+	uint64_t last_xrun_ms;
+	uint64_t last_change_ms;
+} Output;
+
+// Opens the default device. Falls back to RW access when mmap access
+// is requested but the device refuses it. With a NULL profile the
+// device gets a 500 ms buffer and chunks are default_chunk frames;
+// otherwise a chunk is one period. lock_memory mlock()s the staging
+// buffer.
+//
+// max_buffer_ms 0 (or no more than that buffer) keeps the buffer
+// fixed, and a NULL profile then gets snd_pcm_set_params()'s own
+// setup. Above it, the ring is max_buffer_ms long and the buffer grows
+// into it while xruns repeat; a NULL profile then gets 125 ms periods.
+int
+out_open(
+		Output *out,
+		snd_pcm_format_t format,
+		unsigned int channels,
+		unsigned int rate,
+		size_t frame_size,
+		size_t default_chunk,
+		const LatencyProfile *profile,
+		unsigned int max_buffer_ms,
+		int use_mmap,
+		int lock_memory);
+
+void out_close(Output *out);
+
+// Whether the default device takes samples in `format`, e.g. whether
+// float can go out as float. Opens and closes the device, so only ask
+// while it is not open.
+int out_probe_format(snd_pcm_format_t format);
+
+// Brings the device back after a wait, write or commit failed with
+// `err`: an underrun (-EPIPE) is counted and may grow the buffer, a
+// suspend (-ESTRPIPE) is resumed where the driver allows it. Returns 0
+// once writes can go on, or a negative ALSA error code.
+int
+out_recover(
+		Output *out,
+		int err);
+
+// Sleeps until the device has room for `frames` frames (capped at the
+// ring size) past the fill target, or `wake_fd` becomes readable. Returns 1 for room, 0 for
+// wake_fd, or a negative ALSA error code. wake_fd may be -1.
+int
+out_wait(
+		Output *out,
+		size_t frames,
+		int wake_fd);
+
+// Returns how many frames (<= frames) may be written at *dst, or a
+// negative ALSA error code. Blocks until the device has room.
+snd_pcm_sframes_t
+out_begin(
+		Output *out,
+		size_t frames,
+		uint8_t **dst);
+
+// Hands `frames` frames written since out_begin() to the device.
+snd_pcm_sframes_t
+out_commit(
+		Output *out,
+		size_t frames);
+
+// Writes frames that are already in the device format, e.g. straight
+// from the mapped file when the EQ is bypassed. RW mode hands `src`
+// to the device without any staging copy.
+snd_pcm_sframes_t
+out_write(
+		Output *out,
+		const uint8_t *src,
+		size_t frames);
+
+#endif
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE // pthread_attr_setaffinity_np
+
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,51 +14,135 @@
 #include <ctype.h>
 
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
 
 #include "biquad.h"
+#include "conv.h"
+#include "dsp.h"
+#include "eq.h"
+#include "hist.h"
+#include "output.h"
+#include "render.h"
+#include "resample.h"
+#include "library.h"
+#include "scan.h"
+#include "search.h"
+#include "stream.h"
+#include "wav.h"
 
 #define CHUNK_FRAMES 4096
-#define MAX_STRINGS 200
+// How much of the next track the prefetch thread faults in up front
+#define PREFAULT_BYTES (4 * 1024 * 1024)
+// With --mlock, how much of the file ahead of the play position is
+// kept locked in memory
+#define MLOCK_WINDOW (8 * 1024 * 1024)
 #define MAX_STRING_LEN 1024
+// EQ rows on screen; longer EQs scroll with the selected band
+#define EQ_SHOWN_BANDS 10
+// Seeks: audio run through the filters ahead of the target, so they
+// hold the state of that spot; how much of the file after it is
+// requested from the disk at once; how far one scrub step goes
+#define SEEK_PREROLL_MS 10
+#define SEEK_PREFAULT_BYTES (1024 * 1024)
+#define SCRUB_STEP_MS 200
+// After a seek the device is started once this many chunks are in,
+// not once the whole ring is full
+#define SEEK_START_CHUNKS 2
 
 #define move_cursor(x,y) fprintf(stdout, "\x1b[%d;%dH", (y), (x))
 #define hide_cursor() fprintf(stdout, "\x1b[?25l")
 #define show_cursor() fprintf(stdout, "\x1b[?25h")
 
-// no support for IEEE float
-typedef struct
-{
-    // RIFF Chunk
-	char chunk_id[4];
-	uint32_t chunk_size;
-	char format[4];
-
-    // FMT Subchunk
-	char subchunk1_id[4];
-	uint32_t subchunk1_size;
-	uint16_t audio_format;
-	uint16_t num_channels;
-	uint32_t sample_rate;
-	uint32_t byte_rate; // per sec
-	uint16_t block_align;
-	uint16_t bps;
-
-    // Data Subchunk
-	char subchunk2_id[4];
-	uint32_t subchunk2_size;
-} __attribute__((packed))
-WAVHeader;
-
 enum PlayerState {
 	PLAYER_STOPPED,
 	PLAYER_PAUSED,
 	PLAYER_PLAYING,
 };
 
+// Single-producer single-consumer key queue, input thread -> audio
+// thread. Size must be a power of two.
+#define KEY_QUEUE_SIZE 64
+// Queued by the input thread once a time is typed in, never by a key
+// press: go to info->goto_ms
+#define KEY_GOTO '\x01'
+
+typedef struct
+{
+	char keys[KEY_QUEUE_SIZE];
+	atomic_uint head; // written by the input thread only
+	atomic_uint tail; // written by the audio thread only
+} KeyQueue;
+
+// What other threads may see of the audio thread's progress
+typedef struct
+{
+	size_t frames_played;
+	size_t total_frames;
+	const char *filename;
+	const uint8_t *pcm_data;
+	size_t frame_size;
+	enum PlayerState state;
+	uint8_t loop;
+	uint8_t scrub;
+
+	// Seek-to-sound latency: key handled to device running again
+	unsigned int seeks;
+	float seek_ms;
+	float seek_ms_max;
+} AudioStatus;
+
+// Hot-path timings of the audio thread, which is their only writer;
+// the display and the exit report read them without locks. Times are
+// ns per chunk. The fused int -> int kernels decode, filter and encode
+// in one pass, so their chunks count as filtering only.
+typedef struct
+{
+	Histogram convert; // decoding, resampling, encoding
+	Histogram filter;  // EQ and convolver
+	Histogram dsp;     // both: what has to fit in a chunk's length
+	Histogram write;   // out_begin() and the write or commit, blocking included
+
+	atomic_uint xruns;
+	atomic_uint suspends;
+	atomic_uint fill;     // frames still queued when the last chunk was started
+	atomic_uint fill_min; // lowest of those while running, UINT_MAX before
+	atomic_uint buffer_frames; // kept queued, which grows after xruns
+	atomic_uint buffer_us;
+	atomic_uint chunk_us; // length of one chunk at the device rate
+} LoopStats;
+
+// One mapped WAV file, ready to play
+typedef struct
+{
+	char path[1300];
+	WAVHeader header;
+	char *file_buf;
+	size_t file_size;
+
+	uint8_t *pcm_data;
+	size_t frame_size;
+	size_t total_frames;
+
+	// Streaming I/O mode only; pcm_data is then never touched
+	Stream *stream;
+} Track;
+
+typedef struct
+{
+    char audio_paths[20][MAX_STRING_LEN];
+    int count;
+    int current_audio;
+} Playlist;
+
 typedef struct
 {
 	WAVHeader *audio;
@@ -65,20 +152,102 @@ typedef struct
 	size_t frames_played;
 	size_t total_frames;
 
-	size_t audio_size;
 	uint8_t *pcm_data;
-	snd_pcm_t *pcm_handle;
+	Stream *stream;
+	Output out;
+
+	// Samples as stored in the file and as the device takes them
+	enum DspFormat src_format;
+	enum DspFormat dev_format;
 
 	enum PlayerState state;
 	uint8_t loop;
+	uint8_t scrub; // < and > take short steps
+
+	unsigned int seeks;
+	float seek_ms;
+	float seek_ms_max;
+
+	// Go-to entry, written by the input thread: the digits typed so
+	// far (-1 when not typing) and the position entered, in ms
+	atomic_int goto_digits;
+	atomic_long goto_ms;
+
+	// For the whole run, across tracks
+	LoopStats stats;
+
+	// Published copy of the fields above, under a seqlock: status_seq
+	// is odd while the audio thread is writing it.
+	atomic_uint status_seq;
+	AudioStatus status;
+
+	// eventfd that wakes the display thread on changes
+	int display_fd;
+
+	// eventfd that wakes the pager: on the same changes, and once
+	// playback reaches pager_frame (SIZE_MAX: never)
+	int pager_fd;
+	atomic_size_t pager_frame;
+
+	// Keys for the audio thread; cmd_fd (eventfd) is signalled after
+	// each push so a sleeping audio thread wakes up
+	KeyQueue keys;
+	int cmd_fd;
+
+	// eventfd that tells the input thread to return
+	int input_stop_fd;
+
+	// tracks[cur_track] is playing. In gapless mode the prefetch thread
+	// loads playlist entry next_index into the other slot meanwhile, and
+	// the audio thread switches over without stopping the device.
+	Track tracks[2];
+	int cur_track;
+	Playlist *playlist; // NULL unless gapless
+	int next_index;
+	atomic_int next_ready; // 0 loading, 1 loaded, -1 failed or none
+	sem_t next_done;       // posted with every next_ready result
+	sem_t prefetch_want;
+	uint8_t prefetch_quit;
 } AudioInfo;
 
+// One input -> output pair for --render
 typedef struct
 {
-    char audio_paths[20][MAX_STRING_LEN];
+    const char *in_path;
+    char out_path[1300];
+} RenderJob;
+
+// Shared by the render workers; each takes the next job index
+typedef struct
+{
+    RenderJob *jobs;
+    RenderStats *stats;
     int count;
-    int current_audio;
-} Playlist;
+    atomic_int next;
+    atomic_int failed;
+    EqParams params;
+} RenderBatch;
+
+// Interactive file prompt: the index of the current directory and the
+// scan that refreshes it
+typedef struct
+{
+    const char *loc_path;
+    Library library;
+    Scanner *scanner;
+
+    // Everything the scan has returned so far
+    ScanEntry **found;
+    size_t num_found;
+    size_t cap_found;
+
+    // Fuzzy matches for the prompt, over the index until the scan is
+    // over and over the scan results after that
+    SearchIndex search;
+
+    uint8_t quiet;    // listed from the index; the scan only updates it
+    uint8_t reported; // scan finished and summarised
+} Browser;
 
 #define INIT_BQ(X, a, b, c) \
 	do { \
@@ -86,8 +255,29 @@ typedef struct
 		memcpy((X).args, (float[]) {a, b, c}, sizeof((X).args)); \
 	} while (0)
 
-BiquadInfo filters[3];
-uint8_t num_filters = 0;
+unsigned int refresh_hz = 10;
+uint8_t gapless = 0;
+uint8_t use_stream = 0;
+size_t readahead_bytes = ST_DEFAULT_READAHEAD;
+const LatencyProfile *latency_profile = NULL;
+int rt_priority = 0;
+int audio_cpu = -1;
+uint8_t lock_memory = 0;
+
+BiquadInfo *filters = NULL;
+int num_filters = 0;
+enum BiquadPrecision bq_precision = BQ_AUTO;
+EqShared equalizer; // live EQ, seeded from filters[]
+const char *ir_path = NULL;
+unsigned int out_rate = 0; // --rate: fixed device rate, 0 for each file's own
+enum ResampleQuality rs_quality = RS_GOOD;
+uint8_t float_out = 0; // --float-out: float to the device, even from integer files
+unsigned int max_buffer_ms = 0; // --max-buffer: upper limit when adapting, 0 keeps it fixed
+const char *stats_path = NULL; // --stats: JSON report of the hot-path timings on exit
+ConvIR conv_ir; // after the EQ when ir_path is set; frames is 0 otherwise
+uint8_t use_mmap = 0;
+const char *render_path = NULL;
+int render_jobs = 0; // 0: one per online CPU
 
 // masking -
 // char *buf = mmap;
@@ -95,7 +285,6 @@ uint8_t num_filters = 0;
 // ((*buf) & 0x80) >>> 8;
 
 // TODO(daria): select audio folders
-// TODO(daria): saved precomputed numbers for biquad
 
 struct termios orig_termios;
 
@@ -128,45 +317,248 @@ clear_screen(void)
 
 static inline
 int
-keyboard_hit(void)
+key_push(KeyQueue *q, char c)
 {
-	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
-	int retval;
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
 
-	if ((retval = poll(&pfd, 1, 0)) > 0 && (pfd.revents & POLLIN)) {
-		char c;
-		read(STDIN_FILENO, &c, 1);
+	if (head - tail == KEY_QUEUE_SIZE) { return -1; }
 
-        // Prevents character smashing
-        char junk;
-        while (poll(&pfd, 1, 0) > 0)
-        {
-            read(STDIN_FILENO, &junk, 1);
-        }
+	q->keys[head & (KEY_QUEUE_SIZE - 1)] = c;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return 0;
+}
+
+// Returns 0 when the queue is empty; never makes a syscall
+static inline
+char
+key_pop(KeyQueue *q)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	if (tail == head) { return 0; }
+
+	char c = q->keys[tail & (KEY_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return c;
+}
+
+// Like key_pop() but leaves the key queued
+static inline
+char
+key_peek(KeyQueue *q)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	return (tail == head) ? 0 : q->keys[tail & (KEY_QUEUE_SIZE - 1)];
+}
+
+static inline
+uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-		if (isalpha(c) ||
-			isdigit(c) ||
-			c == ' ' ||
-			c == '<' ||
-			c == '>')
+static
+void
+loop_stats_init(LoopStats *stats)
+{
+	hist_init(&stats->convert);
+	hist_init(&stats->filter);
+	hist_init(&stats->dsp);
+	hist_init(&stats->write);
+
+	atomic_init(&stats->xruns, 0);
+	atomic_init(&stats->suspends, 0);
+	atomic_init(&stats->fill, 0);
+	atomic_init(&stats->fill_min, UINT_MAX);
+	atomic_init(&stats->buffer_frames, 0);
+	atomic_init(&stats->buffer_us, 0);
+	atomic_init(&stats->chunk_us, 0);
+}
+
+// Audio thread only
+static inline
+void
+count_xrun(LoopStats *stats, long err)
+{
+	atomic_uint *counter = (err == -EPIPE) ? &stats->xruns :
+		(err == -ESTRPIPE) ? &stats->suspends : NULL;
+
+	if (counter)
+	{
+		atomic_store_explicit(counter,
+				atomic_load_explicit(counter, memory_order_relaxed) + 1,
+				memory_order_relaxed);
+	}
+}
+
+// Typed digits read like a clock: 130 is 1:30, 10000 is 1:00:00
+static inline
+long
+goto_digits_ms(int digits)
+{
+	long secs = (digits / 10000) * 3600L + (digits / 100 % 100) * 60L + digits % 100;
+	return secs * 1000;
+}
+
+// Redraw now instead of at the next refresh tick; the pager follows
+// the same seeks, track changes and stops
+static inline
+void
+display_notify(AudioInfo *info)
+{
+	uint64_t one = 1;
+	write(info->display_fd, &one, sizeof(one));
+	write(info->pager_fd, &one, sizeof(one));
+}
+
+// Input thread: the only reader of stdin while a track plays
+void *
+read_keys(AudioInfo *info)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = info->input_stop_fd, .events = POLLIN },
+	};
+
+	for (;;)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR) { continue; }
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN) { break; }
+		if (!(pfd[0].revents & POLLIN)) { continue; }
+
+		char buf[32];
+		ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+		if (n <= 0) { break; }
+
+		uint8_t pushed = 0;
+		uint8_t eq_changed = 0;
+		for (ssize_t i = 0; i < n; i++)
+		{
+			char c = buf[i];
+			int typed = atomic_load_explicit(&info->goto_digits, memory_order_relaxed);
+
+			// Go-to entry: g, the time, then Enter; Esc or g cancels
+			if (typed >= 0)
+			{
+				if (isdigit(c) && typed < 10000000) { typed = typed * 10 + (c - '0'); }
+				else if (c == '\x7f' || c == '\b') { typed /= 10; }
+				else if (c == '\r' || c == '\n')
+				{
+					atomic_store_explicit(&info->goto_ms, goto_digits_ms(typed), memory_order_relaxed);
+					pushed |= key_push(&info->keys, KEY_GOTO) == 0;
+					typed = -1;
+				}
+				else if (c == '\x1b' || c == 'g') { typed = -1; }
+
+				atomic_store_explicit(&info->goto_digits, typed, memory_order_relaxed);
+				eq_changed = 1;
+				continue;
+			}
+			else if (c == 'g')
+			{
+				atomic_store_explicit(&info->goto_digits, 0, memory_order_relaxed);
+				eq_changed = 1;
+				continue;
+			}
+
+			// EQ edits are handled here and published to the audio
+			// thread, which picks them up before its next chunk
+			if (eq_key(&equalizer, c))
+			{
+				eq_changed = 1;
+			}
+			else if (isalpha(c) ||
+				isdigit(c) ||
+				c == ' ' ||
+				c == '<' ||
+				c == '>')
+			{
+				// Full queue: the audio thread is behind, drop the key
+				pushed |= key_push(&info->keys, c) == 0;
+			}
+		}
+
+		if (pushed)
 		{
-			return c;
+			uint64_t one = 1;
+			write(info->cmd_fd, &one, sizeof(one));
 		}
+
+		if (eq_changed) { display_notify(info); }
 	}
 
-	return 0;
+	pthread_exit(NULL);
+}
+
+// Audio thread only, and main() before it starts
+static inline
+void
+publish_status(AudioInfo *info)
+{
+	unsigned int seq = atomic_load_explicit(&info->status_seq, memory_order_relaxed);
+
+	atomic_store_explicit(&info->status_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	info->status.frames_played = info->frames_played;
+	info->status.total_frames = info->total_frames;
+	info->status.filename = info->filename;
+	info->status.pcm_data = info->pcm_data;
+	info->status.frame_size = info->frame_size;
+	info->status.state = info->state;
+	info->status.loop = info->loop;
+	info->status.scrub = info->scrub;
+	info->status.seeks = info->seeks;
+	info->status.seek_ms = info->seek_ms;
+	info->status.seek_ms_max = info->seek_ms_max;
+
+	atomic_store_explicit(&info->status_seq, seq + 2, memory_order_release);
+
+	// Playback got to where the pager wanted to slide its window. The
+	// exchange keeps a frame it stores meanwhile from being lost: at
+	// worst the pager wakes once for nothing.
+	if (info->frames_played >= atomic_load_explicit(&info->pager_frame, memory_order_relaxed) &&
+		atomic_exchange_explicit(&info->pager_frame, SIZE_MAX, memory_order_relaxed) != SIZE_MAX)
+	{
+		uint64_t one = 1;
+		write(info->pager_fd, &one, sizeof(one));
+	}
+}
+
+static inline
+AudioStatus
+read_status(AudioInfo *info)
+{
+	AudioStatus snap;
+	unsigned int begin, end;
+
+	do {
+		begin = atomic_load_explicit(&info->status_seq, memory_order_acquire);
+		memcpy(&snap, &info->status, sizeof(snap));
+		atomic_thread_fence(memory_order_acquire);
+		end = atomic_load_explicit(&info->status_seq, memory_order_relaxed);
+	} while ((begin & 1) || begin != end);
+
+	return snap;
 }
 
 void *
 display_screen(AudioInfo *info)
 {
-	// TODO(daria): add a mutex.
 	size_t frames_per_sec = info->audio->sample_rate ;//* info->audio->num_channels;
 
-	size_t audio_duration = info->audio_size / info->audio->byte_rate;
-	size_t audio_minutes = audio_duration / 60;
-	size_t audio_seconds = audio_duration % 60;
-
 	size_t duration_played;
 	hide_cursor();
 
@@ -182,57 +574,370 @@ display_screen(AudioInfo *info)
 
 	uint8_t stop  = 0;
 
+	// Redraws on a refresh tick or when display_notify() is called,
+	// and sleeps in between
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	long period_ns = 1000000000L / (refresh_hz ? refresh_hz : 1);
+	struct itimerspec tick = {
+		.it_interval = { period_ns / 1000000000L, period_ns % 1000000000L },
+		.it_value = { period_ns / 1000000000L, period_ns % 1000000000L },
+	};
+	timerfd_settime(timer_fd, 0, &tick, NULL);
+
+	struct pollfd wake[2] = {
+		{ .fd = timer_fd, .events = POLLIN },
+		{ .fd = info->display_fd, .events = POLLIN },
+	};
+
     fprintf(stdout, "EQ:\n\r");
     fprintf(stdout, "  \x1b[4m#\x1b[0m   \x1b[4m%-10s\x1b[0m \x1b[4m%-10s\x1b[0m "
             "\x1b[4m%-10s\x1b[0m \x1b[4m%-5s\x1b[0m\n\r",
             "TYPE", "DB GAIN",
             "FREQUENCY", "QUALITY");
 
+	EqParams params = { .bands = calloc(equalizer.num_bands, sizeof(BiquadInfo)) };
+	int shown = (equalizer.num_bands < EQ_SHOWN_BANDS) ? equalizer.num_bands : EQ_SHOWN_BANDS;
+
 	for (;;)
 	{
+		AudioStatus status = read_status(info);
+		int selected = params.bands ? eq_snapshot(&equalizer, &params) : 0;
+
+        // Window of the EQ around the selected band
+        int first = selected - shown / 2;
+        if (first > equalizer.num_bands - shown) { first = equalizer.num_bands - shown; }
+        if (first < 0 || !params.bands) { first = 0; }
+
         move_cursor(0, 4);
 
-		for (int i = 0; i < 3; i++)
+		for (int i = first; params.bands && i < first + shown; i++)
 		{
-			fprintf(stdout, "  %d - %-10d %-10.1f %-10.0f %-5.1f\n\r",
+			fprintf(stdout, "%c%2d - %-10d %-10.1f %-10.0f %-5.1f\x1b[K\n\r",
+					i == selected ? '>' : ' ',
 					i,
-					filters[i].type,
-					filters[i].args[2],
-					filters[i].args[0],
-					filters[i].args[1]);
+					params.bands[i].type,
+					params.bands[i].args[2],
+					params.bands[i].args[0],
+					params.bands[i].args[1]);
 		}
 
 		fprintf(stdout, "\n\r");
 
-        fprintf(stdout, "Audio: %s\n\r", info->filename);
+        // Gapless playback changes the track under us
+        fprintf(stdout, "Audio: %s\x1b[K\n\r", status.filename);
         fflush(stdout);
 
-		if (info->state == PLAYER_STOPPED)
+		if (status.state == PLAYER_STOPPED)
 		{
 			stop = 1; // to show the player has stopped
 		}
 
-		duration_played = info->frames_played / frames_per_sec;
-		move_cursor(0, 9);
-		fprintf(stdout, "State: %s, Loop: %s  \n\r",
-				state_str[info->state],
-				info->loop ? "TRUE" : "FALSE");
+		duration_played = status.frames_played / frames_per_sec;
+		size_t audio_duration = status.total_frames / frames_per_sec;
+		move_cursor(0, 6 + shown);
+		fprintf(stdout, "State: %s, Loop: %s, Scrub: %s  \n\r",
+				state_str[status.state],
+				status.loop ? "TRUE" : "FALSE",
+				status.scrub ? "TRUE" : "FALSE");
 		fprintf(stdout, "Duration: %02ld:%02ld/%02ld:%02ld\n\r",
 				duration_played / 60,
 				duration_played % 60,
-				audio_minutes,
-				audio_seconds);
+				audio_duration / 60,
+				audio_duration % 60);
+
+		// How close to the deadline the hot path runs: DSP time per
+		// chunk against the chunk's length, time blocked writing, and
+		// the least the device had left queued
+		const LoopStats *stats = &info->stats;
+		if (atomic_load_explicit(&stats->write.count, memory_order_relaxed) > 0)
+		{
+			unsigned int buffer = atomic_load_explicit(&stats->buffer_frames, memory_order_relaxed);
+			unsigned int fill = atomic_load_explicit(&stats->fill, memory_order_relaxed);
+			unsigned int fill_min = atomic_load_explicit(&stats->fill_min, memory_order_relaxed);
+
+			buffer = buffer ? buffer : 1;
+			fill_min = (fill_min == UINT_MAX) ? fill : fill_min;
+
+			fprintf(stdout, "DSP: %.2f/%.2f ms p50/p99 of %.1f ms, write p99 %.2f ms, "
+					"xruns %u, buffer %.0f ms, fill %u%% (min %u%%)\x1b[K\n\r",
+					hist_quantile(&stats->dsp, 0.5) / 1e6,
+					hist_quantile(&stats->dsp, 0.99) / 1e6,
+					atomic_load_explicit(&stats->chunk_us, memory_order_relaxed) / 1e3,
+					hist_quantile(&stats->write, 0.99) / 1e6,
+					atomic_load_explicit(&stats->xruns, memory_order_relaxed),
+					atomic_load_explicit(&stats->buffer_us, memory_order_relaxed) / 1e3,
+					(unsigned int) (100ull * fill / buffer),
+					(unsigned int) (100ull * fill_min / buffer));
+		}
+
+		if (status.seeks > 0)
+		{
+			fprintf(stdout, "Seek: %.1f ms, max %.1f ms over %u\x1b[K\n\r",
+					status.seek_ms, status.seek_ms_max, status.seeks);
+		}
+
+		int typed = atomic_load_explicit(&info->goto_digits, memory_order_relaxed);
+		if (typed >= 0)
+		{
+			fprintf(stdout, "Go to: %d:%02d:%02d\x1b[K\n\r",
+					typed / 10000, typed / 100 % 100, typed % 100);
+		}
+		else
+		{
+			fprintf(stdout, "\x1b[K");
+		}
 		fflush(stdout);
 
 		if (stop){
 			show_cursor();
 			break;
 		}
+
+		if (poll(wake, 2, -1) > 0)
+		{
+			uint64_t count;
+			if (wake[0].revents & POLLIN) { read(timer_fd, &count, sizeof(count)); }
+			if (wake[1].revents & POLLIN) { read(info->display_fd, &count, sizeof(count)); }
+		}
+	}
+
+	close(timer_fd);
+	free(params.bands);
+
+	pthread_exit(NULL);
+}
+
+// Keeps the MLOCK_WINDOW of the mapping ahead of the play position
+// locked, sliding it along as playback moves. The page-ins happen
+// here rather than on the audio thread, which wakes it when playback
+// is halfway through the window and on every seek, track change or
+// stop.
+void *
+lock_pages(AudioInfo *info)
+{
+	const long page = sysconf(_SC_PAGESIZE);
+	uint8_t *locked = NULL;
+	size_t locked_len = 0;
+	struct pollfd wake = { .fd = info->pager_fd, .events = POLLIN };
+
+	for (;;)
+	{
+		AudioStatus status = read_status(info);
+		if (status.state == PLAYER_STOPPED) { break; }
+
+		size_t wake_frame = SIZE_MAX;
+
+		if (status.pcm_data)
+		{
+			const uint8_t *end = status.pcm_data + status.total_frames * status.frame_size;
+			const uint8_t *pos = status.pcm_data + status.frames_played * status.frame_size;
+			uint8_t *start = (uint8_t *) ((uintptr_t) pos & ~(uintptr_t) (page - 1));
+			size_t len = (end - start < MLOCK_WINDOW) ? (size_t) (end - start) : MLOCK_WINDOW;
+
+			// Move on once playback is halfway through the window,
+			// or elsewhere entirely after a seek or track change
+			if (!locked || pos < locked || pos >= locked + locked_len / 2)
+			{
+				// Locks do not nest, so release first; the old pages
+				// stay resident and mapped in between
+				if (locked) { munlock(locked, locked_len); }
+				if (len > 0) { mlock(start, len); }
+				locked = start;
+				locked_len = len;
+			}
+
+			// Nothing left to lock once the window reaches the end
+			const uint8_t *half = locked + locked_len / 2;
+			if (locked_len > 0 && half > pos)
+			{
+				wake_frame = (half - status.pcm_data + status.frame_size - 1) / status.frame_size;
+			}
+		}
+
+		atomic_store_explicit(&info->pager_frame, wake_frame, memory_order_relaxed);
+
+		uint64_t count;
+		if (poll(&wake, 1, -1) > 0) { read(info->pager_fd, &count, sizeof(count)); }
 	}
 
+	if (locked) { munlock(locked, locked_len); }
 	pthread_exit(NULL);
 }
 
+static inline
+void
+track_activate(AudioInfo *info, Track *t)
+{
+	info->audio = &t->header;
+	info->pcm_data = t->pcm_data;
+	info->stream = t->stream;
+	info->frame_size = t->frame_size;
+	info->total_frames = t->total_frames;
+	info->frames_played = 0;
+	info->src_format = dsp_format(t->header.audio_format, t->header.bps);
+
+	info->filename = strrchr(t->path, '/');
+	if (info->filename == NULL) { info->filename = t->path; }
+	else { info->filename += 1; }
+}
+
+// Audio thread only. Moves on to the prefetched track when it has the
+// same format: the device, kernel and filter state carry on, and its
+// first frame is written right behind the last one of this track.
+static
+int
+next_track(AudioInfo *info)
+{
+	int ready;
+
+	// Loading normally finishes long before the end of a track; if not,
+	// sleep until the prefetch thread has its result
+	while ((ready = atomic_load_explicit(&info->next_ready, memory_order_acquire)) == 0)
+	{
+		sem_wait(&info->next_done);
+	}
+
+	if (ready != 1) { return 0; }
+
+	Track *next = &info->tracks[!info->cur_track];
+	if (next->header.audio_format != info->audio->audio_format ||
+		next->header.bps != info->audio->bps ||
+		next->header.num_channels != info->audio->num_channels ||
+		next->header.sample_rate != info->audio->sample_rate)
+	{
+		return 0;
+	}
+
+	info->cur_track = !info->cur_track;
+	track_activate(info, next);
+	info->playlist->current_audio = info->next_index++;
+
+	// The prefetch thread unmaps the old track and loads the one after.
+	// It is idle until posted, so a result not waited for is dropped.
+	while (sem_trywait(&info->next_done) == 0) {}
+	atomic_store_explicit(&info->next_ready, 0, memory_order_relaxed);
+	sem_post(&info->prefetch_want);
+
+	publish_status(info);
+	display_notify(info);
+	return 1;
+}
+
+// Audio thread only. Hands a filtered chunk to the device and never
+// fails: the filters have already moved past the chunk, so it must not
+// go through them again. After an error the device is recovered (and
+// the error counted) here, once, and in RW mode the chunk is written
+// again. In mmap mode the area went with the xrun, and if the second
+// write fails too the chunk is dropped; the next wait reports whatever
+// is still wrong with the device.
+static
+snd_pcm_sframes_t
+commit_chunk(
+		AudioInfo *info,
+		size_t frames)
+{
+	snd_pcm_sframes_t written = out_commit(&info->out, frames);
+	if (written >= 0) { return written; }
+
+	count_xrun(&info->stats, written);
+	if (out_recover(&info->out, written) == 0 && !info->out.use_mmap)
+	{
+		written = out_commit(&info->out, frames);
+		if (written >= 0) { return written; }
+	}
+
+	return frames;
+}
+
+// Audio thread only. The float path's EQ and convolver over `frames`
+// interleaved frames in place, the EQ ramping in the same short blocks
+// as the kernels do
+static
+void
+filter_float(
+		BiquadChain *eq,
+		Convolver *conv,
+		float *buf,
+		size_t frames,
+		int channels)
+{
+	size_t done = 0;
+	while (done < frames)
+	{
+		size_t n = frames - done;
+		if (eq->ramp_left > 0)
+		{
+			n = (n > BQ_RAMP_BLOCK) ? BQ_RAMP_BLOCK : n;
+			bq_chain_ramp(eq, n);
+		}
+
+		bq_chain_process(eq, buf + done * channels, n);
+		done += n;
+	}
+
+	if (conv) { conv_process(conv, buf, frames); }
+}
+
+// Audio thread only. Runs input frames [from, to) through the
+// resampler, EQ and convolver and throws the result away, so after a
+// seek to `to` they carry on from the state that spot would have had
+// instead of from silence. float_buf and rs_buf are the chunk buffers
+// of audio_play().
+static
+void
+warm_filters(
+		AudioInfo *info,
+		BiquadChain *eq,
+		Resampler *rs,
+		Convolver *conv,
+		float *rs_buf,
+		float *float_buf,
+		size_t from,
+		size_t to)
+{
+	const int channels = info->audio->num_channels;
+	const size_t chunk = info->out.chunk_frames;
+
+	while (from < to)
+	{
+		const uint8_t *src;
+		size_t n = to - from;
+		size_t limit = rs ? rs_input_for(rs, chunk) : chunk;
+		if (n > limit) { n = limit; }
+
+		if (info->stream)
+		{
+			// The first call restarts the reader at `from`
+			n = st_acquire(info->stream, from, n, &src, 20);
+			if (n == 0 || n == ST_END) { return; }
+		}
+		else
+		{
+			src = info->pcm_data + from * info->frame_size;
+		}
+
+		size_t frames = n;
+		size_t used = n;
+
+		if (rs)
+		{
+			dsp_to_float(src, rs_buf, n * channels, info->src_format);
+			frames = rs_process(rs, rs_buf, n, &used, float_buf, chunk);
+			if (used == 0 && frames == 0) { return; }
+		}
+		else
+		{
+			dsp_to_float(src, float_buf, n * channels, info->src_format);
+		}
+
+		bq_chain_process(eq, float_buf, frames);
+		if (conv) { conv_process(conv, float_buf, frames); }
+
+		from += used;
+		if (info->stream) { st_release(info->stream, from); }
+	}
+}
+
 void *
 audio_play(AudioInfo *info)
 {
@@ -242,513 +947,1068 @@ audio_play(AudioInfo *info)
 	char key;
 	size_t frames_per_sec = info->audio->sample_rate ;//* info->audio->num_channels;
 	uint32_t five_sec = 5 * frames_per_sec;
+	size_t scrub_step = frames_per_sec * SCRUB_STEP_MS / 1000;
+	size_t preroll = frames_per_sec * SEEK_PREROLL_MS / 1000;
 
-	size_t fs = info->audio->sample_rate;
+	// Seek in flight: when it started and the chunks still to write
+	// before the device is started by hand
+	struct timespec seek_start = { 0 };
+	uint8_t seek_pending = 0;
+	int seek_chunks = 0;
+
+	// The EQ and the convolver run at the device rate
+	size_t fs = out_rate ? out_rate : info->audio->sample_rate;
 	uint8_t channels = info->audio->num_channels;
 
-	Biquad eq[3][2];
-	int8_t selected_bq = 0;
-    int8_t selected_setting = 0;
+	uint8_t eq_changed;
+	const EqParams *params = eq_acquire(&equalizer, &eq_changed);
+
+    const enum DspFormat src_format = info->src_format;
+    const enum DspFormat dev_format = info->dev_format;
+
+    Convolver *conv = NULL;
+    Resampler *rs = NULL;
+    float *rs_buf = NULL;
+    // Float path: resampling, convolution, a change of sample format
+    // and float or 8-bit files, which the int -> int kernels cannot
+    // do, run on a chunk decoded to float_buf. Seeks warm the filters
+    // in it on every path.
+    float *float_buf = NULL;
+
+    // Sized for every band at once, so EQ edits never allocate here
+    BiquadChain *eq = bq_chain_new(params->num_bands);
+    if (!eq)
+    {
+        fprintf(stderr, "Failed to allocate the EQ.\n\r");
+        *exit_player = 1;
+        goto END_AUDIO;
+    }
+
+    // Audio thread only: keeps silent tails off the denormal path
+    bq_denormals_off();
+    bq_chain_update(eq, params->bands, params->num_bands, channels, fs,
+            params->precision);
+
+    // Convolution runs on float samples after the EQ. A partition no
+    // longer than a period bounds the delay it adds; conv stays NULL
+    // when there is no response or it does not fit this format.
+    if (conv_ir.frames && conv_ir.rate == (int) fs)
+    {
+        conv = conv_new(&conv_ir, channels, info->out.period_size);
+    }
+
+    // A file at another rate than the device is resampled before the
+    // EQ, so the filters are designed for the device rate only
+    if (fs != info->audio->sample_rate)
+    {
+        rs = rs_new(info->audio->sample_rate, fs, channels, rs_quality);
+        // rs_input_for() grows by at most one frame with the phase
+        rs_buf = rs ? malloc((rs_input_for(rs, info->out.chunk_frames) + 1) *
+                channels * sizeof(float)) : NULL;
+        if (!rs_buf)
+        {
+            fprintf(stderr, "Cannot resample %u Hz to %zu Hz.\n\r",
+                    info->audio->sample_rate, fs);
+            *exit_player = 1;
+            goto END_AUDIO;
+        }
+    }
+
+    // Samples only go to the device untouched when nothing but the EQ
+    // stands between it and the file
+    uint8_t convert = conv || rs || src_format != dev_format;
+    uint8_t use_float = convert ||
+        (src_format != DSP_S16 && src_format != DSP_S24 && src_format != DSP_S32);
 
-    bq_update(eq, filters, 3, channels, fs);
+    float_buf = malloc(info->out.chunk_frames * channels * sizeof(float));
+    if (!float_buf)
+    {
+        fprintf(stderr, "Failed to allocate the EQ.\n\r");
+        *exit_player = 1;
+        goto END_AUDIO;
+    }
 
-	static uint8_t buffer[CHUNK_FRAMES * 8];
-	static float fbuf[CHUNK_FRAMES * 8];
+    LoopStats *stats = &info->stats;
+    atomic_store_explicit(&stats->chunk_us, info->out.chunk_frames * 1000000 / fs,
+            memory_order_relaxed);
 
 	info->state = PLAYER_PLAYING;
+	publish_status(info);
+	display_notify(info);
 
 	while (info->frames_played < info->total_frames)
 	{
-		key = keyboard_hit();
+		key = key_pop(&info->keys);
 
 		if (key == 'Q')
         {
             *exit_player = 1;
-			snd_pcm_drop(info->pcm_handle);
+			snd_pcm_drop(info->out.pcm);
             goto END_AUDIO;
         }
         else if (key == ' ')
 		{
-			snd_pcm_drop(info->pcm_handle);
+			snd_pcm_drop(info->out.pcm);
             info->state = PLAYER_PAUSED;
-			while ((key = keyboard_hit()) != 'q'  &&
-				info->frames_played < info->total_frames)
+            publish_status(info);
+            display_notify(info);
+
+            // Sleep until a key arrives; nothing runs while paused
+			while ((key = key_pop(&info->keys)) != ' ' && key != 'Q')
 			{
-				if (key == ' ')
-				{ 
-					info->state = PLAYER_PLAYING;
-                    break;
+				if (key == 0)
+				{
+					struct pollfd pfd = { .fd = info->cmd_fd, .events = POLLIN };
+					uint64_t count;
+
+					poll(&pfd, 1, -1);
+					read(info->cmd_fd, &count, sizeof(count));
 				}
 			}
-            
-            if (key == 'Q') { goto END_AUDIO;}
-		}
-		else if (key == '<')
-		{
-			snd_pcm_drop(info->pcm_handle);
 
-			signed int duration_pos = info->frames_played - five_sec;
-			if (duration_pos < 0) {
-				info->frames_played = 0;
-			} else {
-				info->frames_played -= five_sec;
-			}
+            if (key == 'Q')
+            {
+                *exit_player = 1;
+                goto END_AUDIO;
+            }
 
-			snd_pcm_prepare(info->pcm_handle);
+			snd_pcm_prepare(info->out.pcm);
+			info->state = PLAYER_PLAYING;
 		}
-		else if (key == '>')
+		else if (key == '<' || key == '>' || key == KEY_GOTO)
 		{
-			snd_pcm_drop(info->pcm_handle);
+			clock_gettime(CLOCK_MONOTONIC, &seek_start);
+			snd_pcm_drop(info->out.pcm);
+
+			// A held key queues steps faster than they are served;
+			// the ones already waiting make one seek together
+			size_t step = info->scrub ? scrub_step : five_sec;
+			size_t target = info->frames_played;
+
+			for (;;)
+			{
+				if (key == KEY_GOTO)
+				{
+					long ms = atomic_load_explicit(&info->goto_ms, memory_order_relaxed);
+					target = (size_t) ms * frames_per_sec / 1000;
+				}
+				else if (key == '<') { target = (target > step) ? target - step : 0; }
+				else { target += step; }
 
-			info->frames_played += five_sec;
-			if (info->frames_played > info->total_frames) {
-				info->frames_played = info->total_frames;
+				char next = key_peek(&info->keys);
+				if (next != '<' && next != '>' && next != KEY_GOTO) { break; }
+				key = key_pop(&info->keys);
 			}
 
-			snd_pcm_prepare(info->pcm_handle);
+			if (target > info->total_frames) { target = info->total_frames; }
+			size_t from = (target > preroll) ? target - preroll : 0;
+
+			// Ask for the pre-roll and what follows it in one go, so
+			// the reads below do not fault the pages in one at a time.
+			// In streaming mode warm_filters() restarts the reader.
+			if (!info->stream && from < info->total_frames)
+			{
+				const long page = sysconf(_SC_PAGESIZE);
+				const uint8_t *end = info->pcm_data + info->total_frames * info->frame_size;
+				uint8_t *start = (uint8_t *) ((uintptr_t) (info->pcm_data + from * info->frame_size) &
+						~(uintptr_t) (page - 1));
+				size_t len = (end - start < SEEK_PREFAULT_BYTES) ? (size_t) (end - start) : SEEK_PREFAULT_BYTES;
+
+				madvise(start, len, MADV_WILLNEED);
+			}
+
+			// Filter state from the old position would ring into the
+			// new one; start from the pre-roll instead
+			bq_chain_reset(eq);
+			if (rs) { rs_reset(rs); }
+			if (conv) { conv_reset(conv); }
+			warm_filters(info, eq, rs, conv, rs_buf, float_buf, from, target);
+
+			info->frames_played = target;
+			snd_pcm_prepare(info->out.pcm);
+
+			seek_pending = 1;
+			seek_chunks = SEEK_START_CHUNKS;
 		}
+		else if (key == 's') { info->scrub = !info->scrub; }
 		else if (key == 'l') { info->loop = !info->loop; }
 
-        // ------------------------------- //
-        // ------- BIQUAD CONTROL -------- //
-        // ------------------------------- //
-        
-        // Check if key is a digit
-        // TODO(daria): have up to 5 bq, it's only 3 right now
-        if (((unsigned)key - '0' < 10) &&
-            (key >= '0' && key < '3'))
+        // EQ edits arrive from the input thread; only the bands that
+        // changed are redesigned and they glide in over a short ramp
+        uint8_t eq_changed;
+        const EqParams *params = eq_acquire(&equalizer, &eq_changed);
+        if (eq_changed)
         {
-            selected_bq = key - '0';
+            bq_chain_retarget(eq, params->bands, params->num_bands,
+                    params->precision);
         }
-        // change type
-        else if (key == 't' || key == 'd' || key == 'f' || key == 'q')
+
+        // Seeks, state and loop show up right away
+        if (key != 0)
         {
-            selected_setting = key;
+            publish_status(info);
+            display_notify(info);
         }
-        else if (key == 'j')
-        {
-            switch (selected_setting)
-            {
-                case 't':
-                {
-                    filters[selected_bq].type = 
-                        (filters[selected_bq].type - 1) % BQ_MAX;
-                    break;
-                }
-                case 'd':
-                {
-                    filters[selected_bq].args[2] -= 0.1f;
-                    break;
-                }
-                case 'f':
-                {
-                    filters[selected_bq].args[0] -= 10.0f;
 
-                    if (filters[selected_bq].args[0] < 0.0f)
-                    {
-                        filters[selected_bq].args[0] = 0.0f;
-                    }
+		size_t frames_left = info->total_frames - info->frames_played;
+		size_t chunk_frames = info->out.chunk_frames;
+		size_t chunk = (frames_left > chunk_frames) ? chunk_frames : frames_left;
 
-                    break;
-                }
-                case 'q':
-                {
-                    if (filters[selected_bq].type == BQ_LOWPASS ||
-                        filters[selected_bq].type == BQ_HIGHPASS)
-                    {
-                        break;
-                    }
+		// Input frames behind `chunk` device frames
+		size_t chunk_in = chunk;
+		if (rs)
+		{
+			chunk = chunk_frames;
+			chunk_in = rs_input_for(rs, chunk);
+			chunk_in = (chunk_in > frames_left) ? frames_left : chunk_in;
+		}
 
-                    filters[selected_bq].args[1] -= 0.1f;
+		// Sleep until the device has room for the chunk; a key press
+		// wakes us early so it is handled before the write
+		int ready = out_wait(&info->out, chunk, info->cmd_fd);
+		if (ready == 0)
+		{
+			uint64_t count;
+			read(info->cmd_fd, &count, sizeof(count));
+			continue;
+		}
+		else if (ready < 0)
+		{
+			count_xrun(stats, ready);
+			out_recover(&info->out, ready);
+			continue;
+		}
 
-                    if (filters[selected_bq].args[1] < 0.1f)
-                    {
-                        filters[selected_bq].args[1] = 0.1f;
-                    }
-                    break;
-                }
-            }
+		// The queued amount moves with xruns and stable stretches
+		atomic_store_explicit(&stats->buffer_frames, info->out.fill_target, memory_order_relaxed);
+		atomic_store_explicit(&stats->buffer_us, info->out.fill_target * 1000000 / fs,
+				memory_order_relaxed);
 
-            bq_update(eq, filters, selected_bq + 1, channels, fs);
-        }
-        else if (key == 'k') 
-        {
-            switch (selected_setting)
-            {
-                case 't':
-                {
-                    if (filters[selected_bq].type == 0) {
-                        filters[selected_bq].type = BQ_MAX + 1;
-                    }
-                    filters[selected_bq].type = 
-                        filters[selected_bq].type - 1;
-                    break;
-                }
-                case 'd':
-                {
-                    filters[selected_bq].args[2] += 0.1f;
-                    break;
-                }
-                case 'f':
-                {
-                    filters[selected_bq].args[0] += 10.0f;
-                    break;
-                }
-                case 'q':
-                {
-                    if (filters[selected_bq].type == BQ_LOWPASS ||
-                        filters[selected_bq].type == BQ_HIGHPASS ||
-                        filters[selected_bq].args[1] == 0.0f)
-                    {
-                        break;
-                    }
+		// What the device still had queued as this chunk started: the
+		// margin left before an underrun
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(info->out.pcm);
+		if (avail >= 0)
+		{
+			unsigned int fill = ((snd_pcm_uframes_t) avail < info->out.buffer_size) ?
+				info->out.buffer_size - avail : 0;
+			atomic_store_explicit(&stats->fill, fill, memory_order_relaxed);
 
-                    filters[selected_bq].args[1] += 0.1f;
+			if (snd_pcm_state(info->out.pcm) == SND_PCM_STATE_RUNNING &&
+				fill < atomic_load_explicit(&stats->fill_min, memory_order_relaxed))
+			{
+				atomic_store_explicit(&stats->fill_min, fill, memory_order_relaxed);
+			}
+		}
 
-                    break;
-                }
-            }
+		const uint8_t *chunk_ptr;
+		snd_pcm_sframes_t written;
+		size_t consumed = 0;
 
-            bq_update(eq, filters, selected_bq + 1, channels, fs);
-        }
+		if (info->stream)
+		{
+			// Resident ring data only; may be short at the ring's end
+			chunk_in = st_acquire(info->stream, info->frames_played, chunk_in, &chunk_ptr, 20);
+			if (chunk_in == 0) { continue; } // reader is behind
 
-		size_t frames_left = info->total_frames - info->frames_played;
-		size_t chunk = (frames_left > CHUNK_FRAMES) ? CHUNK_FRAMES : frames_left;
-		size_t bytes_per_sample = info->audio->bps / 8;
-		size_t copy_bytes = chunk * channels * bytes_per_sample; // sizeof(int16_t)
+			// Shorter than its header says, or unreadable: the track
+			// ends at the last frame that could be read
+			if (chunk_in == ST_END)
+			{
+				info->total_frames = info->frames_played;
+				publish_status(info);
+				continue;
+			}
+			if (!rs) { chunk = chunk_in; }
+		}
+		else
+		{
+			chunk_ptr = info->pcm_data + (info->frames_played * info->frame_size);
+		}
 
-		uint8_t *chunk_ptr = (info->pcm_data + (info->frames_played * info->frame_size));
-		memcpy(buffer, chunk_ptr, copy_bytes);
+		if (eq->num_stages == 0 && !convert)
+		{
+			// Flat EQ: the file's own samples go to the device as is
+			uint64_t t0 = now_ns();
+			written = out_write(&info->out, chunk_ptr, chunk);
+			consumed = written;
 
-		uint8_t bps = info->audio->bps;
-		for (size_t i = 0; i < chunk * channels; i++)
+			if (written >= 0)
+			{
+				hist_add(&stats->dsp, 0);
+				hist_add(&stats->write, now_ns() - t0);
+			}
+		}
+		else
 		{
-			if (bps == 16)
+			// Where the output goes: the staging buffer in RW mode,
+			// the device ring itself in mmap mode
+			uint8_t *dst;
+			uint64_t t0 = now_ns();
+			snd_pcm_sframes_t room = out_begin(&info->out, chunk, &dst);
+			uint64_t t1 = now_ns();
+			uint64_t convert_ns = 0, filter_ns = 0;
+			written = room;
+
+			if (room >= 0 && use_float)
 			{
-				int16_t s = ((int16_t *)buffer)[i];
-				fbuf[i] = s / 32768.0f;
+				// Decoded once to float for every stage, the EQ ramping
+				// in the same short blocks as the kernels do. The
+				// resampler may keep some input for the next chunk. A
+				// float device is written in place, never requantized.
+				float *fb = (dev_format == DSP_F32) ? (float *) dst : float_buf;
+				size_t frames = room;
+
+				if (rs)
+				{
+					dsp_to_float(chunk_ptr, rs_buf, chunk_in * channels, src_format);
+					frames = rs_process(rs, rs_buf, chunk_in, &consumed, fb, room);
+				}
+				else
+				{
+					dsp_to_float(chunk_ptr, fb, room * channels, src_format);
+					consumed = room;
+				}
+
+				uint64_t t2 = now_ns();
+				filter_float(eq, conv, fb, frames, channels);
+				uint64_t t3 = now_ns();
+
+				if (fb == float_buf)
+				{
+					dsp_from_float(fb, dst, frames * channels, dev_format);
+				}
+				uint64_t t4 = now_ns();
+
+				convert_ns = (t2 - t1) + (t4 - t3);
+				filter_ns = t3 - t2;
+				hist_add(&stats->convert, convert_ns);
+
+				written = commit_chunk(info, frames);
 			}
-			else if (bps == 24)
+			else if (room >= 0)
 			{
-				uint8_t *p = &buffer[i * 3];
-				int32_t s = (p[0] | (p[1] << 8) | (p[2] << 16));
-				if (s & 0x800000) s|= ~0xffffff;
-				fbuf[i] = s / 8388608.0f;
+				// Decode, EQ and encode straight from the mapped file.
+				// While a ramp runs the chunk goes through in short
+				// blocks with the coefficients stepped between them.
+				size_t done = 0;
+				while (done < (size_t) room)
+				{
+					size_t n = room - done;
+					if (eq->ramp_left > 0)
+					{
+						n = (n > BQ_RAMP_BLOCK) ? BQ_RAMP_BLOCK : n;
+						bq_chain_ramp(eq, n);
+					}
+
+					DspKernel kernel = dsp_select(info->audio->bps, channels, eq);
+					kernel(chunk_ptr + done * info->frame_size,
+							dst + done * info->frame_size, n, eq);
+					done += n;
+				}
+
+				filter_ns = now_ns() - t1;
+				written = commit_chunk(info, room);
+				consumed = written;
 			}
-			else
+
+			if (room >= 0 && written >= 0)
 			{
-				int32_t s = ((int32_t *) buffer)[i];
-				fbuf[i] = s / 2147483648.0f;
+				hist_add(&stats->filter, filter_ns);
+				hist_add(&stats->dsp, convert_ns + filter_ns);
+				hist_add(&stats->write, (t1 - t0) + (now_ns() - t1 - convert_ns - filter_ns));
 			}
 		}
 
-		for (size_t i = 0; i < chunk; i++)
+		if (written < 0)
 		{
-			for (size_t ch = 0; ch < channels; ch++)
-			{
-				int idx = i * channels + ch;
-				float x = fbuf[idx];
+			// Only out_begin() and the flat path's writes get here,
+			// before anything was filtered, so the chunk is tried
+			// again. Counted and shown instead of printed over the
+			// screen.
+			count_xrun(stats, written);
+			out_recover(&info->out, written);
+			continue;
+		}
 
-				// TEMP change
-				for (uint8_t n = 0; n < 3 /*num_filters*/; n++)
-				{
-					if (filters[n].type != BQ_NONE)
-						x = bq_process(&eq[n][ch], x);
-				}
-				fbuf[idx] = x;
-			}
+		info->frames_played += consumed;
+
+		if (info->stream)
+		{
+			st_release(info->stream, info->frames_played);
 		}
 
-		for (size_t i = 0; i < chunk * channels; i++)
+		// Sound resumes when the device runs again. Starting it after
+		// a few chunks instead of a full ring keeps deep buffers from
+		// adding their whole length to every seek.
+		if (seek_pending)
 		{
-			float x = fmaxf(-1.0f, fminf(1.0f, fbuf[i]));
-			if (bps == 16)
-			{
-				((int16_t *) buffer)[i] = (int16_t)(x * 32767.0f);
-			}
-			else if (bps == 24)
+			snd_pcm_state_t pcm_state = snd_pcm_state(info->out.pcm);
+
+			if (--seek_chunks <= 0 && pcm_state == SND_PCM_STATE_PREPARED)
 			{
-				int32_t s = (int32_t)(x * 8388607.0f);
-				uint8_t *p = &buffer[i * 3];
-				p[0] = s & 0xff;
-				p[1] = (s >> 8) & 0xff;
-				p[2] = (s >> 16) & 0xff;
+				snd_pcm_start(info->out.pcm);
+				pcm_state = snd_pcm_state(info->out.pcm);
 			}
-			else
+
+			if (pcm_state == SND_PCM_STATE_RUNNING)
 			{
-				((int32_t *) buffer)[i] = (int32_t)(x * 2147483647.0f);
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+
+				info->seek_ms = (now.tv_sec - seek_start.tv_sec) * 1e3f +
+						(now.tv_nsec - seek_start.tv_nsec) / 1e6f;
+				if (info->seek_ms > info->seek_ms_max) { info->seek_ms_max = info->seek_ms; }
+				info->seeks++;
+				seek_pending = 0;
+
+				publish_status(info);
 			}
 		}
 
-		snd_pcm_sframes_t written = snd_pcm_writei(info->pcm_handle, buffer, chunk);
+		if (info->loop && info->frames_played >= info->total_frames)
+		{
+			info->frames_played = 0;
+			display_notify(info);
+		}
 
-		if (written < 0)
+		// Gapless: carry straight on into the prefetched track
+		if (info->playlist && info->frames_played >= info->total_frames)
 		{
-			//fprintf(stderr, "underrun or write error: %s\n", snd_strerror(written));
-			snd_pcm_prepare(info->pcm_handle);
+			next_track(info);
+		}
+
+		// Progress only; the display picks it up on its next tick
+		publish_status(info);
+	}
+
+	// The track has ended (a gapless one carries straight on and never
+	// gets here): the resampler still holds the output for its last
+	// input frames, which only comes out against the silence after them
+	while (rs)
+	{
+		// A few chunks at most; keys stay queued for what plays next
+		int ready = out_wait(&info->out, info->out.chunk_frames, -1);
+		if (ready < 0)
+		{
+			count_xrun(&info->stats, ready);
+			out_recover(&info->out, ready);
+			continue;
+		}
+
+		uint8_t *dst;
+		snd_pcm_sframes_t room = out_begin(&info->out, info->out.chunk_frames, &dst);
+		if (room < 0)
+		{
+			count_xrun(&info->stats, room);
+			out_recover(&info->out, room);
 			continue;
 		}
 
-		info->frames_played += written;
+		float *fb = (dev_format == DSP_F32) ? (float *) dst : float_buf;
+		size_t frames = rs_flush(rs, fb, room);
+		if (frames == 0) { break; }
 
-		if (info->loop && info->frames_played >= info->total_frames)
+		filter_float(eq, conv, fb, frames, channels);
+		if (fb == float_buf)
 		{
-			info->frames_played = 0;
+			dsp_from_float(fb, dst, frames * channels, dev_format);
 		}
+		commit_chunk(info, frames);
 	}
 
 END_AUDIO:
+	bq_chain_free(eq);
+	conv_free(conv);
+	rs_free(rs);
+	free(rs_buf);
+	free(float_buf);
 	info->state = PLAYER_STOPPED;
+	publish_status(info);
+	display_notify(info);
 	pthread_exit(exit_player);
 }
 
-int
-print_files(
-        int *num_dir,
-        struct dirent *dir_entry,
-        DIR *dir,
-        char directories[MAX_STRINGS][MAX_STRING_LEN],
-        char *loc_path,
-        char files[MAX_STRINGS][MAX_STRING_LEN],
-        int *file_idx)
+// ------------------------------- //
+// -------- FILE BROWSER --------- //
+// ------------------------------- //
+
+static void
+print_file(const char *path, uint8_t is_wav, uint64_t frames, uint32_t rate)
 {
-    int num_audio_files = 0;
+    if (!is_wav)
+    {
+        fprintf(stdout, "%s\n\r", path);
+        return;
+    }
+
+    if (rate == 0)
+    {
+        fprintf(stdout, "\x1b[1m%s\x1b[0m\n\r", path);
+        return;
+    }
+
+    uint64_t secs = frames / rate;
+    fprintf(stdout, "\x1b[1m%s\x1b[0m  %02lu:%02lu\n\r",
+            path, (unsigned long) (secs / 60), (unsigned long) (secs % 60));
+}
+
+// Lists `loc_path` and starts a scan of it. With a warm index the
+// listing comes straight from it and the scan only refreshes it;
+// otherwise files are listed as the scanner finds them.
+void
+browse_start(Browser *b, const char *loc_path)
+{
+    memset(b, 0, sizeof(*b));
+    b->loc_path = loc_path;
+    search_init(&b->search);
+
+    lib_open(&b->library, loc_path);
 
     fprintf(stdout, "Files:\n\r");
 
-    // PERF(daria): searching files
-    while (*num_dir > 0)
+    if (b->library.count > 0)
     {
-        char current_path[1024] = { 0 };
-        fflush(stdout);
+        size_t num_wav = 0;
+
+        for (size_t i = 0; i < b->library.count; i++)
+        {
+            const LibRecord *r = &b->library.records[i];
+
+            print_file(lib_path(&b->library, r), r->is_wav, r->frames, r->sample_rate);
+            search_add(&b->search, lib_path(&b->library, r));
+            num_wav += r->is_wav;
+        }
 
-        (*num_dir)--;
-        strcpy(current_path, directories[*num_dir]);
+        fprintf(stdout,
+                "\n\rNumber of WAV files: %zu (indexed)\n\r"
+                "Current Directory: %s\n\r",
+                num_wav, loc_path);
+        b->quiet = 1;
+    }
+
+    b->scanner = scan_start(loc_path, 0, lib_scan_hook, &b->library);
+}
 
-        dir = opendir(current_path);
+void
+browse_stop(Browser *b)
+{
+    scan_close(b->scanner);
+    lib_close(&b->library);
+    search_free(&b->search);
+    free(b->found);
+    memset(b, 0, sizeof(*b));
+}
+
+// Waits for a key on stdin. Meanwhile whatever the scanner finds is
+// printed above the prompt line; returns 0 after that so the caller
+// redraws the prompt, or 1 once a key can be read.
+int
+prompt_wait(Browser *b)
+{
+    Scanner *sc = b->scanner;
+    struct pollfd pfd[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = (sc && !b->reported) ? sc->event_fd : -1, .events = POLLIN },
+    };
 
-        if (!dir)
+    while (poll(pfd, 2, -1) < 0)
+    {
+        if (errno != EINTR) { return 1; }
+    }
+
+    if (!(pfd[1].revents & POLLIN)) { return 1; }
+
+    uint64_t count;
+    read(sc->event_fd, &count, sizeof(count));
+
+    // Checked before taking, so nothing found after it is missed
+    int done = scan_done(sc);
+
+    // Clear the prompt and the matches, the caller draws them again
+    fprintf(stdout, "\x1b[1G\x1b[J");
+
+    for (ScanEntry *e = scan_take(sc); e; e = e->next)
+    {
+        if (b->num_found == b->cap_found)
         {
-            // TODO(daria): handle permission denied error
-            if (errno == 24)
-            {
-                fprintf(stdout, "Notice: Reached max open files.\n\r");
-                break;
-            }
-            perror("opendir");
-            continue;
+            size_t cap = b->cap_found ? b->cap_found * 2 : 1024;
+            ScanEntry **found = realloc(b->found, cap * sizeof(ScanEntry *));
+            if (!found) { break; }
+
+            b->found = found;
+            b->cap_found = cap;
         }
+        b->found[b->num_found++] = e;
 
-        while ((dir_entry = readdir(dir)) != NULL)
+        if (!b->quiet)
         {
-            if (dir_entry->d_name[0] == '.') continue;
+            print_file(e->path, e->is_wav, e->frames, e->sample_rate);
+            search_add(&b->search, e->path);
+        }
+    }
 
-            char full_path[1300];
-            snprintf(full_path, sizeof(full_path), "%s/%s", current_path, dir_entry->d_name);
+    if (done)
+    {
+        size_t changed, removed;
+        lib_update(&b->library, b->found, b->num_found, &changed, &removed);
 
-            struct stat st;
-            if (stat(full_path, &st) == -1)
+        // The index was just remapped; search what the scan found
+        if (b->quiet)
+        {
+            search_clear(&b->search);
+            for (size_t i = 0; i < b->num_found; i++)
             {
-                perror(full_path);
-                continue;
+                search_add(&b->search, b->found[i]->path);
             }
+        }
 
-            if (S_ISDIR(st.st_mode) && *num_dir != MAX_STRINGS)
-            {
-                strncpy(directories[*num_dir], full_path, MAX_STRING_LEN);
-                (*num_dir)++;
-            }
-            else if (S_ISREG(st.st_mode) == 1)
-            {
-                if (*file_idx < MAX_STRINGS)
-                {
-                    strncpy(files[(*file_idx)++], full_path, 1024);
-                }
-                else { break; }
+        if (!b->quiet)
+        {
+            fprintf(stdout,
+                    "\n\rNumber of WAV files: %zu\n\r"
+                    "Current Directory: %s\n\r",
+                    atomic_load(&sc->num_wav), b->loc_path);
+        }
+        else if (changed > 0 || removed > 0)
+        {
+            fprintf(stdout, "Index updated: %zu new or changed, %zu removed\n\r",
+                    changed, removed);
+        }
 
-                char *link = &full_path[strlen(loc_path) + 1];
-                char *ext = strrchr(dir_entry->d_name, '.');
+        b->reported = 1;
+    }
 
-                if (ext && strcmp(ext, ".wav") == 0) {
-                    fprintf(stdout, "\x1b[1m%s\x1b[0m\n\r", link);
-                    num_audio_files++;
-                    continue;
-                }
+    return 0;
+}
 
-                fprintf(stdout, "%s\n\r", link);
-            }
-        }
-        closedir(dir);
+// Lists the best matches for `query` under the prompt and puts the
+// cursor back at `column` of the prompt line
+void
+browse_matches(Browser *b, const char *query, int column)
+{
+    size_t hits = search_run(&b->search, query);
+    if (query[0] == '\0') { return; }
+
+    fprintf(stdout, "\n\r\x1b[2K  %zu/%zu", hits, b->search.count);
+
+    for (size_t i = 0; i < b->search.num_top; i++)
+    {
+        const char *path = search_top(&b->search, i);
+        size_t len = strlen(path);
+
+        // Long paths keep their end, which is where the file name is
+        fprintf(stdout, "\n\r\x1b[2K%s %s%s", i == 0 ? ">" : " ",
+                len > 72 ? "..." : "", len > 72 ? path + len - 69 : path);
     }
 
-    return num_audio_files;
+    fprintf(stdout, "\x1b[%zuA\x1b[%dG", b->search.num_top + 1, column);
+}
+
+static inline
+snd_pcm_format_t
+pcm_format(enum DspFormat format)
+{
+    switch (format)
+    {
+        case DSP_U8:  return SND_PCM_FORMAT_U8;
+        case DSP_S16: return SND_PCM_FORMAT_S16_LE;
+        case DSP_S24: return SND_PCM_FORMAT_S24_3LE;
+        case DSP_S32: return SND_PCM_FORMAT_S32_LE;
+        case DSP_F32: return SND_PCM_FORMAT_FLOAT_LE;
+        case DSP_F64: return SND_PCM_FORMAT_FLOAT64_LE;
+        default: return SND_PCM_FORMAT_UNKNOWN;
+    }
 }
 
+void
+unload_track(Track *t)
+{
+    st_close(t->stream);
+    t->stream = NULL;
+
+    if (t->file_buf)
+    {
+        munmap(t->file_buf, t->file_size);
+    }
+    t->file_buf = NULL;
+    t->pcm_data = NULL;
+}
+
+// Maps and parses a WAV file. Same return codes as read_file().
 int
-read_file(
-        char *file_path,
-        WAVHeader *header,
-        AudioInfo *info,
-        char **file_buf,
-        int *offset)
+load_track(
+        Track *t,
+        const char *path,
+        int verbose)
 {
-    // Check if the file exists
-	{
-        int retval;
-		struct stat stat_buf;
-		if ((retval = stat(file_path, &stat_buf)) != 0) {
-			fprintf(stderr, "File not found, stat failed.\n\r");
-			exit(EXIT_FAILURE);
-		} 
-		info->audio_size = stat_buf.st_size;
-	}
+    int offset = 0;
+    int retval;
 
-	int fd = open(file_path, O_RDONLY);
-*file_buf = (char *) mmap(NULL, info->audio_size, PROT_READ, MAP_SHARED, fd, 0);
-if (file_buf == MAP_FAILED) {
-		fprintf(stderr, "Failed to map %s file.\n", file_path);
-        return -2;
-	}
-	close(fd);
+    snprintf(t->path, sizeof(t->path), "%s", path);
+    memset(&t->header, 0, sizeof(t->header));
+
+    retval = read_file(t->path, &t->header, &t->file_size, &t->file_buf, &offset, verbose);
+    if (retval != 0) { return retval; }
+
+    if (validate_header(t->path, &t->header, verbose) != 0) { return -1; }
 
-    *offset = 0;
+    t->pcm_data = (uint8_t *) t->file_buf + offset;
+    t->frame_size = t->header.bps / 8 * t->header.num_channels;
+    t->total_frames = t->header.subchunk2_size / t->frame_size;
 
-    // RIFF Chunk
-    memcpy((uint8_t *) &(header->chunk_id), *file_buf + *offset, 4);
-    *offset += 4;
+    // The mapping is only used for the header from here on
+    if (use_stream)
+    {
+        t->stream = st_open(t->path,
+                offset,
+                t->total_frames * t->frame_size,
+                t->frame_size,
+                readahead_bytes);
+        if (!t->stream) { return -1; }
+
+        if (lock_memory)
+        {
+            mlock(t->stream->ring, t->stream->ring_size);
+        }
+    }
+
+    return 0;
+}
 
-    memcpy((uint8_t *) &(header->chunk_size), *file_buf + *offset, 4);
-    *offset += 4;
+// Starts read-ahead for the whole file and takes the page faults for
+// its first PREFAULT_BYTES here instead of on the audio thread
+void
+prefault_track(Track *t)
+{
+    // The reader thread is already filling its ring
+    if (t->stream) { return; }
 
-    memcpy((uint8_t *) &(header->format), *file_buf + *offset, 4);
-    *offset += 4;
+    madvise(t->file_buf, t->file_size, MADV_SEQUENTIAL);
+    madvise(t->file_buf, t->file_size, MADV_WILLNEED);
 
-    // RIFF/WAVE container
-    if (strncmp(header->chunk_id, "RIFF", 4) != 0)
+    size_t end = (t->file_size < PREFAULT_BYTES) ? t->file_size : PREFAULT_BYTES;
+    volatile char sink = 0;
+    for (size_t i = 0; i < end; i += 4096)
     {
-        fprintf(stderr, "Not a valid RIFF/WAVE file.\n\r");
-        return -1;
+        sink ^= t->file_buf[i];
     }
-    // Validate file size with WAV header
-    if (strncmp(header->format, "WAVE", 4) != 0)
+    (void) sink;
+}
+
+// Gapless mode: loads playlist entry next_index into the idle slot
+// each time the audio thread posts prefetch_want
+void *
+prefetch_tracks(AudioInfo *info)
+{
+    for (;;)
     {
-        fprintf(stderr, "WAVE chunk is not found.\n\r");
-        return -1;
+        if (sem_wait(&info->prefetch_want) != 0) { continue; }
+        if (info->prefetch_quit) { break; }
+
+        // Slot the audio thread just left, or the one never used yet
+        Track *idle = &info->tracks[!info->cur_track];
+        unload_track(idle);
+
+        if (info->next_index >= info->playlist->count ||
+            load_track(idle, info->playlist->audio_paths[info->next_index], 0) != 0)
+        {
+            unload_track(idle);
+            atomic_store_explicit(&info->next_ready, -1, memory_order_release);
+            sem_post(&info->next_done);
+            continue;
+        }
+
+        prefault_track(idle);
+        atomic_store_explicit(&info->next_ready, 1, memory_order_release);
+        sem_post(&info->next_done);
     }
 
-	// Check file size
-	// Exclude extra 8 bytes from header
-	{
-		int file_size_valid = info->audio_size - 8 - header->chunk_size;
-		if (file_size_valid != 0) {
-			fprintf(stderr, "%s file size does not match with chunk size.\n", file_path);
-            return -1;
-		}
-	}
+    pthread_exit(NULL);
+}
+
+// ------------------------------- //
+// ------- OFFLINE RENDER -------- //
+// ------------------------------- //
+
+void *
+render_worker(RenderBatch *batch)
+{
+    for (;;)
+    {
+        int i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count) { break; }
+
+        RenderJob *job = &batch->jobs[i];
+        Track t = { 0 };
+        struct stat in_stat, out_stat;
+
+        if (load_track(&t, job->in_path, 0) != 0)
+        {
+            atomic_fetch_add(&batch->failed, 1);
+            unload_track(&t);
+            continue;
+        }
+
+        // Truncating the output would pull the mapping out from under us
+        if (stat(job->in_path, &in_stat) == 0 &&
+            stat(job->out_path, &out_stat) == 0 &&
+            in_stat.st_dev == out_stat.st_dev &&
+            in_stat.st_ino == out_stat.st_ino)
+        {
+            fprintf(stderr, "%s: output would overwrite the input.\n\r", job->in_path);
+            atomic_fetch_add(&batch->failed, 1);
+            unload_track(&t);
+            continue;
+        }
+
+        madvise(t.file_buf, t.file_size, MADV_SEQUENTIAL);
+
+        if (render_pcm(job->out_path,
+                    t.pcm_data,
+                    t.total_frames,
+                    dsp_format(t.header.audio_format, t.header.bps),
+                    t.header.num_channels,
+                    t.header.sample_rate,
+                    &batch->params,
+                    conv_ir.frames ? &conv_ir : NULL,
+                    &batch->stats[i]) != 0)
+        {
+            atomic_fetch_add(&batch->failed, 1);
+        }
+
+        unload_track(&t);
+    }
+
+    pthread_exit(NULL);
+}
+
+// Renders every job on a pool of `workers` threads and reports the
+// throughput. Returns the number of jobs that failed.
+int
+render_run(RenderJob *jobs, int count, int workers)
+{
+    RenderBatch batch = {
+        .jobs = jobs,
+        .stats = calloc(count, sizeof(RenderStats)),
+        .count = count,
+        .params = { .bands = calloc(equalizer.num_bands, sizeof(BiquadInfo)) },
+    };
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failed, 0);
+
+    if (workers > count) { workers = count; }
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+
+    if (!batch.stats || !threads || !batch.params.bands)
+    {
+        fprintf(stderr, "Failed to allocate render jobs.\n\r");
+        free(batch.stats);
+        free(batch.params.bands);
+        free(threads);
+        return count;
+    }
+
+    eq_snapshot(&equalizer, &batch.params);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
+    int started = 0;
+    while (started < workers &&
+           pthread_create(&threads[started], NULL,
+               (void *(*)(void *)) render_worker, &batch) == 0)
     {
-        struct {
-            char id[4];
-            uint32_t size;
-        } chunk;
-        uint8_t found_fmt = 0;
-
-        // Added a limit to the offset in case
-        // of an invalid WAV header
-        while (*offset < 100)
+        started++;
+    }
+
+    if (started == 0)
+    {
+        fprintf(stderr, "Failed to create a thread.\n");
+        atomic_store(&batch.failed, count);
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    size_t bytes = 0;
+    double audio_secs = 0.0;
+    for (int i = 0; i < count; i++)
+    {
+        bytes += batch.stats[i].bytes;
+        audio_secs += batch.stats[i].audio_secs;
+    }
+
+    int failed = atomic_load(&batch.failed);
+    if (elapsed <= 0.0) { elapsed = 1e-9; }
+
+    fprintf(stdout,
+            "Rendered %d/%d files on %d threads: %.1f MB in %.2f s, "
+            "%.1f MB/s, %.1fx realtime\n\r",
+            count - failed, count, started,
+            bytes / 1e6, elapsed,
+            bytes / 1e6 / elapsed,
+            audio_secs / elapsed);
+
+    free(batch.stats);
+    free(batch.params.bands);
+    free(threads);
+    return failed;
+}
+
+// Builds the job list for --render: a single file, every .wav in a
+// directory, or the playlist, and runs it
+int
+render_main(const char *in_path, Playlist *playlist, uint8_t from_dir)
+{
+    struct stat stat_buf;
+    RenderJob *jobs = NULL;
+    char **names = NULL;
+    int count = 0;
+
+    uint8_t batch = from_dir || playlist;
+    if (!batch)
+    {
+        jobs = calloc(1, sizeof(RenderJob));
+        if (!jobs) { return -1; }
+
+        jobs[0].in_path = in_path;
+        snprintf(jobs[0].out_path, sizeof(jobs[0].out_path), "%s", render_path);
+        count = 1;
+    }
+    else
+    {
+        // Batch output goes into a directory, under the input's name
+        if (stat(render_path, &stat_buf) != 0 && mkdir(render_path, 0755) != 0)
         {
-            memcpy((uint8_t *) &chunk, *file_buf + *offset, 8);
-            *offset += 8;
-            printf("%.*s\n\r", 4, chunk.id);
+            fprintf(stderr, "Failed to create %s: %s\n\r", render_path, strerror(errno));
+            return -1;
+        }
 
-            if (strncmp(chunk.id, "fmt ", 4) == 0)
+        if (from_dir)
+        {
+            DIR *dir = opendir(in_path);
+            struct dirent *entry;
+
+            if (!dir)
             {
-                memcpy(&(header->subchunk1_id), (uint8_t *) &chunk, 8);
-                memcpy(&(header->audio_format), (uint8_t *) *file_buf + *offset, 16);
-                *offset += 16;
-                found_fmt = 1;
+                fprintf(stderr, "Failed to open %s: %s\n\r", in_path, strerror(errno));
+                return -1;
             }
-            else if (strncmp(chunk.id, "data", 4) == 0)
+
+            while ((entry = readdir(dir)) != NULL)
             {
-                memcpy(&(header->subchunk2_id), &chunk, 8);
-                // Reached the actual audio
-                break;
+                char *ext = strrchr(entry->d_name, '.');
+                if (!ext || strcmp(ext, ".wav") != 0) { continue; }
+
+                char **grown = realloc(names, (count + 1) * sizeof(char *));
+                if (!grown) { break; }
+                names = grown;
+
+                size_t len = strlen(in_path) + strlen(entry->d_name) + 2;
+                names[count] = malloc(len);
+                if (!names[count]) { break; }
+                snprintf(names[count], len, "%s/%s", in_path, entry->d_name);
+                count++;
             }
-            else
-            {
-                // Skip other subchunks, checks for padding
-                uint32_t bytes_to_skip = chunk.size;
+            closedir(dir);
+        }
+        else
+        {
+            count = playlist->count;
+        }
 
-                if (bytes_to_skip % 2 != 0)
-                {
-                    bytes_to_skip += 1;
-                }
+        jobs = calloc(count ? count : 1, sizeof(RenderJob));
+        if (!jobs) { count = 0; }
+
+        for (int i = 0; i < count; i++)
+        {
+            jobs[i].in_path = from_dir ? names[i] : playlist->audio_paths[i];
+
+            const char *base = strrchr(jobs[i].in_path, '/');
+            base = base ? base + 1 : jobs[i].in_path;
+            snprintf(jobs[i].out_path, sizeof(jobs[i].out_path), "%s/%s", render_path, base);
+        }
+    }
 
-                *offset += bytes_to_skip;
-            }
+    int failed = -1;
+    if (count > 0)
+    {
+        int workers = render_jobs;
+        if (workers <= 0) { workers = sysconf(_SC_NPROCESSORS_ONLN); }
+        if (workers <= 0) { workers = 1; }
 
-            // TODO(daria): handle all types of chunks
-            // https://www.recordingblogs.com/wiki/wave-file-format
-        }
+        failed = render_run(jobs, count, workers);
+    }
+    else
+    {
+        fprintf(stderr, "Nothing to render.\n\r");
+    }
 
-        if (!found_fmt)
-        {
-            fprintf(stderr, "fmt subchunk is not found\n\r");
-            return -2;
-        }
-        
-        if (*offset > 100)
-        {
-            fprintf(stderr, "WAV Header is incomplete");
-            return -2;
-        }
+    for (int i = 0; names && i < count; i++)
+    {
+        free(names[i]);
     }
+    free(names);
+    free(jobs);
 
-    return 0;
+    return (failed == 0) ? 0 : -1;
 }
 
-int
-validate_header(
-        char *file_path,
-        WAVHeader *header)
+// --stats: the hot-path timings as one JSON object, for collecting
+// from many machines. Times are in ns, sizes in frames.
+static
+void
+write_stats(
+        LoopStats *stats,
+        const char *path)
 {
-	// Sample Rate in Normal Range
-	if (header->sample_rate < 8000 && header->sample_rate > 192000)
-	{
-		fprintf(stderr, "%s file has sample rate outside the normal range\n", file_path);
-        return -1;
-	}
-
-	// Number of Channels
-	if (header->num_channels != 1 && header->num_channels != 2)
-	{
-		fprintf(stderr, "%s file is neither mono (1) or stereo (2)\n", file_path);
-        return -1;
-	}
-	
-	// BPS
-	if (!(header->bps == 8 || header->bps == 16 || header->bps == 24 || header->bps == 32))
-	{
-		fprintf(stderr, "%s file has invalid BPS\n", file_path);
-        return -1;
-	}
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to create %s: %s\n\r", path, strerror(errno));
+        return;
+    }
 
-	fprintf(stdout, "%s is a valid WAV file\n\r", file_path);
-    return 0;
+    unsigned int fill_min = atomic_load(&stats->fill_min);
+
+    fprintf(f, "{\n  \"xruns\": %u,\n  \"suspends\": %u,\n  \"buffer_frames\": %u,\n"
+            "  \"chunk_us\": %u,\n  \"fill_min_frames\": %d,\n",
+            atomic_load(&stats->xruns),
+            atomic_load(&stats->suspends),
+            atomic_load(&stats->buffer_frames),
+            atomic_load(&stats->chunk_us),
+            (fill_min == UINT_MAX) ? -1 : (int) fill_min);
+
+    fprintf(f, "  \"convert_ns\": ");
+    hist_json(&stats->convert, f);
+    fprintf(f, ",\n  \"filter_ns\": ");
+    hist_json(&stats->filter, f);
+    fprintf(f, ",\n  \"dsp_ns\": ");
+    hist_json(&stats->dsp, f);
+    fprintf(f, ",\n  \"write_ns\": ");
+    hist_json(&stats->write, f);
+    fprintf(f, "\n}\n");
+
+    fclose(f);
 }
 
 int
 main(int argc, char *argv[])
 {
     int retval;
-	WAVHeader header = { 0 };
     Playlist playlist = { 0 };
-	AudioInfo info;
-    char *file_buf = NULL;
-    int offset = 0;
+	AudioInfo info = { 0 };
     int is_playlist = 0;
     int is_interactive = 0;
     int filter_idx = -1;
+    int precision_idx = -1;
+    int refresh_idx = -1;
+    uint8_t render_dir = 0;
 	
 	clear_screen();
 	fflush(stdout);
@@ -757,10 +2017,6 @@ main(int argc, char *argv[])
 	char file_path[1300];
 	(argc > 1) ? strncpy(file_path, argv[1], 255) : 0;
 
-	INIT_BQ(filters[0], 1000.0f, 1.0f, -5.0f);
-	INIT_BQ(filters[1], 1000.0f, 1.0f, -5.0f);
-	INIT_BQ(filters[2], 1000.0f, 1.0f, -5.0f);
-
 	fprintf(stdout, "-- \x1b[34myacht\x1b[0m --\n");
 	enable_raw_mode();
 
@@ -785,7 +2041,167 @@ main(int argc, char *argv[])
 			{
                 filter_idx = i;
 			}
+			if (strcmp(argv[i], "--precision") == 0)
+			{
+                precision_idx = i;
+			}
+			if (strcmp(argv[i], "--refresh") == 0)
+			{
+                refresh_idx = i;
+			}
+			if (strcmp(argv[i], "--io") == 0)
+			{
+                const char *mode = (i + 1 < argc) ? argv[i + 1] : "";
+
+                if (strcmp(mode, "stream") == 0) { use_stream = 1; }
+                else if (strcmp(mode, "mmap") == 0) { use_stream = 0; }
+                else
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--io mmap|stream]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+			}
+			if (strcmp(argv[i], "--readahead") == 0)
+			{
+                long kib = (i + 1 < argc) ? atol(argv[i + 1]) : 0;
+
+                if (kib <= 0)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--readahead <KiB>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                readahead_bytes = (size_t) kib * 1024;
+			}
+			if (strcmp(argv[i], "--latency") == 0)
+			{
+                const char *name = (i + 1 < argc) ? argv[i + 1] : "";
+
+                latency_profile = out_find_profile(name);
+                if (!latency_profile)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> "
+                            "[--latency low-latency|balanced|power-save]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+			}
+			if (strcmp(argv[i], "--rt") == 0)
+			{
+                rt_priority = (i + 1 < argc) ? atoi(argv[i + 1]) : 0;
+
+                if (rt_priority < 1 || rt_priority > 99)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--rt <1-99>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+			}
+			if (strcmp(argv[i], "--cpu") == 0)
+			{
+                audio_cpu = (i + 1 < argc) ? atoi(argv[i + 1]) : -1;
+
+                if (audio_cpu < 0 || audio_cpu >= CPU_SETSIZE)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--cpu <n>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+			}
+			if (strcmp(argv[i], "--mlock") == 0)
+			{
+                lock_memory = 1;
+			}
+			if (strcmp(argv[i], "--gapless") == 0)
+			{
+                gapless = 1;
+			}
+			if (strcmp(argv[i], "--mmap") == 0)
+			{
+                use_mmap = 1;
+			}
+			if (strcmp(argv[i], "--render") == 0)
+			{
+                if (i + 1 >= argc)
+                {
+                    fprintf(stdout, "Usage: %s <wav file|directory> [--render <wav file|directory>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                render_path = argv[i + 1];
+			}
+			if (strcmp(argv[i], "--ir") == 0)
+			{
+                if (i + 1 >= argc)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--ir <wav file>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                ir_path = argv[i + 1];
+			}
+			if (strcmp(argv[i], "--rate") == 0)
+			{
+                long hz = (i + 1 < argc) ? atol(argv[i + 1]) : 0;
+
+                if (hz < 8000 || hz > 384000)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--rate <8000-384000 Hz>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                out_rate = hz;
+			}
+			if (strcmp(argv[i], "--float-out") == 0)
+			{
+                float_out = 1;
+			}
+			if (strcmp(argv[i], "--max-buffer") == 0)
+			{
+                long ms = (i + 1 < argc) ? atol(argv[i + 1]) : -1;
+
+                if (ms < 0 || ms > 10000)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--max-buffer <0-10000 ms>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                max_buffer_ms = ms;
+			}
+			if (strcmp(argv[i], "--stats") == 0)
+			{
+                if (i + 1 >= argc)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--stats <json file>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                stats_path = argv[i + 1];
+			}
+			if (strcmp(argv[i], "--resample") == 0)
+			{
+                const char *q = (i + 1 < argc) ? argv[i + 1] : "";
+
+                if (strcmp(q, "fast") == 0) { rs_quality = RS_FAST; }
+                else if (strcmp(q, "good") == 0) { rs_quality = RS_GOOD; }
+                else if (strcmp(q, "best") == 0) { rs_quality = RS_BEST; }
+                else
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--resample fast|good|best]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+			}
+			if (strcmp(argv[i], "--jobs") == 0)
+			{
+                render_jobs = (i + 1 < argc) ? atoi(argv[i + 1]) : 0;
+
+                if (render_jobs < 1)
+                {
+                    fprintf(stdout, "Usage: %s <wav file> [--render <path>] [--jobs <n>]\n\r", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+			}
 		}
+
+        // Rendering a directory needs no file picker
+        struct stat stat_buf;
+        if (render_path && !is_playlist &&
+            stat(argv[1], &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode))
+        {
+            render_dir = 1;
+            is_interactive = 0;
+        }
     }
 
 	if (is_interactive)
@@ -794,51 +2210,44 @@ main(int argc, char *argv[])
         // ----- DIRECTORY TRAVERSAL ----- //
         // ------------------------------- //
 
-		DIR *dir = NULL;
-		struct dirent *dir_entry = NULL;
-		char directories[MAX_STRINGS][MAX_STRING_LEN];
-		char files[MAX_STRINGS][MAX_STRING_LEN];
-		int num_dir = 0;
-		int file_idx = 0;
-
 		char c[2] = { 0 };
 		char input_line[255] = { 0 };
+		const char *prompt = "Enter WAV file (Ctrl-Q to exit): ";
 		int length = 0;
 		int line_length = 0;
 
 		char loc_path[255] = { 0 };
 
 		getcwd(loc_path, 255);
-		memset(&directories[0], '\0', sizeof(directories));
-
-		int num_audio_files = 0;
-
-        // Add current directory to explore
-		strcpy(directories[num_dir], loc_path);
-        num_dir++;
 
-        // Print all files in the directory
-        // including ones in the subdirectory
-        num_audio_files = print_files(&num_dir, dir_entry, dir,
-                directories, loc_path, files, &file_idx);
-
-		fprintf(stdout,
-				"\n\rNumber of WAV files: %d\n\r"
-				"Current Directory: %s\n\r",
-				num_audio_files, loc_path);
+        // Print all files in the directory, including ones in the
+        // subdirectories; the prompt is live in the meantime
+        Browser browser;
+        browse_start(&browser, loc_path);
 
         // Shell-like loop
 		while (length != -1)
 		{
-			fprintf(stdout, "\rEnter WAV file (Ctrl-Q to exit): %s", input_line);
+			fprintf(stdout, "\r%s%s", prompt, input_line);
+			browse_matches(&browser, input_line, strlen(prompt) + strlen(input_line) + 1);
 			fflush(stdout);
 
 			c[length] = '\0';
+			length = prompt_wait(&browser);
+			if (length == 0) { continue; }
+
 			length = read(STDIN_FILENO, c, 1);
 			line_length = strlen(input_line);
 
+			// Matches go away with any key
+			fprintf(stdout, "\x1b[J");
+
 			// CTRLQ
-			if (c[0] == 17)  { return 0; }
+			if (c[0] == 17)
+            {
+                browse_stop(&browser);
+                return 0;
+            }
             // ESC - Ignore
 			else if (c[0] == '\x1b')
 			{
@@ -852,12 +2261,29 @@ main(int argc, char *argv[])
             { 
                 input_line[line_length - 1] = '\0';
             }
+			// TAB - Take the best match
+			else if (c[0] == '\t')
+			{
+				const char *top = search_top(&browser.search, 0);
+				if (top) { snprintf(input_line, sizeof(input_line), "%s", top); }
+			}
 			// ENTER
 			else if (c[0] == 13)
 			{
 				fprintf(stdout, "\n\r");
 				fflush(stdout);
 
+				// Whatever is typed goes if it exists, the best match
+				// otherwise
+				struct stat typed;
+				const char *top = search_top(&browser.search, 0);
+
+				if (top && stat(input_line, &typed) != 0 &&
+					!(is_playlist && strcmp(input_line, "finish playlist") == 0))
+				{
+					snprintf(input_line, sizeof(input_line), "%s", top);
+				}
+
 				int result = chdir(input_line);
 				if (result != -1)
 				{
@@ -867,20 +2293,8 @@ main(int argc, char *argv[])
 
                     getcwd(loc_path, 255);
 
-                    memset(&directories[0], '\0', MAX_STRINGS * MAX_STRING_LEN);
-                    memset(&files[0], '\0', MAX_STRINGS * MAX_STRING_LEN);
-                    num_dir = 1;
-                    file_idx = 0;
-
-                    strcpy(directories[0], loc_path);
-
-                    num_audio_files = print_files(&num_dir, dir_entry, dir,
-                            directories, loc_path, files, &file_idx);
-
-                    fprintf(stdout,
-                            "\n\rNumber of WAV files: %d\n\r"
-                            "Current Directory: %s\n\r",
-                            num_audio_files, loc_path);
+                    browse_stop(&browser);
+                    browse_start(&browser, loc_path);
 				}
                 else
                 {
@@ -921,9 +2335,11 @@ main(int argc, char *argv[])
 			}
 			else if (line_length + 1 < 255) { strcat(input_line, c); }
 
-			// Clear current line
-			fprintf(stdout, "\x1b[1G\x1b[2K");
+			// Clear current line and the matches under it
+			fprintf(stdout, "\x1b[1G\x1b[J");
 		}
+
+        browse_stop(&browser);
 	}
 
 	if (filter_idx > 0)
@@ -936,159 +2352,297 @@ main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
 
-        FILE *fp = fopen(argv[filter_idx + 1], "r");
-        char *line_buf = NULL;
-        size_t line_size = 0;
-        ssize_t nread = 0;
-
-        if (!fp)
+        if (eq_load(argv[filter_idx + 1], &filters, &num_filters, &bq_precision) != 0)
         {
-            fprintf(stderr, "Failed to open %s file\n\r", argv[filter_idx + 1]);
             exit(EXIT_FAILURE);
         }
 
-        uint8_t filter_nargs = 0;
-        while ((nread = getline(&line_buf, &line_size, fp)) != -1)
+        if (num_filters == 0)
         {
-            if (line_buf[nread - 1] == '\n')
-            {
-                line_buf[nread - 1] = '\0';
-            }
+            fprintf(stdout,
+            "No filters are applied; none were valid.\n\r");
+        }
+	}
 
-            if (strcmp(line_buf, "BQ_PEAKING") == 0)
-            {
-                filters[num_filters].type = BQ_PEAKING;
-                filter_nargs = 3;
-            }
-            else if (strcmp(line_buf, "BQ_LOWSHELF") == 0)
-            {
-                filters[num_filters].type = BQ_LOWSHELF;
-                filter_nargs = 3;
-            }
-            else if (strcmp(line_buf, "BQ_HIGHSHELF") == 0)
-            {
-                filters[num_filters].type = BQ_HIGHSHELF;
-                filter_nargs = 3;
-            }
-            else if (strcmp(line_buf, "BQ_LOWPASS") == 0)
-            {
-                filters[num_filters].type = BQ_LOWPASS;
-                filter_nargs = 2;
-            }
-            else if (strcmp(line_buf, "BQ_HIGHPASS") == 0)
-            {
-                filters[num_filters].type = BQ_HIGHPASS;
-                filter_nargs = 2;
-            }
-            else
-            {
-                continue;
-            }
+    // Short or no filter file: the rest of the default bands start off
+    if (num_filters < EQ_DEFAULT_BANDS)
+    {
+        BiquadInfo *grown = realloc(filters, EQ_DEFAULT_BANDS * sizeof(BiquadInfo));
+        if (!grown)
+        {
+            fprintf(stderr, "Failed to allocate the EQ.\n\r");
+            exit(EXIT_FAILURE);
+        }
 
-            for (uint8_t i = 0; i < filter_nargs; i++)
-            {
-                if ((nread = getline(&line_buf, &line_size, fp) == -1))
-                {
-                    fprintf(stderr,
-                    "Not enough args for filter #%d\n\r",
-                    num_filters + 1);
-                    exit(EXIT_FAILURE);
-                }
+        filters = grown;
+        for (; num_filters < EQ_DEFAULT_BANDS; num_filters++)
+        {
+            INIT_BQ(filters[num_filters], 1000.0f, 1.0f, -5.0f);
+        }
+    }
 
-                errno = 0;
-                char *end;
-                filters[num_filters].args[i] = strtof(line_buf, &end);
-            }
+    if (refresh_idx > 0)
+    {
+        int hz = (refresh_idx + 1 < argc) ? atoi(argv[refresh_idx + 1]) : 0;
 
-            num_filters++;
+        if (hz <= 0 || hz > 1000)
+        {
+            fprintf(stdout, "Usage: %s <wav file> [--refresh <1-1000 Hz>]\n\r",
+                    argv[0]
+            );
+            exit(EXIT_FAILURE);
         }
-        
-        if (num_filters == 0)
+        refresh_hz = hz;
+    }
+
+    // The flag wins over a directive in the filter file
+    if (precision_idx > 0)
+    {
+        char *mode = (precision_idx + 1 < argc) ? argv[precision_idx + 1] : "";
+
+        if (strcmp(mode, "auto") == 0) { bq_precision = BQ_AUTO; }
+        else if (strcmp(mode, "float") == 0) { bq_precision = BQ_FLOAT; }
+        else if (strcmp(mode, "double") == 0) { bq_precision = BQ_DOUBLE; }
+        else
         {
-            fprintf(stdout,
-            "No filters are applied; none were valid.\n\r");
+            fprintf(stdout, "Usage: %s <wav file> [--precision auto|float|double]\n\r",
+                    argv[0]
+            );
+            exit(EXIT_FAILURE);
         }
+    }
 
-        free(line_buf);
-        fclose(fp);
-	}
+    if (ir_path && conv_load_ir(ir_path, &conv_ir) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    bq_presets_init();
+    if (eq_init(&equalizer, filters, num_filters, bq_precision) != 0)
+    {
+        fprintf(stderr, "Failed to allocate the EQ.\n\r");
+        exit(EXIT_FAILURE);
+    }
+
+    if (render_path)
+    {
+        // Reads run front to back; the ring buys nothing here
+        use_stream = 0;
+
+        retval = render_main(render_dir ? argv[1] : file_path,
+                is_playlist ? &playlist : NULL,
+                render_dir);
+        fflush(stdout);
+        return (retval == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     
     if (is_playlist)
     {
         strncpy(file_path, playlist.audio_paths[0], MAX_STRING_LEN); 
     }
 
+    atomic_init(&info.status_seq, 0);
+    atomic_init(&info.goto_digits, -1);
+    atomic_init(&info.goto_ms, 0);
+    info.scrub = 0;
+    info.seeks = 0;
+    info.seek_ms = 0.0f;
+    info.seek_ms_max = 0.0f;
+    loop_stats_init(&info.stats);
+    info.display_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    info.pager_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    atomic_init(&info.pager_frame, SIZE_MAX);
+    info.cmd_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    info.input_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    memset(info.tracks, 0, sizeof(info.tracks));
+    info.cur_track = 0;
+    info.playlist = (is_playlist && gapless) ? &playlist : NULL;
+    sem_init(&info.prefetch_want, 0, 0);
+    sem_init(&info.next_done, 0, 0);
+
+    // The device stays open across tracks that share its format
+    uint8_t out_ready = 0;
+    WAVHeader out_format = { 0 };
+    int float_ok = -1; // device takes FLOAT_LE; -1 until asked
+
+    // tracks[cur_track] was already loaded by the prefetch thread
+    uint8_t preloaded = 0;
+
     while (1)
     {
-        // ------------------------------- //
-        // ------- FILE READING ---------- //
-        // ------------------------------- //
+        Track *track = &info.tracks[info.cur_track];
 
-        retval = read_file(file_path, &header, &info, &file_buf, &offset);
+        if (!preloaded)
+        {
+            // ------------------------------- //
+            // ------- FILE READING ---------- //
+            // --- HEADER FIELD VALIDATION --- //
+            // ------------------------------- //
 
-        if (retval == -1) { goto CLEANUP; }
-        if (retval == -2) { goto EXIT; }
+            retval = load_track(track, file_path, 1);
 
-        // ------------------------------- //
-        // --- HEADER FIELD VALIDATION --- //
-        // ------------------------------- //
+            if (retval == -1) { goto CLEANUP; }
+            if (retval == -2) { goto EXIT; }
+        }
+        preloaded = 0;
 
-        retval = validate_header(file_path, &header);
-        if (retval == -1) { goto CLEANUP; }
+        // Get the audio file's sample format
+        int src_format = dsp_format(track->header.audio_format, track->header.bps);
+        if (src_format < 0)
+        {
+            fprintf(stderr, "Unsupported sample format: %d-bit\n", track->header.bps);
+            goto CLEANUP;
+        }
 
-        info.pcm_data = (uint8_t *) file_buf + offset;
-        size_t pcm_size = header.subchunk2_size;
+        // Float goes out as float when the device takes it, which is
+        // asked once, before it is first opened. 64-bit float is not
+        // worth the bandwidth, and with no float support at all float
+        // files go out as 32-bit integers.
+        if (float_ok < 0 && (src_format >= DSP_F32 || float_out))
+        {
+            float_ok = out_probe_format(SND_PCM_FORMAT_FLOAT_LE);
+        }
 
-        // Opens default sound device
-        snd_pcm_open(&info.pcm_handle, "default", SND_PCM_STREAM_PLAYBACK, 0);
+        enum DspFormat dev_format = src_format;
+        if ((src_format >= DSP_F32 || float_out) && float_ok == 1) { dev_format = DSP_F32; }
+        else if (src_format >= DSP_F32) { dev_format = DSP_S32; }
 
-        // Get the audio file's PCM format
-        snd_pcm_format_t pcm_format;
+        // With --rate the device stays at that rate and any other is
+        // resampled, so only a new format or layout reopens it
+        if (out_ready &&
+            (dev_format != info.dev_format ||
+             track->header.num_channels != out_format.num_channels ||
+             (!out_rate && track->header.sample_rate != out_format.sample_rate)))
+        {
+            out_close(&info.out);
+            out_ready = 0;
+        }
 
-        // PCM
-        switch (header.bps)
+        if (!out_ready)
         {
-            case 16:
-                pcm_format = SND_PCM_FORMAT_S16_LE;
-                break;
-            case 24:
-                pcm_format = SND_PCM_FORMAT_S24_3LE;
-                break;
-            case 32:
-                pcm_format = SND_PCM_FORMAT_S32_LE;
-                break;
-            default:
-                fprintf(stderr, "Unsupported bit depth: %d\n", header.bps);
-                goto CLEANUP;
+            unsigned int device_rate = out_rate ? out_rate : track->header.sample_rate;
+
+            // Opens default sound device and sets the parameters
+            retval = out_open(&info.out,
+                    pcm_format(dev_format),
+                    track->header.num_channels,
+                    device_rate,
+                    dsp_format_bytes(dev_format) * track->header.num_channels,
+                    CHUNK_FRAMES,
+                    latency_profile,
+                    max_buffer_ms,
+                    use_mmap,
+                    lock_memory);
+            if (retval != 0) { goto CLEANUP; }
+
+            out_ready = 1;
+            out_format = track->header;
+            info.dev_format = dev_format;
+
+            // The response only fits audio of its own rate and layout
+            if (conv_ir.frames &&
+                (conv_ir.rate != (int) device_rate ||
+                 (conv_ir.channels != 1 &&
+                  conv_ir.channels != track->header.num_channels)))
+            {
+                fprintf(stderr, "%s is %d Hz with %d channels, the device %u Hz with %u; "
+                        "playing without it.\n\r",
+                        ir_path, conv_ir.rate, conv_ir.channels,
+                        device_rate, track->header.num_channels);
+            }
         }
 
-        info.audio = &header;
+        track_activate(&info, track);
         info.loop = 0;
-        info.frame_size = header.bps / 8 * header.num_channels;
-        info.total_frames = pcm_size / info.frame_size;
-        info.frames_played = 0;
-
-        // Sets the parameters
-        snd_pcm_set_params(info.pcm_handle,
-                pcm_format,
-                SND_PCM_ACCESS_RW_INTERLEAVED,
-                header.num_channels,
-                header.sample_rate,
-                1, 500000);
 
-        info.filename = strrchr(file_path, '/');
-        if (info.filename == NULL) { info.filename = file_path; }
-        else { info.filename += 1; }
+        // The screen and pager read the status from the moment they
+        // start, long before the audio thread has set up the filters
+        // and publishes its own; the last track left it STOPPED
+        info.state = PLAYER_PLAYING;
+        info.frames_played = 0;
+        publish_status(&info);
 
         pthread_t player_thread;
         pthread_t screen_thread;
-        retval = pthread_create(&player_thread, NULL, (void *(*)(void *)) audio_play, &info);
+        pthread_t input_thread;
+        pthread_t prefetch_thread;
+
+        atomic_store(&info.keys.head, 0);
+        atomic_store(&info.keys.tail, 0);
+
+        if (info.playlist)
+        {
+            // Start loading the next entry right away
+            info.next_index = playlist.current_audio + 1;
+            info.prefetch_quit = 0;
+            while (sem_trywait(&info.next_done) == 0) {}
+            atomic_store(&info.next_ready, 0);
+            sem_post(&info.prefetch_want);
+
+            retval = pthread_create(&prefetch_thread, NULL, (void *(*)(void *)) prefetch_tracks, &info);
+            if (retval != 0)
+            {
+                fprintf(stderr, "Failed to create a thread.\n");
+                goto CLEANUP;
+            }
+        }
+
+        retval = pthread_create(&input_thread, NULL, (void *(*)(void *)) read_keys, &info);
+        if (retval != 0)
+        {
+            fprintf(stderr, "Failed to create a thread.\n");
+            goto CLEANUP;
+        }
+
+        {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+
+            if (audio_cpu >= 0)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(audio_cpu, &cpus);
+                pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+            }
+
+            if (rt_priority > 0)
+            {
+                struct sched_param param = { .sched_priority = rt_priority };
+                pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+                pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+                pthread_attr_setschedparam(&attr, &param);
+            }
+
+            retval = pthread_create(&player_thread, &attr, (void *(*)(void *)) audio_play, &info);
+
+            if (retval == EPERM && rt_priority > 0)
+            {
+                fprintf(stderr, "No permission for SCHED_FIFO, using normal priority.\n\r");
+                pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+                retval = pthread_create(&player_thread, &attr, (void *(*)(void *)) audio_play, &info);
+            }
+
+            pthread_attr_destroy(&attr);
+        }
+
         if (retval != 0)
         {
             fprintf(stderr, "Failed to create a thread.\n");
             goto CLEANUP;
         }
 
+        // The stream ring is locked already; the mapping needs a pager
+        pthread_t pager_thread;
+        uint8_t paging = lock_memory && !use_stream;
+
+        if (paging &&
+            pthread_create(&pager_thread, NULL, (void *(*)(void *)) lock_pages, &info) != 0)
+        {
+            paging = 0;
+        }
+
         retval = pthread_create(&screen_thread, NULL, (void *(*)(void *)) display_screen, &info);
         if (retval != 0)
         {
@@ -1100,22 +2654,51 @@ main(int argc, char *argv[])
         pthread_join(player_thread, &exit_player);
         pthread_join(screen_thread, NULL);
 
-        snd_pcm_drain(info.pcm_handle);
-        snd_pcm_close(info.pcm_handle);
-        snd_config_update_free_global();
+        if (paging) { pthread_join(pager_thread, NULL); }
 
-        if (*(int *)exit_player == 1)
         {
-            free(exit_player);
-            break;
+            uint64_t count = 1;
+            write(info.input_stop_fd, &count, sizeof(count));
+            pthread_join(input_thread, NULL);
+
+            // Reset the counters for the next track
+            read(info.input_stop_fd, &count, sizeof(count));
+            read(info.cmd_fd, &count, sizeof(count));
+            read(info.pager_fd, &count, sizeof(count));
+            atomic_store(&info.pager_frame, SIZE_MAX);
         }
 
+        if (info.playlist)
+        {
+            info.prefetch_quit = 1;
+            sem_post(&info.prefetch_want);
+            pthread_join(prefetch_thread, NULL);
+        }
+
+        // The audio thread may have moved on to later entries itself
+        track = &info.tracks[info.cur_track];
+
+        int quit = *(int *)exit_player;
+        free(exit_player);
+        if (quit == 1) { break; }
+
         if (is_playlist)
         {
+            // Prefetched, but in a format the open device cannot take
+            if (info.playlist && atomic_load(&info.next_ready) == 1)
+            {
+                unload_track(track);
+                info.cur_track = !info.cur_track;
+                playlist.current_audio = info.next_index;
+                preloaded = 1;
+                continue;
+            }
+
             playlist.current_audio++;
 
             if (playlist.current_audio < playlist.count)
             {
+                unload_track(track);
                 strncpy(file_path, playlist.audio_paths[playlist.current_audio], MAX_STRING_LEN);
                 continue;
             }
@@ -1126,7 +2709,14 @@ main(int argc, char *argv[])
 
 
 CLEANUP:
-	munmap(file_buf, info.audio_size);
+    if (stats_path) { write_stats(&info.stats, stats_path); }
+    if (out_ready)
+    {
+        out_close(&info.out);
+        snd_config_update_free_global();
+    }
+    unload_track(&info.tracks[0]);
+    unload_track(&info.tracks[1]);
 EXIT:
 	fflush(stderr);
 	return 0;
@@ -0,0 +1,224 @@
+#include "render.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "biquad.h"
+#include "dsp.h"
+#include "wav.h"
+
+static int
+render_write(int fd, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	while (size > 0)
+	{
+		ssize_t n = write(fd, p, size);
+		if (n < 0)
+		{
+			if (errno == EINTR) { continue; }
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+// Float path, for the convolver and the formats the int -> int kernels
+// do not take: the block is decoded to float, run through the EQ and
+// the convolver (if any) there and encoded. The first `*skip` frames
+// out of the convolver are its delay and are dropped. A NULL `src`
+// feeds the convolver silence.
+static int
+render_float(
+		int fd,
+		BiquadChain *chain,
+		Convolver *conv,
+		const uint8_t *src,
+		size_t frames,
+		float *fbuf,
+		uint8_t *block,
+		enum DspFormat format,
+		size_t *skip)
+{
+	const int channels = chain->channels;
+	const size_t samples = frames * channels;
+
+	if (src)
+	{
+		dsp_to_float(src, fbuf, samples, format);
+		bq_chain_process(chain, fbuf, frames);
+	}
+	else
+	{
+		memset(fbuf, 0, samples * sizeof(float));
+	}
+
+	if (conv) { conv_process(conv, fbuf, frames); }
+
+	size_t from = (*skip < frames) ? *skip : frames;
+	*skip -= from;
+
+	size_t n = (frames - from) * channels;
+	dsp_from_float(fbuf + from * channels, block, n, format);
+	return render_write(fd, block, n * dsp_format_bytes(format));
+}
+
+int
+render_pcm(
+		const char *out_path,
+		const uint8_t *pcm,
+		size_t frames,
+		enum DspFormat format,
+		int channels,
+		int rate,
+		const EqParams *params,
+		const ConvIR *ir,
+		RenderStats *stats)
+{
+	const int bps = dsp_format_bytes(format) * 8;
+	const size_t frame_size = bps / 8 * channels;
+	const size_t data_size = frames * frame_size;
+
+	if (data_size > UINT32_MAX - 36)
+	{
+		fprintf(stderr, "%s: too long for a WAV file.\n\r", out_path);
+		return -1;
+	}
+
+	if (ir && ir->rate != rate)
+	{
+		fprintf(stderr, "%s: impulse response is %d Hz, the audio %d Hz.\n\r",
+				out_path, ir->rate, rate);
+		return -1;
+	}
+
+	if (ir && ir->channels != 1 && ir->channels != channels)
+	{
+		fprintf(stderr, "%s: impulse response has %d channels, the audio %d.\n\r",
+				out_path, ir->channels, channels);
+		return -1;
+	}
+
+	BiquadChain *chain = bq_chain_new(params->num_bands);
+	uint8_t *block = malloc(RENDER_BLOCK_FRAMES * frame_size);
+	// Longest partition: offline, the delay costs nothing
+	Convolver *conv = ir ? conv_new(ir, channels, CONV_MAX_BLOCK) : NULL;
+	float *fbuf = malloc(RENDER_BLOCK_FRAMES * channels * sizeof(float));
+	if (!chain || !block || !fbuf || (ir && !conv))
+	{
+		fprintf(stderr, "Failed to allocate render buffers.\n\r");
+		bq_chain_free(chain);
+		free(block);
+		conv_free(conv);
+		free(fbuf);
+		return -1;
+	}
+
+	bq_denormals_off();
+	bq_chain_update(chain, params->bands, params->num_bands, channels, rate,
+			params->precision);
+
+	// NULL for float and 8-bit PCM, which take the float path
+	DspKernel kernel = (format == DSP_S16 || format == DSP_S24 || format == DSP_S32) ?
+		dsp_select(bps, channels, chain) : NULL;
+	if (!kernel && (channels < 1 || channels > BQ_MAX_CHANNELS))
+	{
+		fprintf(stderr, "%s: unsupported format for rendering.\n\r", out_path);
+		bq_chain_free(chain);
+		free(block);
+		conv_free(conv);
+		free(fbuf);
+		return -1;
+	}
+
+	int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Failed to create %s: %s\n\r", out_path, strerror(errno));
+		bq_chain_free(chain);
+		free(block);
+		conv_free(conv);
+		free(fbuf);
+		return -1;
+	}
+
+	// Canonical 44-byte header
+	WAVHeader header = {
+		.chunk_id = { 'R', 'I', 'F', 'F' },
+		.chunk_size = 36 + data_size,
+		.format = { 'W', 'A', 'V', 'E' },
+		.subchunk1_id = { 'f', 'm', 't', ' ' },
+		.subchunk1_size = 16,
+		.audio_format = (format == DSP_F32 || format == DSP_F64) ?
+			WAV_FORMAT_FLOAT : WAV_FORMAT_PCM,
+		.num_channels = channels,
+		.sample_rate = rate,
+		.byte_rate = rate * frame_size,
+		.block_align = frame_size,
+		.bps = bps,
+		.subchunk2_id = { 'd', 'a', 't', 'a' },
+		.subchunk2_size = data_size,
+	};
+
+	int retval = render_write(fd, &header, sizeof(header));
+	size_t skip = conv ? conv->block : 0;
+
+	for (size_t done = 0; retval == 0 && done < frames; done += RENDER_BLOCK_FRAMES)
+	{
+		size_t n = (frames - done > RENDER_BLOCK_FRAMES) ? RENDER_BLOCK_FRAMES : frames - done;
+		const uint8_t *src = pcm + done * frame_size;
+
+		// A flat EQ copies the samples through untouched, as in playback
+		if (!conv && chain->num_stages == 0)
+		{
+			retval = render_write(fd, src, n * frame_size);
+		}
+		else if (conv || !kernel)
+		{
+			retval = render_float(fd, chain, conv, src, n, fbuf, block, format, &skip);
+		}
+		else
+		{
+			kernel(src, block, n, chain);
+			retval = render_write(fd, block, n * frame_size);
+		}
+	}
+
+	// Silence pushes out what the convolver still holds
+	if (conv && retval == 0)
+	{
+		retval = render_float(fd, chain, conv, NULL, conv->block, fbuf, block, format, &skip);
+	}
+
+	if (retval != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %s\n\r", out_path, strerror(errno));
+	}
+
+	if (close(fd) != 0 && retval == 0)
+	{
+		fprintf(stderr, "Failed to write %s: %s\n\r", out_path, strerror(errno));
+		retval = -1;
+	}
+
+	bq_chain_free(chain);
+	free(block);
+	conv_free(conv);
+	free(fbuf);
+
+	if (retval == 0 && stats)
+	{
+		stats->bytes = data_size;
+		stats->audio_secs = (double) frames / rate;
+	}
+
+	return retval;
+}
@@ -0,0 +1,41 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conv.h"
+#include "dsp.h"
+#include "eq.h"
+
+// Frames per pass through the DSP kernel and per write() when rendering
+#define RENDER_BLOCK_FRAMES 16384
+
+typedef struct
+{
+	size_t bytes;      // PCM bytes processed
+	double audio_secs; // length of the audio rendered
+} RenderStats;
+
+// Runs `frames` frames of interleaved PCM through the same decode ->
+// EQ -> encode kernels as playback, as fast as the CPU allows, and
+// writes the result to `out_path` as a WAV file of the same format.
+// Float and 8-bit input is EQed in float and written back unclamped
+// (float) or clamped (8-bit).
+// With an impulse response `ir` (may be NULL) the EQ output is also
+// convolved with it; the convolver's delay is taken out, so the output
+// lines up with the input and is just as long. Returns 0, or -1 with a
+// message on stderr.
+int
+render_pcm(
+		const char *out_path,
+		const uint8_t *pcm,
+		size_t frames,
+		enum DspFormat format,
+		int channels,
+		int rate,
+		const EqParams *params,
+		const ConvIR *ir,
+		RenderStats *stats);
+
+#endif
@@ -0,0 +1,265 @@
+#include "resample.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "biquad.h"
+
+// Per quality: taps per phase, Kaiser beta (stopband about -60, -80
+// and -105 dB) and passband edge as a fraction of the lower Nyquist
+static const struct
+{
+	int taps;
+	double beta;
+	double rolloff;
+} rs_params[] =
+{
+	[RS_FAST] = { 16, 5.5, 0.80 },
+	[RS_GOOD] = { 32, 8.0, 0.88 },
+	[RS_BEST] = { 64, 10.5, 0.93 },
+};
+
+static int
+rs_gcd(int a, int b)
+{
+	while (b != 0)
+	{
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Zeroth-order modified Bessel function, for the Kaiser window
+static double
+rs_bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+
+	for (int k = 1; k < 64; k++)
+	{
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12) { break; }
+	}
+	return sum;
+}
+
+Resampler *
+rs_new(
+		int in_rate,
+		int out_rate,
+		int channels,
+		enum ResampleQuality quality)
+{
+	if (in_rate <= 0 || out_rate <= 0 ||
+		channels < 1 || channels > BQ_MAX_CHANNELS ||
+		quality < RS_FAST || quality > RS_BEST)
+	{
+		return NULL;
+	}
+
+	const int g = rs_gcd(in_rate, out_rate);
+	const int up = out_rate / g;
+	const int down = in_rate / g;
+	if (up > RS_MAX_PHASES) { return NULL; }
+
+	// Downsampling narrows the passband, so the filter spans as many
+	// more input frames; whole 16-float runs for the dot products
+	int taps = rs_params[quality].taps;
+	if (down > up) { taps = (int) ((int64_t) taps * down / up); }
+	taps = (taps + 15) & ~15;
+
+	Resampler *r = calloc(1, sizeof(Resampler));
+	if (!r) { return NULL; }
+
+	r->in_rate = in_rate;
+	r->out_rate = out_rate;
+	r->up = up;
+	r->down = down;
+	r->taps = taps;
+	r->channels = channels;
+	r->quality = quality;
+	r->buf_stride = (taps - 1 + RS_BLOCK_FRAMES + 15) & ~(size_t) 15;
+
+	const size_t coef_size = (size_t) up * taps * sizeof(float);
+	const size_t buf_size = channels * r->buf_stride * sizeof(float);
+
+	r->mem = aligned_alloc(64, coef_size + buf_size);
+	if (!r->mem)
+	{
+		free(r);
+		return NULL;
+	}
+
+	r->coefs = r->mem;
+	r->buf = (float *) ((uint8_t *) r->mem + coef_size);
+
+	// Prototype lowpass at in_rate * up, `taps * up` long, with gain
+	// `up` to make up for the zeros stuffed between input frames
+	const size_t len = (size_t) taps * up;
+	const double lower = (in_rate < out_rate) ? in_rate : out_rate;
+	const double fc = rs_params[quality].rolloff * lower / 2.0 / ((double) in_rate * up);
+	const double centre = (len - 1) / 2.0;
+	const double beta = rs_params[quality].beta;
+	const double i0_beta = rs_bessel_i0(beta);
+
+	for (int phase = 0; phase < up; phase++)
+	{
+		for (int k = 0; k < taps; k++)
+		{
+			double j = phase + (double) k * up;
+			double t = j - centre;
+			double sinc = (t == 0.0) ? 1.0 : sin(2.0 * M_PI * fc * t) / (2.0 * M_PI * fc * t);
+			double x = 2.0 * j / (len - 1) - 1.0;
+			double w = rs_bessel_i0(beta * sqrt(fmax(0.0, 1.0 - x * x))) / i0_beta;
+
+			// Reversed, so an output is a dot product with the input
+			// frames in order
+			r->coefs[(size_t) phase * taps + taps - 1 - k] = 2.0 * fc * sinc * w * up;
+		}
+	}
+
+	rs_reset(r);
+	return r;
+}
+
+void
+rs_free(Resampler *r)
+{
+	if (!r) { return; }
+
+	free(r->mem);
+	free(r);
+}
+
+void
+rs_reset(Resampler *r)
+{
+	memset(r->buf, 0, r->channels * r->buf_stride * sizeof(float));
+	r->buf_frames = r->taps - 1;
+	r->pos = 0;
+	r->phase = 0;
+	r->flush_left = r->taps / 2;
+}
+
+// Drops what no output will look at again, making room to top up
+static void
+rs_compact(Resampler *r)
+{
+	size_t drop = (r->pos < r->buf_frames) ? r->pos : r->buf_frames;
+	if (drop == 0) { return; }
+
+	for (int c = 0; c < r->channels; c++)
+	{
+		float *b = r->buf + c * r->buf_stride;
+		memmove(b, b + drop, (r->buf_frames - drop) * sizeof(float));
+	}
+	r->buf_frames -= drop;
+	r->pos -= drop;
+}
+
+static inline float
+rs_dot(const float *h, const float *x, int taps)
+{
+	bq_v8f a = { 0 }, b = { 0 };
+
+	for (int k = 0; k < taps; k += 16)
+	{
+		bq_v8f h0, h1, x0, x1;
+		memcpy(&h0, h + k, sizeof(h0));
+		memcpy(&h1, h + k + 8, sizeof(h1));
+		memcpy(&x0, x + k, sizeof(x0));
+		memcpy(&x1, x + k + 8, sizeof(x1));
+		a += h0 * x0;
+		b += h1 * x1;
+	}
+
+	a += b;
+	return ((a[0] + a[4]) + (a[1] + a[5])) + ((a[2] + a[6]) + (a[3] + a[7]));
+}
+
+size_t
+rs_process(
+		Resampler *r,
+		const float *in,
+		size_t in_frames,
+		size_t *used,
+		float *out,
+		size_t out_frames)
+{
+	const int channels = r->channels;
+	const int taps = r->taps;
+	size_t n = 0;
+
+	*used = 0;
+
+	for (;;)
+	{
+		while (n < out_frames && r->pos + taps <= r->buf_frames)
+		{
+			const float *h = r->coefs + (size_t) r->phase * taps;
+
+			for (int c = 0; c < channels; c++)
+			{
+				out[n * channels + c] = rs_dot(h, r->buf + c * r->buf_stride + r->pos, taps);
+			}
+			n++;
+
+			r->phase += r->down;
+			r->pos += r->phase / r->up;
+			r->phase %= r->up;
+		}
+
+		if (n == out_frames || *used == in_frames) { break; }
+
+		rs_compact(r);
+
+		size_t take = r->buf_stride - r->buf_frames;
+		if (take > in_frames - *used) { take = in_frames - *used; }
+
+		const float *src = in + *used * channels;
+		for (int c = 0; c < channels; c++)
+		{
+			float *b = r->buf + c * r->buf_stride + r->buf_frames;
+			for (size_t i = 0; i < take; i++) { b[i] = src[i * channels + c]; }
+		}
+		r->buf_frames += take;
+		*used += take;
+	}
+
+	return n;
+}
+
+size_t
+rs_flush(
+		Resampler *r,
+		float *out,
+		size_t out_frames)
+{
+	size_t n = 0;
+
+	for (;;)
+	{
+		size_t used;
+		n += rs_process(r, NULL, 0, &used, out + n * r->channels, out_frames - n);
+
+		if (n == out_frames || r->flush_left == 0) { break; }
+
+		rs_compact(r);
+
+		size_t take = r->buf_stride - r->buf_frames;
+		if (take > r->flush_left) { take = r->flush_left; }
+
+		for (int c = 0; c < r->channels; c++)
+		{
+			memset(r->buf + c * r->buf_stride + r->buf_frames, 0, take * sizeof(float));
+		}
+		r->buf_frames += take;
+		r->flush_left -= take;
+	}
+
+	return n;
+}
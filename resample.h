@@ -0,0 +1,93 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Input frames buffered per channel between calls, past the history
+#define RS_BLOCK_FRAMES 1024
+// Rate pairs whose reduced ratio needs more phases than this are
+// rejected; every pair of the usual 8 to 192 kHz rates fits
+#define RS_MAX_PHASES 4096
+
+enum ResampleQuality
+{
+	RS_FAST = 0, // 16 taps per phase
+	RS_GOOD,     // 32
+	RS_BEST,     // 64
+};
+
+// Polyphase windowed-sinc resampler from in_rate to out_rate.
+//
+// With the ratio reduced to up / down, output n sits at input time
+// n * down / up. Its phase, (n * down) mod up, picks one of `up` short
+// filters cut from one long Kaiser-windowed sinc, and the output is
+// that filter's dot product with the last `taps` input frames. The
+// phases are stored reversed and padded to whole vectors, so each
+// output is a few aligned vector multiply-adds per channel; inputs are
+// kept deinterleaved for the same reason.
+typedef struct
+{
+	int in_rate, out_rate;
+	int up, down;
+	int taps;
+	int channels;
+	enum ResampleQuality quality;
+
+	float *coefs; // [up][taps]
+
+	// Per channel: taps - 1 frames of history, then new input
+	float *buf;
+	size_t buf_stride;
+	size_t buf_frames; // frames in each channel's buffer
+	size_t pos;        // first input frame under the next output
+	int phase;
+	size_t flush_left; // silent frames rs_flush() has still to append
+
+	void *mem;
+} Resampler;
+
+// NULL if the rates are out of range or out of memory
+Resampler *
+rs_new(
+		int in_rate,
+		int out_rate,
+		int channels,
+		enum ResampleQuality quality);
+
+void rs_free(Resampler *r);
+
+// Back to silence, as on a seek
+void rs_reset(Resampler *r);
+
+// At most this many input frames are taken to make `out_frames` frames
+static inline size_t
+rs_input_for(const Resampler *r, size_t out_frames)
+{
+	return (out_frames * r->down + r->phase) / r->up + 1;
+}
+
+// Resamples interleaved frames: takes up to `in_frames` frames from
+// `in` and writes up to `out_frames` frames to `out`. Returns the
+// frames written; *used gets the frames taken, which the resampler
+// keeps until they are needed. Never allocates.
+size_t
+rs_process(
+		Resampler *r,
+		const float *in,
+		size_t in_frames,
+		size_t *used,
+		float *out,
+		size_t out_frames);
+
+// At the end of the input: the last taps / 2 frames only reach the
+// output once silence follows them. Appends that silence and writes up
+// to `out_frames` of the frames it releases to `out`; returns how many,
+// 0 once everything is out. rs_reset() starts over.
+size_t
+rs_flush(
+		Resampler *r,
+		float *out,
+		size_t out_frames);
+
+#endif
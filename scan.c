@@ -0,0 +1,372 @@
+#include "scan.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCAN_BLOCK_SIZE (64 * 1024)
+
+static void *
+scan_alloc(ScanWorker *w, size_t size)
+{
+	size = (size + 7) & ~(size_t) 7;
+
+	if (!w->arena || w->arena->used + size > SCAN_BLOCK_SIZE)
+	{
+		size_t cap = (size > SCAN_BLOCK_SIZE) ? size : SCAN_BLOCK_SIZE;
+		ScanBlock *b = malloc(sizeof(ScanBlock) + cap);
+		if (!b) { return NULL; }
+
+		b->next = w->arena;
+		b->used = 0;
+		w->arena = b;
+	}
+
+	void *p = w->arena->data + w->arena->used;
+	w->arena->used += size;
+	return p;
+}
+
+static int
+scan_push(ScanDeque *q, char *dir)
+{
+	pthread_mutex_lock(&q->lock);
+
+	if (q->head == q->tail) { q->head = q->tail = 0; }
+
+	if (q->tail == q->cap)
+	{
+		size_t cap = q->cap ? q->cap * 2 : 64;
+		char **dirs = realloc(q->dirs, cap * sizeof(char *));
+		if (!dirs)
+		{
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		q->dirs = dirs;
+		q->cap = cap;
+	}
+
+	q->dirs[q->tail++] = dir;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+// The owner works depth first from the tail; thieves take the oldest,
+// usually largest, subtrees from the head
+static char *
+scan_pop(ScanDeque *q, int steal)
+{
+	char *dir = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+	{
+		dir = steal ? q->dirs[q->head++] : q->dirs[--q->tail];
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return dir;
+}
+
+// Wakes one parked worker for new work, or all of them once the walk
+// is over. Parked workers only sleep while work_gen stays put, and
+// announce themselves in `idle` before checking it, so the lock is
+// only taken when somebody is actually waiting.
+static void
+scan_wake(Scanner *sc, int all)
+{
+	atomic_fetch_add(&sc->work_gen, 1);
+	if (atomic_load(&sc->idle) == 0) { return; }
+
+	pthread_mutex_lock(&sc->idle_lock);
+	if (all) { pthread_cond_broadcast(&sc->idle_cond); }
+	else { pthread_cond_signal(&sc->idle_cond); }
+	pthread_mutex_unlock(&sc->idle_lock);
+}
+
+static inline void
+scan_signal(Scanner *sc)
+{
+	uint64_t one = 1;
+	write(sc->event_fd, &one, sizeof(one));
+}
+
+static void
+scan_dir(ScanWorker *w, const char *rel)
+{
+	Scanner *sc = w->sc;
+	int fd = openat(sc->root_fd, rel[0] ? rel : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) { return; }
+
+	DIR *dir = fdopendir(fd);
+	if (!dir)
+	{
+		close(fd);
+		return;
+	}
+
+	// Collected newest first, then spliced onto the results in one go
+	ScanEntry *first = NULL, *last = NULL;
+	size_t files = 0, wavs = 0;
+	size_t rel_len = strlen(rel);
+	struct dirent *entry;
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.') { continue; }
+
+		unsigned char type = entry->d_type;
+
+		// Only pay for a stat when the file system does not say.
+		// Links are followed to files but never into directories,
+		// so a link loop cannot trap the walk.
+		if (type == DT_UNKNOWN || type == DT_LNK)
+		{
+			struct stat st;
+			if (fstatat(fd, entry->d_name, &st, 0) != 0) { continue; }
+
+			if (S_ISREG(st.st_mode)) { type = DT_REG; }
+			else if (S_ISDIR(st.st_mode) && type == DT_UNKNOWN) { type = DT_DIR; }
+			else { continue; }
+		}
+
+		if (type != DT_DIR && type != DT_REG) { continue; }
+
+		size_t name_len = strlen(entry->d_name);
+		size_t len = rel_len + (rel_len > 0) + name_len;
+
+		if (type == DT_DIR)
+		{
+			char *path = scan_alloc(w, len + 1);
+			if (!path) { continue; }
+
+			snprintf(path, len + 1, "%s%s%s", rel, rel_len ? "/" : "", entry->d_name);
+
+			atomic_fetch_add(&sc->pending, 1);
+			if (scan_push(&w->queue, path) != 0)
+			{
+				atomic_fetch_sub(&sc->pending, 1);
+			}
+			else
+			{
+				scan_wake(sc, 0);
+			}
+			continue;
+		}
+
+		ScanEntry *e = scan_alloc(w, sizeof(ScanEntry) + len + 1);
+		if (!e) { continue; }
+
+		memset(e, 0, sizeof(*e));
+		snprintf(e->path, len + 1, "%s%s%s", rel, rel_len ? "/" : "", entry->d_name);
+
+		const char *ext = strrchr(entry->d_name, '.');
+		e->is_wav = ext && strcmp(ext, ".wav") == 0;
+
+		if (sc->hook) { sc->hook(sc->hook_ctx, fd, entry->d_name, e); }
+
+		e->next = first;
+		first = e;
+		if (!last) { last = e; }
+
+		files++;
+		wavs += e->is_wav;
+	}
+
+	closedir(dir);
+
+	if (!first) { return; }
+
+	ScanEntry *head = atomic_load_explicit(&sc->results, memory_order_relaxed);
+	do {
+		last->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&sc->results, &head, first,
+				memory_order_release, memory_order_relaxed));
+
+	atomic_fetch_add_explicit(&sc->num_files, files, memory_order_relaxed);
+	atomic_fetch_add_explicit(&sc->num_wav, wavs, memory_order_relaxed);
+	scan_signal(sc);
+}
+
+static void *
+scan_worker(ScanWorker *w)
+{
+	Scanner *sc = w->sc;
+	int me = w - sc->workers;
+
+	while (!atomic_load_explicit(&sc->quit, memory_order_relaxed))
+	{
+		unsigned int gen = atomic_load(&sc->work_gen);
+		char *dir = scan_pop(&w->queue, 0);
+
+		for (int i = 1; !dir && i < sc->num_workers; i++)
+		{
+			dir = scan_pop(&sc->workers[(me + i) % sc->num_workers].queue, 1);
+		}
+
+		if (!dir)
+		{
+			if (atomic_load(&sc->pending) == 0) { break; }
+
+			// Somebody is still reading a directory that may hand
+			// out more work: sleep until something is pushed (or
+			// was, since the pops above) or the walk ends
+			pthread_mutex_lock(&sc->idle_lock);
+			atomic_fetch_add(&sc->idle, 1);
+
+			while (atomic_load(&sc->work_gen) == gen &&
+				atomic_load(&sc->pending) != 0 &&
+				!atomic_load(&sc->quit))
+			{
+				pthread_cond_wait(&sc->idle_cond, &sc->idle_lock);
+			}
+
+			atomic_fetch_sub(&sc->idle, 1);
+			pthread_mutex_unlock(&sc->idle_lock);
+			continue;
+		}
+
+		scan_dir(w, dir);
+
+		if (atomic_fetch_sub(&sc->pending, 1) == 1)
+		{
+			scan_wake(sc, 1);
+			scan_signal(sc);
+		}
+	}
+
+	return NULL;
+}
+
+Scanner *
+scan_start(
+		const char *root,
+		int threads,
+		ScanHook hook,
+		void *hook_ctx)
+{
+	Scanner *sc = calloc(1, sizeof(Scanner));
+	if (!sc) { return NULL; }
+
+	sc->hook = hook;
+	sc->hook_ctx = hook_ctx;
+
+	sc->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	sc->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (sc->root_fd < 0 || sc->event_fd < 0)
+	{
+		perror(root);
+		if (sc->root_fd >= 0) { close(sc->root_fd); }
+		if (sc->event_fd >= 0) { close(sc->event_fd); }
+		free(sc);
+		return NULL;
+	}
+
+	if (threads <= 0) { threads = sysconf(_SC_NPROCESSORS_ONLN); }
+	if (threads <= 0) { threads = 1; }
+	if (threads > SCAN_MAX_THREADS) { threads = SCAN_MAX_THREADS; }
+
+	atomic_init(&sc->pending, 1);
+	atomic_init(&sc->quit, 0);
+	atomic_init(&sc->work_gen, 0);
+	atomic_init(&sc->idle, 0);
+	pthread_mutex_init(&sc->idle_lock, NULL);
+	pthread_cond_init(&sc->idle_cond, NULL);
+	atomic_init(&sc->results, NULL);
+	atomic_init(&sc->num_files, 0);
+	atomic_init(&sc->num_wav, 0);
+
+	for (int i = 0; i < threads; i++)
+	{
+		sc->workers[i].sc = sc;
+		pthread_mutex_init(&sc->workers[i].queue.lock, NULL);
+	}
+	sc->num_workers = threads;
+
+	static char root_dir[] = "";
+	scan_push(&sc->workers[0].queue, root_dir);
+
+	for (int i = 0; i < threads; i++)
+	{
+		if (pthread_create(&sc->workers[i].thread, NULL,
+					(void *(*)(void *)) scan_worker, &sc->workers[i]) != 0)
+		{
+			// The ones already running steal the rest
+			sc->num_workers = i;
+			break;
+		}
+	}
+
+	if (sc->num_workers == 0)
+	{
+		fprintf(stderr, "Failed to create a thread.\n");
+		scan_close(sc);
+		return NULL;
+	}
+
+	return sc;
+}
+
+ScanEntry *
+scan_take(Scanner *sc)
+{
+	ScanEntry *e = atomic_exchange_explicit(&sc->results, NULL, memory_order_acquire);
+	ScanEntry *prev = NULL;
+
+	while (e)
+	{
+		ScanEntry *next = e->next;
+		e->next = prev;
+		prev = e;
+		e = next;
+	}
+
+	return prev;
+}
+
+int
+scan_done(Scanner *sc)
+{
+	return atomic_load(&sc->pending) == 0;
+}
+
+void
+scan_close(Scanner *sc)
+{
+	if (!sc) { return; }
+
+	atomic_store(&sc->quit, 1);
+	scan_wake(sc, 1);
+
+	for (int i = 0; i < sc->num_workers; i++)
+	{
+		pthread_join(sc->workers[i].thread, NULL);
+	}
+
+	for (int i = 0; i < SCAN_MAX_THREADS; i++)
+	{
+		ScanWorker *w = &sc->workers[i];
+
+		while (w->arena)
+		{
+			ScanBlock *next = w->arena->next;
+			free(w->arena);
+			w->arena = next;
+		}
+
+		free(w->queue.dirs);
+		if (w->sc) { pthread_mutex_destroy(&w->queue.lock); }
+	}
+
+	pthread_mutex_destroy(&sc->idle_lock);
+	pthread_cond_destroy(&sc->idle_cond);
+	close(sc->root_fd);
+	close(sc->event_fd);
+	free(sc);
+}
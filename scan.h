@@ -0,0 +1,109 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_MAX_THREADS 8
+
+// One regular file found by the scanner. Entries live in the scanner's
+// arenas and stay valid until scan_close().
+typedef struct ScanEntry
+{
+	struct ScanEntry *next;
+
+	// Left at 0 unless a ScanHook fills them in
+	int64_t mtime_ns;
+	uint64_t size;
+	uint64_t frames;
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t bps;
+	uint8_t probed; // the hook had to read the file itself
+
+	uint8_t is_wav;
+	char path[]; // relative to the scan root
+} ScanEntry;
+
+// Called on a worker thread for every file found, with the file's
+// directory open as `dir_fd`, before the entry is handed out
+typedef void (*ScanHook)(void *ctx, int dir_fd, const char *name, ScanEntry *e);
+
+// Bump allocator, one per worker so allocation takes no lock
+typedef struct ScanBlock
+{
+	struct ScanBlock *next;
+	size_t used;
+	char data[];
+} ScanBlock;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	char **dirs; // [head, tail) are waiting
+	size_t head, tail, cap;
+} ScanDeque;
+
+typedef struct Scanner Scanner;
+
+typedef struct
+{
+	Scanner *sc;
+	ScanDeque queue;
+	ScanBlock *arena;
+	pthread_t thread;
+} ScanWorker;
+
+// Parallel directory walk. Each worker takes directories from the tail
+// of its own deque and, when that runs dry, steals from the head of
+// another's. Files come back through a lock-free list, so the prompt
+// can show them while the walk goes on.
+struct Scanner
+{
+	int root_fd;
+	int event_fd; // eventfd, readable when new entries or the end arrive
+	ScanHook hook;
+	void *hook_ctx;
+
+	ScanWorker workers[SCAN_MAX_THREADS];
+	int num_workers;
+
+	// Directories queued or being read; the walk is over at 0
+	atomic_size_t pending;
+	atomic_int quit;
+
+	// Workers with nothing to steal park on idle_cond until work_gen
+	// moves, which every push, the end of the walk and quit do
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	atomic_uint work_gen;
+	atomic_int idle;
+
+	// Newest first; scan_take() hands them out oldest first
+	_Atomic(ScanEntry *) results;
+	atomic_size_t num_files;
+	atomic_size_t num_wav;
+};
+
+// Starts walking `root` on up to `threads` workers (0: one per CPU).
+// `hook` may be NULL. NULL on failure.
+Scanner *
+scan_start(
+		const char *root,
+		int threads,
+		ScanHook hook,
+		void *hook_ctx);
+
+// Entries found since the last call, in discovery order, or NULL
+ScanEntry *scan_take(Scanner *sc);
+
+// 1 once every directory has been read; check after draining event_fd
+// and before the final scan_take()
+int scan_done(Scanner *sc);
+
+// Stops the walk and frees every entry it returned
+void scan_close(Scanner *sc);
+
+#endif
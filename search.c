@@ -0,0 +1,264 @@
+#define _GNU_SOURCE // memrchr
+
+#include "search.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SEARCH_NO_MATCH INT32_MIN
+
+static inline unsigned char
+search_lower(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Letters and digits get a bit each, everything else shares the rest
+static inline uint64_t
+search_bit(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z') { return 1ull << (c - 'a'); }
+	if (c >= '0' && c <= '9') { return 1ull << (26 + c - '0'); }
+	return 1ull << (36 + c % 28);
+}
+
+static inline int
+search_boundary(unsigned char c)
+{
+	return c == '/' || c == ' ' || c == '_' || c == '-' || c == '.';
+}
+
+// Matches the query right to left, taking the last possible place for
+// each character, so a hit in the file name beats one in the leading
+// directories. Consecutive characters, starts of words and the file
+// name earn points, gaps and long names cost some.
+static int32_t
+search_score(const char *key, size_t len, const char *query, size_t query_len)
+{
+	const char *slash = memrchr(key, '/', len);
+	size_t name_start = slash ? (size_t) (slash - key) + 1 : 0;
+	size_t k = len, prev = len;
+	int32_t score = -(int32_t) (len / 16);
+
+	for (size_t i = query_len; i-- > 0;)
+	{
+		while (k > 0 && key[k - 1] != query[i]) { k--; }
+		if (k == 0) { return SEARCH_NO_MATCH; }
+		k--;
+
+		score += 16;
+
+		if (k + 1 == prev) { score += 16; }
+		else if (prev < len) { score -= (prev - k - 1 < 16) ? prev - k - 1 : 16; }
+
+		if (k == 0 || search_boundary(key[k - 1])) { score += 12; }
+		if (k >= name_start) { score += 4; }
+
+		prev = k;
+	}
+
+	return score;
+}
+
+static int
+search_grow(void **p, size_t cap, size_t size)
+{
+	void *grown = realloc(*p, cap * size);
+	if (!grown) { return -1; }
+
+	*p = grown;
+	return 0;
+}
+
+void
+search_init(SearchIndex *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+void
+search_free(SearchIndex *s)
+{
+	free(s->names);
+	free(s->masks);
+	free(s->key_offsets);
+	free(s->key_lengths);
+	free(s->keys);
+	free(s->hits);
+	free(s->scores);
+	memset(s, 0, sizeof(*s));
+}
+
+void
+search_clear(SearchIndex *s)
+{
+	s->count = 0;
+	s->keys_size = 0;
+	s->query[0] = '\0';
+	s->query_len = 0;
+	s->num_hits = 0;
+	s->searched = 0;
+	s->num_top = 0;
+}
+
+int
+search_add(SearchIndex *s, const char *name)
+{
+	size_t len = strlen(name);
+	if (len > UINT16_MAX) { len = UINT16_MAX; }
+
+	if (s->count == s->cap)
+	{
+		size_t cap = s->cap ? s->cap * 2 : 1024;
+
+		// Each array keeps the old contents if a later one fails
+		if (search_grow((void **) &s->names, cap, sizeof(*s->names)) != 0 ||
+			search_grow((void **) &s->masks, cap, sizeof(*s->masks)) != 0 ||
+			search_grow((void **) &s->key_offsets, cap, sizeof(*s->key_offsets)) != 0 ||
+			search_grow((void **) &s->key_lengths, cap, sizeof(*s->key_lengths)) != 0 ||
+			search_grow((void **) &s->hits, cap, sizeof(*s->hits)) != 0 ||
+			search_grow((void **) &s->scores, cap, sizeof(*s->scores)) != 0)
+		{
+			return -1;
+		}
+		s->cap = cap;
+	}
+
+	if (s->keys_size + len > s->keys_cap)
+	{
+		size_t cap = s->keys_cap ? s->keys_cap * 2 : 64 * 1024;
+		while (cap < s->keys_size + len) { cap *= 2; }
+
+		if (search_grow((void **) &s->keys, cap, 1) != 0) { return -1; }
+		s->keys_cap = cap;
+	}
+
+	// Offsets are 32-bit; past 4 GiB of names the rest go unindexed
+	if (s->keys_size + len > UINT32_MAX) { return -1; }
+
+	char *key = s->keys + s->keys_size;
+	uint64_t mask = 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		key[i] = search_lower(name[i]);
+		mask |= search_bit(key[i]);
+	}
+
+	s->names[s->count] = name;
+	s->masks[s->count] = mask;
+	s->key_offsets[s->count] = s->keys_size;
+	s->key_lengths[s->count] = len;
+	s->keys_size += len;
+	s->count++;
+
+	return 0;
+}
+
+// Scores hits [from, num_hits) and drops the ones that do not match
+static void
+search_filter(SearchIndex *s, size_t from, uint64_t mask)
+{
+	size_t n = from;
+
+	for (size_t i = from; i < s->num_hits; i++)
+	{
+		uint32_t h = s->hits[i];
+		if ((s->masks[h] & mask) != mask) { continue; }
+
+		int32_t score = search_score(s->keys + s->key_offsets[h], s->key_lengths[h],
+				s->query, s->query_len);
+		if (score == SEARCH_NO_MATCH) { continue; }
+
+		s->hits[n] = h;
+		s->scores[n] = score;
+		n++;
+	}
+
+	s->num_hits = n;
+}
+
+size_t
+search_run(SearchIndex *s, const char *query)
+{
+	char q[SEARCH_MAX_QUERY + 1];
+	size_t q_len = 0;
+	uint64_t mask = 0;
+
+	for (const char *p = query; *p && q_len < SEARCH_MAX_QUERY; p++)
+	{
+		if (*p == ' ') { continue; }
+
+		q[q_len] = search_lower(*p);
+		mask |= search_bit(q[q_len]);
+		q_len++;
+	}
+	q[q_len] = '\0';
+
+	int same = q_len == s->query_len && memcmp(q, s->query, q_len) == 0;
+	if (same && s->searched == s->count) { return s->num_hits; }
+
+	// Every match of the new query also matches any prefix of it, so
+	// a longer query only needs to look at the last hits
+	int refine = s->query_len > 0 &&
+			q_len >= s->query_len &&
+			memcmp(q, s->query, s->query_len) == 0;
+
+	memcpy(s->query, q, q_len + 1);
+	s->query_len = q_len;
+
+	if (q_len == 0)
+	{
+		s->num_hits = 0;
+		s->num_top = 0;
+		s->searched = s->count;
+		return 0;
+	}
+
+	if (!refine)
+	{
+		s->num_hits = 0;
+		s->searched = 0;
+	}
+	else if (!same)
+	{
+		search_filter(s, 0, mask);
+	}
+
+	// Names added since the last search: mask test first, without a
+	// branch so the loop stays vectorized, then score the survivors
+	size_t from = s->num_hits;
+	size_t n = from;
+
+	for (size_t i = s->searched; i < s->count; i++)
+	{
+		s->hits[n] = i;
+		n += (s->masks[i] & mask) == mask;
+	}
+	s->num_hits = n;
+	s->searched = s->count;
+
+	search_filter(s, from, mask);
+
+	// Keep the best few in order; ties go to the name found first
+	s->num_top = 0;
+
+	for (size_t i = 0; i < s->num_hits; i++)
+	{
+		int32_t score = s->scores[i];
+		size_t pos = s->num_top;
+
+		if (pos == SEARCH_TOP && score <= s->top_score[SEARCH_TOP - 1]) { continue; }
+
+		while (pos > 0 && score > s->top_score[pos - 1]) { pos--; }
+
+		size_t last = (s->num_top < SEARCH_TOP) ? s->num_top++ : SEARCH_TOP - 1;
+		memmove(&s->top[pos + 1], &s->top[pos], (last - pos) * sizeof(s->top[0]));
+		memmove(&s->top_score[pos + 1], &s->top_score[pos], (last - pos) * sizeof(s->top_score[0]));
+
+		s->top[pos] = s->hits[i];
+		s->top_score[pos] = score;
+	}
+
+	return s->num_hits;
+}
@@ -0,0 +1,67 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEARCH_MAX_QUERY 255
+// Best matches kept in rank order after each search
+#define SEARCH_TOP 8
+
+// Fuzzy finder over the file list. Each name gets a lowercased key,
+// packed back to back in one buffer, and a 64-bit mask of the
+// characters it contains. A keystroke first tests the query's mask
+// against the dense mask array, which the compiler turns into a few
+// vector compares per cache line, and only scores the names that pass.
+//
+// The hits of the last query are kept: when the new query extends it,
+// only those (and names added since) are looked at again.
+typedef struct
+{
+	// Per name
+	const char **names; // borrowed, must outlive the index
+	uint64_t *masks;
+	uint32_t *key_offsets;
+	uint16_t *key_lengths;
+	size_t count;
+	size_t cap;
+
+	char *keys;
+	size_t keys_size;
+	size_t keys_cap;
+
+	// Last query and every name that matched it, in the order added
+	char query[SEARCH_MAX_QUERY + 1];
+	size_t query_len;
+	uint32_t *hits;
+	int32_t *scores;
+	size_t num_hits;
+	size_t searched; // names [0, searched) were tested against query
+
+	// Best of the hits, highest score first
+	uint32_t top[SEARCH_TOP];
+	int32_t top_score[SEARCH_TOP];
+	size_t num_top;
+} SearchIndex;
+
+void search_init(SearchIndex *s);
+
+void search_free(SearchIndex *s);
+
+// Drops every name but keeps the buffers
+void search_clear(SearchIndex *s);
+
+// Returns -1 if out of memory
+int search_add(SearchIndex *s, const char *name);
+
+// Brings hits and top up to date for `query`; cheap when nothing
+// changed. Case-insensitive, spaces are ignored. Returns num_hits.
+size_t search_run(SearchIndex *s, const char *query);
+
+static inline const char *
+search_top(const SearchIndex *s, size_t rank)
+{
+	return (rank < s->num_top) ? s->names[s->top[rank]] : NULL;
+}
+
+#endif
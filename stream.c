@@ -0,0 +1,269 @@
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Largest single pread(); small enough to notice a seek quickly
+#define ST_READ_BLOCK (256 * 1024)
+// A failing read is tried this many more times, this far apart,
+// before the data is reported as unreadable
+#define ST_READ_RETRIES 5
+#define ST_RETRY_MS 20
+
+// Absolute CLOCK_REALTIME deadline `ms` from now, for sem_timedwait()
+static struct timespec
+st_deadline(int ms)
+{
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += ms / 1000;
+	until.tv_nsec += (ms % 1000) * 1000000L;
+	if (until.tv_nsec >= 1000000000L)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	return until;
+}
+
+static void *
+st_reader(Stream *st)
+{
+	unsigned int gen = atomic_load(&st->seek_ack);
+	int errors = 0;
+
+	while (!atomic_load_explicit(&st->quit, memory_order_relaxed))
+	{
+		unsigned int want = atomic_load_explicit(&st->seek_gen, memory_order_acquire);
+		if (want != gen)
+		{
+			size_t pos = atomic_load_explicit(&st->seek_pos, memory_order_relaxed);
+			atomic_store_explicit(&st->tail, pos, memory_order_relaxed);
+			atomic_store_explicit(&st->head, pos, memory_order_relaxed);
+			atomic_store_explicit(&st->failed, 0, memory_order_relaxed);
+			errors = 0;
+			gen = want;
+			atomic_store_explicit(&st->seek_ack, gen, memory_order_release);
+			sem_post(&st->data);
+		}
+
+		size_t head = atomic_load_explicit(&st->head, memory_order_relaxed);
+		size_t tail = atomic_load_explicit(&st->tail, memory_order_acquire);
+		size_t space = st->ring_size - (head - tail);
+		size_t end = atomic_load_explicit(&st->data_end, memory_order_relaxed);
+		size_t left = (head < end) ? end - head : 0;
+
+		// Ring full, file done or unreadable here: sleep until the
+		// audio thread frees space or asks for a seek
+		if (left == 0 || space < st->frame_size ||
+			atomic_load_explicit(&st->failed, memory_order_relaxed))
+		{
+			struct timespec until = st_deadline(50);
+			sem_timedwait(&st->space, &until);
+			continue;
+		}
+
+		size_t at = head % st->ring_size;
+		size_t n = st->ring_size - at; // up to the end of the ring
+		if (n > space) { n = space; }
+		if (n > left) { n = left; }
+		if (n > ST_READ_BLOCK) { n = ST_READ_BLOCK; }
+
+		ssize_t got = pread(st->fd, st->ring + at, n, st->data_offset + head);
+		int err = errno;
+
+		// A seek came in while reading; this data, or its failure, is
+		// for the old spot
+		if (atomic_load_explicit(&st->seek_gen, memory_order_acquire) != gen)
+			continue;
+
+		if (got < 0)
+		{
+			if (err == EINTR) { continue; }
+
+			// Worth another go (EIO or EAGAIN from a network or failing
+			// disk may pass); a seek or quit cuts the wait short, but
+			// space freed earlier must not
+			if (++errors <= ST_READ_RETRIES)
+			{
+				while (sem_trywait(&st->space) == 0) {}
+
+				struct timespec until = st_deadline(ST_RETRY_MS);
+				if (atomic_load_explicit(&st->seek_gen, memory_order_acquire) == gen)
+					sem_timedwait(&st->space, &until);
+				continue;
+			}
+
+			// Still failing: the audio thread ends the track at the
+			// last frame read, and a seek tries again
+			errors = 0;
+			atomic_store_explicit(&st->failed, 1, memory_order_release);
+			sem_post(&st->data);
+			continue;
+		}
+
+		errors = 0;
+
+		// File shorter than its header says: the data ends here. The
+		// thread stays up to answer seeks.
+		if (got == 0)
+		{
+			atomic_store_explicit(&st->data_end, head - head % st->frame_size,
+					memory_order_release);
+			sem_post(&st->data);
+			continue;
+		}
+
+		atomic_store_explicit(&st->head, head + got, memory_order_release);
+		sem_post(&st->data);
+	}
+
+	return NULL;
+}
+
+Stream *
+st_open(
+		const char *path,
+		off_t data_offset,
+		size_t data_size,
+		size_t frame_size,
+		size_t readahead)
+{
+	Stream *st = calloc(1, sizeof(*st));
+	if (!st) { return NULL; }
+
+	st->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (st->fd < 0)
+	{
+		fprintf(stderr, "Failed to open %s for streaming.\n\r", path);
+		free(st);
+		return NULL;
+	}
+
+	// Sequential hint for the kernel's own read-ahead
+	posix_fadvise(st->fd, data_offset, data_size, POSIX_FADV_SEQUENTIAL);
+
+	st->data_offset = data_offset;
+	st->data_size = data_size - data_size % frame_size;
+	st->frame_size = frame_size;
+
+	// Whole frames only, so the ring never wraps inside a frame
+	if (readahead < ST_READ_BLOCK) { readahead = ST_READ_BLOCK; }
+	st->ring_size = readahead - readahead % frame_size;
+	st->ring = malloc(st->ring_size);
+
+	atomic_init(&st->data_end, st->data_size);
+	atomic_init(&st->head, 0);
+	atomic_init(&st->tail, 0);
+	atomic_init(&st->seek_pos, 0);
+	atomic_init(&st->seek_gen, 0);
+	atomic_init(&st->seek_ack, 0);
+	atomic_init(&st->failed, 0);
+	atomic_init(&st->quit, 0);
+	sem_init(&st->space, 0, 0);
+	sem_init(&st->data, 0, 0);
+
+	if (!st->ring ||
+		pthread_create(&st->thread, NULL, (void *(*)(void *)) st_reader, st) != 0)
+	{
+		close(st->fd);
+		free(st->ring);
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+void
+st_close(Stream *st)
+{
+	if (!st) { return; }
+
+	atomic_store(&st->quit, 1);
+	sem_post(&st->space);
+	pthread_join(st->thread, NULL);
+
+	sem_destroy(&st->space);
+	sem_destroy(&st->data);
+	close(st->fd);
+	free(st->ring);
+	free(st);
+}
+
+size_t
+st_acquire(
+		Stream *st,
+		size_t pos,
+		size_t frames,
+		const uint8_t **ptr,
+		int timeout_ms)
+{
+	size_t at = pos * st->frame_size;
+	size_t tail = atomic_load_explicit(&st->tail, memory_order_relaxed);
+	unsigned int gen = atomic_load_explicit(&st->seek_gen, memory_order_relaxed);
+
+	if (at != tail)
+	{
+		atomic_store_explicit(&st->seek_pos, at, memory_order_relaxed);
+		atomic_store_explicit(&st->seek_gen, ++gen, memory_order_release);
+		sem_post(&st->space);
+	}
+
+	struct timespec until = st_deadline(timeout_ms);
+
+	for (;;)
+	{
+		// Posts from reads already looked at only cost a pass each,
+		// but there is no need to go through them one by one
+		while (sem_trywait(&st->data) == 0) {}
+
+		if (atomic_load_explicit(&st->seek_ack, memory_order_acquire) == gen)
+		{
+			size_t head = atomic_load_explicit(&st->head, memory_order_acquire);
+			size_t have = (head - at) / st->frame_size;
+
+			if (have > 0)
+			{
+				size_t to_end = (st->ring_size - at % st->ring_size) / st->frame_size;
+
+				if (have > to_end) { have = to_end; }
+				if (have > frames) { have = frames; }
+
+				*ptr = st->ring + at % st->ring_size;
+				return have;
+			}
+
+			if (at >= atomic_load_explicit(&st->data_end, memory_order_acquire) ||
+				atomic_load_explicit(&st->failed, memory_order_acquire))
+			{
+				return ST_END;
+			}
+		}
+
+		// Posted by the reader after each read and seek
+		while (sem_timedwait(&st->data, &until) != 0)
+		{
+			if (errno != EINTR) { return 0; }
+		}
+	}
+}
+
+void
+st_release(
+		Stream *st,
+		size_t pos)
+{
+	size_t tail = pos * st->frame_size;
+	size_t head = atomic_load_explicit(&st->head, memory_order_relaxed);
+
+	atomic_store_explicit(&st->tail, tail, memory_order_release);
+
+	// Only wake the reader once it has a worthwhile amount to refill
+	if (head - tail <= st->ring_size / 2)
+		sem_post(&st->space);
+}
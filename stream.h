@@ -0,0 +1,86 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Streaming input: a reader thread pread()s the PCM data of one file
+// into a single-producer single-consumer ring, so the audio thread
+// only ever touches memory that is already resident. An alternative
+// to mmap for libraries on NFS or spinning disks.
+//
+// Positions are absolute byte offsets into the PCM data; the ring holds
+// [tail, head). Only the reader moves head and only the audio thread
+// moves tail, except while a seek is being served.
+typedef struct
+{
+	int fd;
+	off_t data_offset;
+	size_t data_size;
+	size_t frame_size;
+
+	// Where the data really ends: data_size, or less once the reader
+	// hit the end of a file shorter than its header says
+	atomic_size_t data_end;
+	// Set when reads at head keep failing, until the next seek
+	atomic_int failed;
+
+	uint8_t *ring;
+	size_t ring_size; // multiple of frame_size
+
+	atomic_size_t head;
+	atomic_size_t tail;
+
+	// Seek handshake: the audio thread bumps seek_gen after setting
+	// seek_pos, the reader acks by copying it into seek_ack
+	atomic_size_t seek_pos;
+	atomic_uint seek_gen;
+	atomic_uint seek_ack;
+
+	sem_t space; // posted when the audio thread frees ring space
+	sem_t data;  // posted when the reader moves head or answers a seek
+	atomic_int quit;
+	pthread_t thread;
+} Stream;
+
+#define ST_DEFAULT_READAHEAD (4 * 1024 * 1024)
+// st_acquire() at or past the end of the readable data
+#define ST_END ((size_t) -1)
+
+// Starts reading `data_size` bytes at `data_offset` of `path`, keeping
+// up to `readahead` bytes ahead of the audio thread. NULL on failure.
+Stream *
+st_open(
+		const char *path,
+		off_t data_offset,
+		size_t data_size,
+		size_t frame_size,
+		size_t readahead);
+
+void st_close(Stream *st);
+
+// Points *ptr at up to `frames` contiguous frames starting at frame
+// `pos` and returns how many are there. A `pos` other than the last
+// released one is a seek and restarts the reader there. Waits at most
+// `timeout_ms` for data; returns 0 on an underrun and ST_END once
+// `pos` is past the data that could be read, or reads there keep
+// failing.
+size_t
+st_acquire(
+		Stream *st,
+		size_t pos,
+		size_t frames,
+		const uint8_t **ptr,
+		int timeout_ms);
+
+// Frees everything before frame `pos` for the reader to refill.
+void
+st_release(
+		Stream *st,
+		size_t pos);
+
+#endif
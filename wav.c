@@ -0,0 +1,244 @@
+#include "wav.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "biquad.h"
+
+// The format code of a fmt chunk's `size` bytes of data, looking
+// through WAVE_FORMAT_EXTENSIBLE to its sub-format
+static uint16_t
+wav_format_tag(const uint8_t *fmt, uint32_t size)
+{
+	uint16_t tag;
+	memcpy(&tag, fmt, sizeof(tag));
+
+	if (tag == WAV_FORMAT_EXTENSIBLE && size >= 26)
+	{
+		memcpy(&tag, fmt + 24, sizeof(tag));
+	}
+	return tag;
+}
+
+int
+read_file(
+        char *file_path,
+        WAVHeader *header,
+        size_t *file_size,
+        char **file_buf,
+        int *offset,
+        int verbose)
+{
+    // Check if the file exists
+	{
+        int retval;
+		struct stat stat_buf;
+		if ((retval = stat(file_path, &stat_buf)) != 0) {
+			fprintf(stderr, "File not found, stat failed.\n\r");
+			return -2;
+		} 
+		*file_size = stat_buf.st_size;
+	}
+
+	int fd = open(file_path, O_RDONLY);
+	*file_buf = (char *) mmap(NULL, *file_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (*file_buf == MAP_FAILED) {
+		*file_buf = NULL;
+		fprintf(stderr, "Failed to map %s file.\n", file_path);
+        return -2;
+	}
+
+    *offset = 0;
+
+    // RIFF Chunk
+    memcpy((uint8_t *) &(header->chunk_id), *file_buf + *offset, 4);
+    *offset += 4;
+
+    memcpy((uint8_t *) &(header->chunk_size), *file_buf + *offset, 4);
+    *offset += 4;
+
+    memcpy((uint8_t *) &(header->format), *file_buf + *offset, 4);
+    *offset += 4;
+
+    // RIFF/WAVE container
+    if (strncmp(header->chunk_id, "RIFF", 4) != 0)
+    {
+        fprintf(stderr, "Not a valid RIFF/WAVE file.\n\r");
+        return -1;
+    }
+    // Validate file size with WAV header
+    if (strncmp(header->format, "WAVE", 4) != 0)
+    {
+        fprintf(stderr, "WAVE chunk is not found.\n\r");
+        return -1;
+    }
+
+	// Check file size
+	// Exclude extra 8 bytes from header
+	{
+		int file_size_valid = *file_size - 8 - header->chunk_size;
+		if (file_size_valid != 0) {
+			fprintf(stderr, "%s file size does not match with chunk size.\n", file_path);
+            return -1;
+		}
+	}
+
+    {
+        struct {
+            char id[4];
+            uint32_t size;
+        } chunk;
+        uint8_t found_fmt = 0;
+
+        // Added a limit to the offset in case
+        // of an invalid WAV header
+        while (*offset < 100)
+        {
+            memcpy((uint8_t *) &chunk, *file_buf + *offset, 8);
+            *offset += 8;
+            if (verbose) { printf("%.*s\n\r", 4, chunk.id); }
+
+            if (strncmp(chunk.id, "fmt ", 4) == 0)
+            {
+                const uint8_t *fmt = (uint8_t *) *file_buf + *offset;
+
+                memcpy(&(header->subchunk1_id), (uint8_t *) &chunk, 8);
+                memcpy(&(header->audio_format), fmt, 16);
+                header->audio_format = wav_format_tag(fmt, chunk.size);
+
+                // Float and extensible headers are longer than 16
+                *offset += (chunk.size < 16) ? 16 : chunk.size + (chunk.size & 1);
+                found_fmt = 1;
+            }
+            else if (strncmp(chunk.id, "data", 4) == 0)
+            {
+                memcpy(&(header->subchunk2_id), &chunk, 8);
+                // Reached the actual audio
+                break;
+            }
+            else
+            {
+                // Skip other subchunks, checks for padding
+                uint32_t bytes_to_skip = chunk.size;
+
+                if (bytes_to_skip % 2 != 0)
+                {
+                    bytes_to_skip += 1;
+                }
+
+                *offset += bytes_to_skip;
+            }
+
+            // TODO(daria): handle all types of chunks
+            // https://www.recordingblogs.com/wiki/wave-file-format
+        }
+
+        if (!found_fmt)
+        {
+            fprintf(stderr, "fmt subchunk is not found\n\r");
+            return -2;
+        }
+        
+        if (*offset > 100)
+        {
+            fprintf(stderr, "WAV Header is incomplete");
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+int
+wav_probe(int fd, WAVHeader *header)
+{
+	uint8_t buf[WAV_PROBE_SIZE];
+	ssize_t n = pread(fd, buf, sizeof(buf), 0);
+
+	if (n < 12 ||
+		memcmp(buf, "RIFF", 4) != 0 ||
+		memcmp(buf + 8, "WAVE", 4) != 0)
+	{
+		return -1;
+	}
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->chunk_id, buf, 12);
+
+	uint8_t found_fmt = 0;
+	size_t offset = 12;
+
+	while (offset + 8 <= (size_t) n)
+	{
+		char id[4];
+		uint32_t size;
+		memcpy(id, buf + offset, 4);
+		memcpy(&size, buf + offset + 4, 4);
+
+		if (memcmp(id, "fmt ", 4) == 0 && offset + 24 <= (size_t) n)
+		{
+			memcpy(header->subchunk1_id, buf + offset, 24);
+			if (offset + 8 + size <= (size_t) n)
+			{
+				header->audio_format = wav_format_tag(buf + offset + 8, size);
+			}
+			found_fmt = 1;
+		}
+		else if (memcmp(id, "data", 4) == 0)
+		{
+			memcpy(header->subchunk2_id, buf + offset, 8);
+			return found_fmt ? 0 : -1;
+		}
+
+		// Chunks are padded to an even size
+		offset += 8 + size + (size & 1);
+	}
+
+	return -1;
+}
+
+int
+validate_header(
+        char *file_path,
+        WAVHeader *header,
+        int verbose)
+{
+	// Sample Rate in Normal Range
+	if (header->sample_rate < 8000 && header->sample_rate > 192000)
+	{
+		fprintf(stderr, "%s file has sample rate outside the normal range\n", file_path);
+        return -1;
+	}
+
+	// Number of Channels
+	if (header->num_channels < 1 || header->num_channels > BQ_MAX_CHANNELS)
+	{
+		fprintf(stderr, "%s file has %d channels, only 1 to %d are supported\n",
+				file_path, header->num_channels, BQ_MAX_CHANNELS);
+        return -1;
+	}
+	
+	// Sample format
+	if (header->audio_format != WAV_FORMAT_PCM && header->audio_format != WAV_FORMAT_FLOAT)
+	{
+		fprintf(stderr, "%s file has unsupported format %#x\n", file_path,
+				header->audio_format);
+        return -1;
+	}
+
+	if (header->audio_format == WAV_FORMAT_FLOAT ?
+		!(header->bps == 32 || header->bps == 64) :
+		!(header->bps == 8 || header->bps == 16 || header->bps == 24 || header->bps == 32))
+	{
+		fprintf(stderr, "%s file has invalid BPS\n", file_path);
+        return -1;
+	}
+
+	if (verbose) { fprintf(stdout, "%s is a valid WAV file\n\r", file_path); }
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// audio_format values. An extensible header names one of the others
+// in its sub-format; the parsers below store that one instead.
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+typedef struct
+{
+    // RIFF Chunk
+	char chunk_id[4];
+	uint32_t chunk_size;
+	char format[4];
+
+    // FMT Subchunk
+	char subchunk1_id[4];
+	uint32_t subchunk1_size;
+	uint16_t audio_format;
+	uint16_t num_channels;
+	uint32_t sample_rate;
+	uint32_t byte_rate; // per sec
+	uint16_t block_align;
+	uint16_t bps;
+
+    // Data Subchunk
+	char subchunk2_id[4];
+	uint32_t subchunk2_size;
+} __attribute__((packed))
+WAVHeader;
+
+// Maps `file_path` and fills in `header`; *offset is left at the first
+// PCM byte. Returns -1 for a malformed file, -2 if it cannot be read
+// or the header is incomplete. *file_buf stays mapped either way.
+int
+read_file(
+        char *file_path,
+        WAVHeader *header,
+        size_t *file_size,
+        char **file_buf,
+        int *offset,
+        int verbose);
+
+// Quiet header probe for indexing: reads the start of an open file and
+// fills in `header` without mapping it. 0 on success, -1 if the file
+// is not a WAV file or the header is past the first WAV_PROBE_SIZE
+// bytes.
+#define WAV_PROBE_SIZE 4096
+
+int wav_probe(int fd, WAVHeader *header);
+
+// Checks the format is one the engine can play: 8 to 32-bit integer
+// or 32 and 64-bit float PCM. 0 if so.
+int
+validate_header(
+        char *file_path,
+        WAVHeader *header,
+        int verbose);
+
+#endif